@@ -2,9 +2,15 @@ LOCAL_PATH:= $(call my-dir)
 
 include $(CLEAR_VARS)
 LOCAL_MODULE:= libwebm
-LOCAL_SRC_FILES:= mkvparser.cpp \
+# mkvmuxer.cpp links the frame transform queue of mkvframetransform.cpp, which
+# runs on std::thread, so the library needs C++11.
+LOCAL_CPPFLAGS:= -std=c++11
+LOCAL_SRC_FILES:= mkvasyncwriter.cpp \
+                  mkvframetransform.cpp \
+                  mkvparser.cpp \
                   mkvreader.cpp \
                   mkvmuxer.cpp \
                   mkvmuxerutil.cpp \
-                  mkvwriter.cpp
+                  mkvwriter.cpp \
+                  webmcrc32.cpp
 include $(BUILD_STATIC_LIBRARY)
@@ -0,0 +1,475 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+
+#include "mkvasyncwriter.hpp"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <thread>
+
+namespace mkvmuxer {
+
+///////////////////////////////////////////////////////////////
+//
+// AsyncMkvWriter::Queue class
+
+// Ring of |length_| buffers shared by the caller's thread (producer) and the
+// I/O thread (consumer). The producer fills the entry at |head_| and publishes
+// it by advancing |head_|; the consumer writes out the entry at |tail_| and
+// releases it by advancing |tail_|. Neither index is ever written by more
+// than one thread, so no lock is taken on the data path. The mutex and
+// condition variable are only used to put a thread to sleep when the queue is
+// full or empty.
+class AsyncMkvWriter::Queue {
+ public:
+  Queue(IMkvWriter* writer, uint32 length, uint32 buffer_size);
+  ~Queue();
+
+  // Allocates the entries and starts the I/O thread. Returns true on success.
+  bool Init();
+
+  // Copies |length| bytes to the output at |position|. Returns 0 on success.
+  int32 Write(const uint8* data, uint32 length, int64 position);
+
+  // Queues an element start notification. Notifications are delivered to the
+  // destination writer before the data queued with or after them is written.
+  // Returns 0 on success.
+  int32 Notify(uint64 element_id, int64 position);
+
+  // Publishes the entry being filled, if any, and waits until the consumer
+  // has written out every published entry. Returns true if no write error
+  // occurred.
+  bool Flush();
+
+  // Flushes and stops the I/O thread. Returns true if no write error
+  // occurred.
+  bool Stop();
+
+  // Returns true if a write error occurred on the I/O thread.
+  bool error() const { return error_.load(std::memory_order_acquire); }
+
+ private:
+  struct Entry {
+    Entry()
+        : data(NULL),
+          length(0),
+          position(0),
+          notify_ids(NULL),
+          notify_positions(NULL),
+          notify_count(0),
+          notify_capacity(0) {}
+    ~Entry() {
+      delete[] data;
+      delete[] notify_ids;
+      delete[] notify_positions;
+    }
+
+    // Output data, |length| bytes of which are valid.
+    uint8* data;
+    uint32 length;
+
+    // Output position of the first byte of |data|.
+    int64 position;
+
+    // Element start notifications to deliver before |data| is written.
+    uint64* notify_ids;
+    int64* notify_positions;
+    int32 notify_count;
+    int32 notify_capacity;
+  };
+
+  // Returns the entry being filled by the producer, waiting for a free entry
+  // if there is none. |position| is the output position the entry starts at
+  // when a new one is started. Returns NULL if the I/O thread has stopped.
+  Entry* Current(int64 position);
+
+  // Publishes the entry being filled to the consumer.
+  void Publish();
+
+  // Writes out |entry| to |writer_|. Returns false on error.
+  bool Process(Entry* entry);
+
+  // Main function of the I/O thread.
+  void Run();
+
+  // Wakes up the other thread if it is waiting on |waiting|.
+  void Wake(const std::atomic<bool>& waiting);
+
+  IMkvWriter* const writer_;
+  const uint32 length_;
+  const uint32 buffer_size_;
+
+  Entry* entries_;
+
+  // Entry being filled by the producer, or NULL.
+  Entry* current_;
+
+  // Output position of |writer_|. Used by the consumer only.
+  int64 output_position_;
+
+  // Index of the next entry to publish. Written by the producer only.
+  std::atomic<uint32> head_;
+
+  // Index of the next entry to write out. Written by the consumer only.
+  std::atomic<uint32> tail_;
+
+  std::atomic<bool> error_;
+  std::atomic<bool> stop_;
+  std::atomic<bool> producer_waiting_;
+  std::atomic<bool> consumer_waiting_;
+
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  std::thread thread_;
+  bool running_;
+
+  LIBWEBM_DISALLOW_COPY_AND_ASSIGN(Queue);
+};
+
+AsyncMkvWriter::Queue::Queue(IMkvWriter* writer, uint32 length,
+                             uint32 buffer_size)
+    : writer_(writer),
+      length_(length),
+      buffer_size_(buffer_size),
+      entries_(NULL),
+      current_(NULL),
+      output_position_(0),
+      head_(0),
+      tail_(0),
+      error_(false),
+      stop_(false),
+      producer_waiting_(false),
+      consumer_waiting_(false),
+      running_(false) {}
+
+AsyncMkvWriter::Queue::~Queue() {
+  Stop();
+  delete[] entries_;
+}
+
+bool AsyncMkvWriter::Queue::Init() {
+  if (entries_ || length_ == 0 || buffer_size_ == 0)
+    return false;
+
+  entries_ = new (std::nothrow) Entry[length_];  // NOLINT
+  if (!entries_)
+    return false;
+
+  for (uint32 i = 0; i < length_; ++i) {
+    entries_[i].data = new (std::nothrow) uint8[buffer_size_];  // NOLINT
+    if (!entries_[i].data)
+      return false;
+  }
+
+  output_position_ = writer_->Position();
+
+  try {
+    thread_ = std::thread(&Queue::Run, this);
+  } catch (...) {
+    return false;
+  }
+  running_ = true;
+
+  return true;
+}
+
+int32 AsyncMkvWriter::Queue::Write(const uint8* data, uint32 length,
+                                   int64 position) {
+  while (length > 0) {
+    Entry* entry = current_;
+    if (entry && entry->position + entry->length != position) {
+      // Start a new entry at the new output position.
+      if (entry->length > 0 || entry->notify_count > 0) {
+        Publish();
+        entry = NULL;
+      } else {
+        entry->position = position;
+      }
+    }
+
+    if (!entry) {
+      entry = Current(position);
+      if (!entry)
+        return -1;
+    }
+
+    const uint32 space = buffer_size_ - entry->length;
+    const uint32 bytes = (length < space) ? length : space;
+    memcpy(entry->data + entry->length, data, bytes);
+    entry->length += bytes;
+    data += bytes;
+    length -= bytes;
+    position += bytes;
+
+    if (entry->length == buffer_size_)
+      Publish();
+  }
+
+  return 0;
+}
+
+int32 AsyncMkvWriter::Queue::Notify(uint64 element_id, int64 position) {
+  Entry* const entry = Current(position);
+  if (!entry)
+    return -1;
+
+  if (entry->notify_count >= entry->notify_capacity) {
+    const int32 new_capacity =
+        (entry->notify_capacity == 0) ? 8 : entry->notify_capacity * 2;
+
+    uint64* const ids = new (std::nothrow) uint64[new_capacity];  // NOLINT
+    int64* const positions =
+        new (std::nothrow) int64[new_capacity];  // NOLINT
+    if (!ids || !positions) {
+      delete[] ids;
+      delete[] positions;
+      return -1;
+    }
+
+    for (int32 i = 0; i < entry->notify_count; ++i) {
+      ids[i] = entry->notify_ids[i];
+      positions[i] = entry->notify_positions[i];
+    }
+
+    delete[] entry->notify_ids;
+    delete[] entry->notify_positions;
+    entry->notify_ids = ids;
+    entry->notify_positions = positions;
+    entry->notify_capacity = new_capacity;
+  }
+
+  entry->notify_ids[entry->notify_count] = element_id;
+  entry->notify_positions[entry->notify_count] = position;
+  ++entry->notify_count;
+
+  return 0;
+}
+
+bool AsyncMkvWriter::Queue::Flush() {
+  if (!running_)
+    return !error();
+
+  if (current_)
+    Publish();
+
+  const uint32 head = head_.load(std::memory_order_relaxed);
+  if (tail_.load(std::memory_order_acquire) != head) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    producer_waiting_.store(true);
+    while (tail_.load() != head)
+      cond_.wait(lock);
+    producer_waiting_.store(false);
+  }
+
+  return !error();
+}
+
+bool AsyncMkvWriter::Queue::Stop() {
+  if (!running_)
+    return !error();
+
+  const bool ok = Flush();
+
+  stop_.store(true);
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    cond_.notify_all();
+  }
+  thread_.join();
+  running_ = false;
+
+  return ok;
+}
+
+AsyncMkvWriter::Queue::Entry* AsyncMkvWriter::Queue::Current(int64 position) {
+  if (current_)
+    return current_;
+
+  if (!running_)
+    return NULL;
+
+  const uint32 head = head_.load(std::memory_order_relaxed);
+  if (head - tail_.load(std::memory_order_acquire) >= length_) {
+    // The queue is full; wait for the I/O thread to release an entry.
+    std::unique_lock<std::mutex> lock(mutex_);
+    producer_waiting_.store(true);
+    while (head - tail_.load() >= length_)
+      cond_.wait(lock);
+    producer_waiting_.store(false);
+  }
+
+  current_ = &entries_[head % length_];
+  current_->length = 0;
+  current_->position = position;
+  current_->notify_count = 0;
+
+  return current_;
+}
+
+void AsyncMkvWriter::Queue::Publish() {
+  current_ = NULL;
+  head_.store(head_.load(std::memory_order_relaxed) + 1);
+  Wake(consumer_waiting_);
+}
+
+bool AsyncMkvWriter::Queue::Process(Entry* entry) {
+  for (int32 i = 0; i < entry->notify_count; ++i)
+    writer_->ElementStartNotify(entry->notify_ids[i],
+                                entry->notify_positions[i]);
+
+  if (entry->length == 0)
+    return true;
+
+  if (output_position_ != entry->position) {
+    if (!writer_->Seekable() || writer_->Position(entry->position))
+      return false;
+  }
+
+  if (writer_->Write(entry->data, entry->length))
+    return false;
+
+  output_position_ = entry->position + entry->length;
+  return true;
+}
+
+void AsyncMkvWriter::Queue::Run() {
+  for (;;) {
+    const uint32 tail = tail_.load(std::memory_order_relaxed);
+
+    if (head_.load(std::memory_order_acquire) == tail) {
+      std::unique_lock<std::mutex> lock(mutex_);
+      consumer_waiting_.store(true);
+      while (head_.load() == tail && !stop_.load())
+        cond_.wait(lock);
+      consumer_waiting_.store(false);
+
+      if (head_.load() == tail)
+        return;  // Stopped and nothing left to write.
+    }
+
+    // Once an error occurred the remaining entries are dropped, but they are
+    // still released so the producer never waits forever.
+    Entry* const entry = &entries_[tail % length_];
+    if (!error() && !Process(entry))
+      error_.store(true, std::memory_order_release);
+
+    tail_.store(tail + 1);
+    Wake(producer_waiting_);
+  }
+}
+
+void AsyncMkvWriter::Queue::Wake(const std::atomic<bool>& waiting) {
+  // The waiting thread sets its flag before checking the queue indices with
+  // the mutex held, so taking the mutex here guarantees it either sees the
+  // updated index or is already waiting for the notification.
+  if (waiting.load()) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    cond_.notify_all();
+  }
+}
+
+///////////////////////////////////////////////////////////////
+//
+// AsyncMkvWriter class
+
+AsyncMkvWriter::AsyncMkvWriter(IMkvWriter* writer)
+    : writer_(writer),
+      seekable_(writer ? writer->Seekable() : false),
+      queue_length_(kDefaultQueueLength),
+      buffer_size_(kDefaultBufferSize),
+      position_(0),
+      queue_(NULL) {}
+
+AsyncMkvWriter::AsyncMkvWriter(IMkvWriter* writer, uint32 queue_length,
+                               uint32 buffer_size)
+    : writer_(writer),
+      seekable_(writer ? writer->Seekable() : false),
+      queue_length_(queue_length),
+      buffer_size_(buffer_size),
+      position_(0),
+      queue_(NULL) {}
+
+AsyncMkvWriter::~AsyncMkvWriter() { Close(); }
+
+bool AsyncMkvWriter::Init() {
+  if (!writer_ || queue_)
+    return false;
+
+  position_ = writer_->Position();
+
+  queue_ = new (std::nothrow)
+      Queue(writer_, queue_length_, buffer_size_);  // NOLINT
+  if (!queue_)
+    return false;
+
+  if (!queue_->Init()) {
+    delete queue_;
+    queue_ = NULL;
+    return false;
+  }
+
+  return true;
+}
+
+bool AsyncMkvWriter::Flush() {
+  if (!queue_)
+    return false;
+
+  return queue_->Flush();
+}
+
+bool AsyncMkvWriter::Close() {
+  if (!queue_)
+    return false;
+
+  const bool ok = queue_->Stop();
+  delete queue_;
+  queue_ = NULL;
+
+  return ok;
+}
+
+int32 AsyncMkvWriter::Write(const void* buffer, uint32 length) {
+  if (!queue_ || queue_->error())
+    return -1;
+
+  if (length == 0)
+    return 0;
+
+  if (buffer == NULL)
+    return -1;
+
+  if (queue_->Write(static_cast<const uint8*>(buffer), length, position_))
+    return -1;
+
+  position_ += length;
+  return 0;
+}
+
+int64 AsyncMkvWriter::Position() const { return position_; }
+
+int32 AsyncMkvWriter::Position(int64 position) {
+  if (!queue_ || !seekable_ || position < 0)
+    return -1;
+
+  // The seek itself is replayed by the I/O thread before the next write.
+  position_ = position;
+  return 0;
+}
+
+bool AsyncMkvWriter::Seekable() const { return seekable_; }
+
+void AsyncMkvWriter::ElementStartNotify(uint64 element_id, int64 position) {
+  if (queue_)
+    queue_->Notify(element_id, position);
+}
+
+}  // namespace mkvmuxer
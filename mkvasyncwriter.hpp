@@ -0,0 +1,86 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+
+#ifndef MKVASYNCWRITER_HPP
+#define MKVASYNCWRITER_HPP
+
+#include "mkvmuxer.hpp"
+#include "mkvmuxertypes.hpp"
+
+namespace mkvmuxer {
+
+// Implementation of the IMkvWriter interface that moves the output of another
+// writer onto a dedicated I/O thread. Data passed to Write() is copied into
+// fixed-size buffers that are handed to the I/O thread through a bounded
+// single-producer/single-consumer queue, so the calling thread only waits when
+// the queue is full. Position() reflects all data written and seeks made so
+// far, whether or not the destination writer has received them yet, and seeks
+// are replayed on the I/O thread in order. Write errors from the destination
+// writer are reported by the next call to Write(), Flush() or Close().
+//
+// All member functions must be called from the same thread. The destination
+// writer must not be used by any other thread until Close() returns.
+class AsyncMkvWriter : public IMkvWriter {
+ public:
+  // Default number of buffers in the queue.
+  static const uint32 kDefaultQueueLength = 64;
+
+  // Default size in bytes of each buffer.
+  static const uint32 kDefaultBufferSize = 256 * 1024;
+
+  // |writer| is the destination writer. Not owned by this class.
+  explicit AsyncMkvWriter(IMkvWriter* writer);
+
+  // |queue_length| buffers of |buffer_size| bytes each are allocated by
+  // Init(), which bounds the amount of data waiting to be written.
+  AsyncMkvWriter(IMkvWriter* writer, uint32 queue_length, uint32 buffer_size);
+
+  virtual ~AsyncMkvWriter();
+
+  // Allocates the queue and starts the I/O thread. Returns true on success.
+  bool Init();
+
+  // Blocks until all data written so far has been passed to the destination
+  // writer. Returns true if no write error occurred.
+  bool Flush();
+
+  // Flushes the queue and stops the I/O thread. The writer can not be used
+  // afterwards. Returns true if all data was written successfully.
+  bool Close();
+
+  // IMkvWriter interface
+  virtual int64 Position() const;
+  virtual int32 Position(int64 position);
+  virtual bool Seekable() const;
+  virtual int32 Write(const void* buffer, uint32 length);
+  virtual void ElementStartNotify(uint64 element_id, int64 position);
+
+ private:
+  // Queue and I/O thread state.
+  class Queue;
+
+  // Destination writer. Not owned by this class.
+  IMkvWriter* const writer_;
+
+  // Cached result of |writer_|->Seekable().
+  const bool seekable_;
+
+  const uint32 queue_length_;
+  const uint32 buffer_size_;
+
+  // Position of the next byte written, as seen by the caller.
+  int64 position_;
+
+  Queue* queue_;
+
+  LIBWEBM_DISALLOW_COPY_AND_ASSIGN(AsyncMkvWriter);
+};
+
+}  // end namespace mkvmuxer
+
+#endif  // MKVASYNCWRITER_HPP
@@ -0,0 +1,471 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+
+#include "mkvframetransform.hpp"
+
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <vector>
+
+namespace mkvmuxer {
+
+namespace {
+
+// Signal byte of an encrypted frame.
+const uint8 kEncryptedSignal = 0x01;
+
+// Size in bytes of an AES block.
+const uint64 kAesBlockSize = 16;
+
+inline uint8 MultiplyBy2(uint8 value) {
+  return static_cast<uint8>((value << 1) ^ ((value & 0x80) ? 0x1B : 0));
+}
+
+inline uint32 RotateRight8(uint32 value) {
+  return (value >> 8) | (value << 24);
+}
+
+// AES S-box and the encryption tables that combine SubBytes, ShiftRows and
+// MixColumns into four lookups per column and round. |encrypt[k]| is
+// |encrypt[0]| rotated right by k bytes.
+struct AesTables {
+  AesTables() {
+    // Walk the multiplicative group of GF(2^8) with the generator 3, so
+    // that |inverse| is the multiplicative inverse of |value| at each step.
+    uint8 value = 1;
+    uint8 inverse = 1;
+    do {
+      value = static_cast<uint8>(value ^ MultiplyBy2(value));
+      inverse = static_cast<uint8>(inverse ^ (inverse << 1));
+      inverse = static_cast<uint8>(inverse ^ (inverse << 2));
+      inverse = static_cast<uint8>(inverse ^ (inverse << 4));
+      if (inverse & 0x80)
+        inverse ^= 0x09;
+
+      const uint32 x = inverse;
+      const uint32 affine = x ^ ((x << 1) | (x >> 7)) ^ ((x << 2) | (x >> 6)) ^
+                            ((x << 3) | (x >> 5)) ^ ((x << 4) | (x >> 4));
+      sbox[value] = static_cast<uint8>((affine ^ 0x63) & 0xFF);
+    } while (value != 1);
+    sbox[0] = 0x63;
+
+    for (int i = 0; i < 256; ++i) {
+      const uint8 s = sbox[i];
+      const uint8 s2 = MultiplyBy2(s);
+      const uint8 s3 = static_cast<uint8>(s2 ^ s);
+      encrypt[0][i] = (static_cast<uint32>(s2) << 24) |
+                      (static_cast<uint32>(s) << 16) |
+                      (static_cast<uint32>(s) << 8) | s3;
+      for (int k = 1; k < 4; ++k)
+        encrypt[k][i] = RotateRight8(encrypt[k - 1][i]);
+    }
+  }
+
+  uint8 sbox[256];
+  uint32 encrypt[4][256];
+};
+
+const AesTables& GetAesTables() {
+  static const AesTables tables;
+  return tables;
+}
+
+inline uint32 LoadBigEndian32(const uint8* data) {
+  return (static_cast<uint32>(data[0]) << 24) |
+         (static_cast<uint32>(data[1]) << 16) |
+         (static_cast<uint32>(data[2]) << 8) | static_cast<uint32>(data[3]);
+}
+
+inline void StoreBigEndian32(uint32 value, uint8* data) {
+  data[0] = static_cast<uint8>(value >> 24);
+  data[1] = static_cast<uint8>(value >> 16);
+  data[2] = static_cast<uint8>(value >> 8);
+  data[3] = static_cast<uint8>(value);
+}
+
+inline void StoreBigEndian64(uint64 value, uint8* data) {
+  StoreBigEndian32(static_cast<uint32>(value >> 32), data);
+  StoreBigEndian32(static_cast<uint32>(value), data + 4);
+}
+
+// Applies SubBytes to each byte of |word|.
+inline uint32 SubWord(const uint8* sbox, uint32 word) {
+  return (static_cast<uint32>(sbox[word >> 24]) << 24) |
+         (static_cast<uint32>(sbox[(word >> 16) & 0xFF]) << 16) |
+         (static_cast<uint32>(sbox[(word >> 8) & 0xFF]) << 8) |
+         static_cast<uint32>(sbox[word & 0xFF]);
+}
+
+}  // namespace
+
+///////////////////////////////////////////////////////////////
+//
+// AesCtrFrameTransform Class
+
+AesCtrFrameTransform::AesCtrFrameTransform() : rounds_(0), initial_iv_(0) {
+  memset(round_keys_, 0, sizeof(round_keys_));
+}
+
+AesCtrFrameTransform::~AesCtrFrameTransform() {
+  memset(round_keys_, 0, sizeof(round_keys_));
+}
+
+bool AesCtrFrameTransform::Init(const uint8* key, uint64 key_length,
+                                uint64 initial_iv) {
+  if (!key || (key_length != 16 && key_length != 24 && key_length != 32))
+    return false;
+
+  const uint8* const sbox = GetAesTables().sbox;
+  const int32 key_words = static_cast<int32>(key_length / 4);
+  const int32 rounds = key_words + 6;
+  const int32 total_words = 4 * (rounds + 1);
+
+  for (int32 i = 0; i < key_words; ++i)
+    round_keys_[i] = LoadBigEndian32(key + 4 * i);
+
+  uint8 round_constant = 0x01;
+  for (int32 i = key_words; i < total_words; ++i) {
+    uint32 word = round_keys_[i - 1];
+    if (i % key_words == 0) {
+      word = SubWord(sbox, (word << 8) | (word >> 24)) ^
+             (static_cast<uint32>(round_constant) << 24);
+      round_constant = MultiplyBy2(round_constant);
+    } else if (key_words > 6 && i % key_words == 4) {
+      word = SubWord(sbox, word);
+    }
+    round_keys_[i] = round_keys_[i - key_words] ^ word;
+  }
+
+  rounds_ = rounds;
+  initial_iv_ = initial_iv;
+  return true;
+}
+
+uint64 AesCtrFrameTransform::MaxTransformedSize(uint64 length) const {
+  return length + kHeaderSize;
+}
+
+bool AesCtrFrameTransform::Transform(const uint8* input, uint64 length,
+                                     uint64 sequence, uint8* output,
+                                     uint64* output_length) const {
+  if (rounds_ == 0 || !output || !output_length || (!input && length > 0))
+    return false;
+
+  const uint64 iv = initial_iv_ + sequence;
+  output[0] = kEncryptedSignal;
+  StoreBigEndian64(iv, output + 1);
+
+  uint8 counter[kAesBlockSize];
+  uint8 key_stream[kAesBlockSize];
+  StoreBigEndian64(iv, counter);
+
+  uint8* const data = output + kHeaderSize;
+  uint64 block = 0;
+  for (uint64 offset = 0; offset < length; offset += kAesBlockSize) {
+    StoreBigEndian64(block++, counter + kIvSize);
+    EncryptBlock(counter, key_stream);
+
+    const uint64 remaining = length - offset;
+    const uint64 bytes = remaining < kAesBlockSize ? remaining : kAesBlockSize;
+    for (uint64 i = 0; i < bytes; ++i)
+      data[offset + i] = input[offset + i] ^ key_stream[i];
+  }
+
+  *output_length = length + kHeaderSize;
+  return true;
+}
+
+void AesCtrFrameTransform::EncryptBlock(const uint8* input,
+                                        uint8* output) const {
+  const AesTables& tables = GetAesTables();
+  const uint32(*const te)[256] = tables.encrypt;
+  const uint32* rk = round_keys_;
+
+  uint32 s0 = LoadBigEndian32(input) ^ rk[0];
+  uint32 s1 = LoadBigEndian32(input + 4) ^ rk[1];
+  uint32 s2 = LoadBigEndian32(input + 8) ^ rk[2];
+  uint32 s3 = LoadBigEndian32(input + 12) ^ rk[3];
+
+  for (int32 round = 1; round < rounds_; ++round) {
+    rk += 4;
+    const uint32 t0 = te[0][s0 >> 24] ^ te[1][(s1 >> 16) & 0xFF] ^
+                      te[2][(s2 >> 8) & 0xFF] ^ te[3][s3 & 0xFF] ^ rk[0];
+    const uint32 t1 = te[0][s1 >> 24] ^ te[1][(s2 >> 16) & 0xFF] ^
+                      te[2][(s3 >> 8) & 0xFF] ^ te[3][s0 & 0xFF] ^ rk[1];
+    const uint32 t2 = te[0][s2 >> 24] ^ te[1][(s3 >> 16) & 0xFF] ^
+                      te[2][(s0 >> 8) & 0xFF] ^ te[3][s1 & 0xFF] ^ rk[2];
+    const uint32 t3 = te[0][s3 >> 24] ^ te[1][(s0 >> 16) & 0xFF] ^
+                      te[2][(s1 >> 8) & 0xFF] ^ te[3][s2 & 0xFF] ^ rk[3];
+    s0 = t0;
+    s1 = t1;
+    s2 = t2;
+    s3 = t3;
+  }
+
+  // The last round has no MixColumns.
+  rk += 4;
+  const uint8* const sbox = tables.sbox;
+  const uint32 words[4] = {s0, s1, s2, s3};
+  for (int32 i = 0; i < 4; ++i) {
+    const uint32 word =
+        (static_cast<uint32>(sbox[words[i] >> 24]) << 24) |
+        (static_cast<uint32>(sbox[(words[(i + 1) & 3] >> 16) & 0xFF]) << 16) |
+        (static_cast<uint32>(sbox[(words[(i + 2) & 3] >> 8) & 0xFF]) << 8) |
+        static_cast<uint32>(sbox[words[(i + 3) & 3] & 0xFF]);
+    StoreBigEndian32(word ^ rk[i], output + 4 * i);
+  }
+}
+
+///////////////////////////////////////////////////////////////
+//
+// FrameTransformQueue::Pool class
+
+// Ring of |length_| slots. The caller's thread fills the slot at |tail_|, the
+// worker threads claim slots in order at |next_| and mark them done when the
+// frame is transformed, and the caller's thread takes frames out at |head_|
+// once they are done. Frames may finish out of order, but they always leave
+// the ring in the order they entered it. All indices and flags are guarded
+// by |mutex_|; the transforms run without holding it.
+class FrameTransformQueue::Pool {
+ public:
+  Pool(int32 num_threads, int32 length);
+  ~Pool();
+
+  // Allocates the slots and starts the worker threads. Returns true on
+  // success.
+  bool Init();
+
+  bool Push(Frame* frame, const IMkvFrameTransform* transform,
+            uint64 sequence);
+  bool Pop(bool wait, Frame** frame);
+  bool empty() const;
+  bool full() const;
+
+ private:
+  struct Slot {
+    Slot() : frame(NULL), transform(NULL), sequence(0), done(false),
+             ok(false) {}
+    ~Slot() { delete frame; }
+
+    // Frame to transform. Owned by the slot until it is popped.
+    Frame* frame;
+    const IMkvFrameTransform* transform;
+    uint64 sequence;
+
+    // Set when the transform has finished, and whether it succeeded.
+    bool done;
+    bool ok;
+  };
+
+  // Runs the transform of |slot|. Returns true on success.
+  static bool Process(const Slot& slot);
+
+  // Main function of the worker threads.
+  void Run();
+
+  const int32 num_threads_;
+  const uint64 length_;
+
+  Slot* slots_;
+
+  // Index of the next slot to pop, to transform and to push.
+  uint64 head_;
+  uint64 next_;
+  uint64 tail_;
+
+  bool stop_;
+
+  mutable std::mutex mutex_;
+
+  // Signaled when a slot is pushed and when the workers have to stop.
+  std::condition_variable work_cond_;
+
+  // Signaled when the transform of the slot at |head_| is done. Only the
+  // caller's thread waits on it.
+  std::condition_variable done_cond_;
+
+  std::vector<std::thread> threads_;
+
+  LIBWEBM_DISALLOW_COPY_AND_ASSIGN(Pool);
+};
+
+FrameTransformQueue::Pool::Pool(int32 num_threads, int32 length)
+    : num_threads_(num_threads),
+      length_(static_cast<uint64>(length)),
+      slots_(NULL),
+      head_(0),
+      next_(0),
+      tail_(0),
+      stop_(false) {}
+
+FrameTransformQueue::Pool::~Pool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  work_cond_.notify_all();
+  for (size_t i = 0; i < threads_.size(); ++i)
+    threads_[i].join();
+  delete[] slots_;
+}
+
+bool FrameTransformQueue::Pool::Init() {
+  if (slots_ || length_ == 0)
+    return false;
+
+  slots_ = new (std::nothrow) Slot[static_cast<size_t>(length_)];  // NOLINT
+  if (!slots_)
+    return false;
+
+  try {
+    for (int32 i = 0; i < num_threads_; ++i)
+      threads_.push_back(std::thread(&Pool::Run, this));
+  } catch (...) {
+    return false;
+  }
+
+  return true;
+}
+
+bool FrameTransformQueue::Pool::Push(Frame* frame,
+                                     const IMkvFrameTransform* transform,
+                                     uint64 sequence) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (tail_ - head_ == length_)
+    return false;
+
+  Slot& slot = slots_[tail_ % length_];
+  slot.frame = frame;
+  slot.transform = transform;
+  slot.sequence = sequence;
+  slot.done = false;
+  slot.ok = false;
+  ++tail_;
+
+  if (num_threads_ == 0) {
+    slot.ok = Process(slot);
+    slot.done = true;
+    ++next_;
+    return true;
+  }
+
+  lock.unlock();
+  work_cond_.notify_one();
+  return true;
+}
+
+bool FrameTransformQueue::Pool::Pop(bool wait, Frame** frame) {
+  *frame = NULL;
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (head_ == tail_)
+    return true;
+
+  Slot& slot = slots_[head_ % length_];
+  if (!slot.done) {
+    if (!wait)
+      return true;
+    while (!slot.done)
+      done_cond_.wait(lock);
+  }
+
+  ++head_;
+  const bool ok = slot.ok;
+  Frame* const popped = slot.frame;
+  slot.frame = NULL;
+  lock.unlock();
+
+  if (!ok) {
+    delete popped;
+    return false;
+  }
+
+  *frame = popped;
+  return true;
+}
+
+bool FrameTransformQueue::Pool::empty() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return head_ == tail_;
+}
+
+bool FrameTransformQueue::Pool::full() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return tail_ - head_ == length_;
+}
+
+bool FrameTransformQueue::Pool::Process(const Slot& slot) {
+  return !slot.transform ||
+         slot.frame->Transform(slot.transform, slot.sequence);
+}
+
+void FrameTransformQueue::Pool::Run() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  for (;;) {
+    while (!stop_ && next_ == tail_)
+      work_cond_.wait(lock);
+    if (stop_)
+      return;
+
+    const uint64 index = next_++;
+    Slot& slot = slots_[index % length_];
+    lock.unlock();
+
+    const bool ok = Process(slot);
+
+    lock.lock();
+    slot.ok = ok;
+    slot.done = true;
+    if (index == head_)
+      done_cond_.notify_one();
+  }
+}
+
+///////////////////////////////////////////////////////////////
+//
+// FrameTransformQueue Class
+
+FrameTransformQueue::FrameTransformQueue(int32 num_threads,
+                                         int32 queue_length)
+    : num_threads_(num_threads), queue_length_(queue_length), pool_(NULL) {}
+
+FrameTransformQueue::~FrameTransformQueue() { delete pool_; }
+
+bool FrameTransformQueue::Init() {
+  if (pool_ || num_threads_ < 0 || queue_length_ < 1)
+    return false;
+
+  pool_ = new (std::nothrow) Pool(num_threads_, queue_length_);  // NOLINT
+  return pool_ && pool_->Init();
+}
+
+bool FrameTransformQueue::Push(Frame* frame,
+                               const IMkvFrameTransform* transform,
+                               uint64 sequence) {
+  if (!pool_ || !frame) {
+    delete frame;
+    return false;
+  }
+  return pool_->Push(frame, transform, sequence);
+}
+
+bool FrameTransformQueue::Pop(bool wait, Frame** frame) {
+  if (!frame)
+    return false;
+  *frame = NULL;
+  return pool_ && pool_->Pop(wait, frame);
+}
+
+bool FrameTransformQueue::empty() const { return !pool_ || pool_->empty(); }
+
+bool FrameTransformQueue::full() const { return pool_ && pool_->full(); }
+
+}  // end namespace mkvmuxer
@@ -0,0 +1,120 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+
+#ifndef MKVFRAMETRANSFORM_HPP
+#define MKVFRAMETRANSFORM_HPP
+
+#include "mkvmuxer.hpp"
+#include "mkvmuxertypes.hpp"
+
+namespace mkvmuxer {
+
+///////////////////////////////////////////////////////////////
+// Frame transform that encrypts frames with AES in counter mode, as described
+// by a ContentEncoding element whose ContentEncAESSettings cipher mode is
+// |ContentEncAESSettings::kCTR|. Every frame is written in the WebM
+// encrypted frame format: a signal byte of 0x01, the 8 byte IV of the frame,
+// and the encrypted data. The counter block of the frame is the IV followed
+// by the 64 bit big-endian number of the 16 byte block, starting at 0.
+//
+// The IV of a frame is the initial IV passed to Init() plus the sequence
+// number of the frame, so the IVs never repeat within a segment. A transform
+// must not be shared by segments that use the same key.
+class AesCtrFrameTransform : public IMkvFrameTransform {
+ public:
+  // Size in bytes of the IV of a frame.
+  static const uint64 kIvSize = 8;
+
+  // Size in bytes of the signal byte and IV added to every frame.
+  static const uint64 kHeaderSize = 1 + kIvSize;
+
+  AesCtrFrameTransform();
+  virtual ~AesCtrFrameTransform();
+
+  // Sets the AES key to the |key_length| bytes of |key|, which must be 16, 24
+  // or 32, and the IV of the first frame to |initial_iv|. Returns true on
+  // success.
+  bool Init(const uint8* key, uint64 key_length, uint64 initial_iv);
+
+  // IMkvFrameTransform interface
+  virtual uint64 MaxTransformedSize(uint64 length) const;
+  virtual bool Transform(const uint8* input, uint64 length, uint64 sequence,
+                         uint8* output, uint64* output_length) const;
+
+ private:
+  // Maximum number of 32 bit words in the expanded key.
+  static const int32 kMaxRoundKeyWords = 4 * (14 + 1);
+
+  // Encrypts the 16 bytes at |input| into |output|.
+  void EncryptBlock(const uint8* input, uint8* output) const;
+
+  // Expanded key.
+  uint32 round_keys_[kMaxRoundKeyWords];
+
+  // Number of rounds; 0 until Init() succeeds.
+  int32 rounds_;
+
+  uint64 initial_iv_;
+
+  LIBWEBM_DISALLOW_COPY_AND_ASSIGN(AesCtrFrameTransform);
+};
+
+///////////////////////////////////////////////////////////////
+// Queue of frames that are transformed on a pool of worker threads and
+// handed back in the order they were pushed. Used by Segment to run the
+// transforms set by Segment::SetFrameTransform().
+//
+// Push() and Pop() must be called from the same thread.
+class FrameTransformQueue {
+ public:
+  // Default number of frames that can be in the queue.
+  static const int32 kDefaultQueueLength = 64;
+
+  // |num_threads| worker threads are started by Init(). With 0 threads the
+  // frames are transformed by Push().
+  FrameTransformQueue(int32 num_threads, int32 queue_length);
+  ~FrameTransformQueue();
+
+  // Allocates the queue and starts the worker threads. Returns true on
+  // success.
+  bool Init();
+
+  // Adds |frame| to the queue. The frame is transformed with |transform|
+  // using |sequence|, or handed back unchanged if |transform| is NULL. Takes
+  // ownership of |frame|. Returns false if the queue is full or on error.
+  bool Push(Frame* frame, const IMkvFrameTransform* transform,
+            uint64 sequence);
+
+  // Takes the oldest frame out of the queue once it has been transformed and
+  // stores it in |frame|; the caller owns the frame. If the oldest frame is
+  // still being transformed, waits for it when |wait| is true, otherwise
+  // stores NULL. Stores NULL if the queue is empty. Returns false if the
+  // transform of the frame failed.
+  bool Pop(bool wait, Frame** frame);
+
+  // Returns true if no frame is in the queue.
+  bool empty() const;
+
+  // Returns true if no more frames can be pushed until one is popped.
+  bool full() const;
+
+ private:
+  // Slots and worker thread state.
+  class Pool;
+
+  const int32 num_threads_;
+  const int32 queue_length_;
+
+  Pool* pool_;
+
+  LIBWEBM_DISALLOW_COPY_AND_ASSIGN(FrameTransformQueue);
+};
+
+}  // end namespace mkvmuxer
+
+#endif  // MKVFRAMETRANSFORM_HPP
@@ -9,17 +9,32 @@
 #include "mkvmuxer.hpp"
 
 #include <climits>
+#include <cmath>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <ctime>
 #include <new>
 
+#include "mkvframetransform.hpp"
 #include "mkvmuxerutil.hpp"
 #include "mkvparser.hpp"
 #include "mkvwriter.hpp"
 #include "webmids.hpp"
 
+// ChunkedCopy() lets the kernel copy the data when both ends are plain files.
+// Recognizing the file based reader and writer requires RTTI.
+#if defined(__linux__) && !defined(__ANDROID__) && defined(__GXX_RTTI)
+#define MKVMUXER_KERNEL_COPY
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <typeinfo>
+
+#include "mkvreader.hpp"
+#endif
+
 #ifdef _MSC_VER
 // Disable MSVC warnings that suggest making code non-portable.
 #pragma warning(disable : 4996)
@@ -28,6 +43,10 @@
 namespace mkvmuxer {
 
 namespace {
+// Tracks with numbers below this value are found through a table indexed by
+// the track number.
+const uint64 kMaxTrackNumberTableSize = 1024;
+
 // Deallocate the string designated by |dst|, and then copy the |src|
 // string to |dst|.  The caller owns both the |src| string and the
 // |dst| copy (hence the caller is responsible for eventually
@@ -55,6 +74,94 @@ bool StrCpy(const char* src, char** dst_ptr) {
   strcpy(dst, src);  // NOLINT
   return true;
 }
+
+// Returns a new frame holding a copy of the |length| bytes of |data|, or NULL
+// on failure. The caller owns the frame.
+Frame* NewFrame(const uint8* data, uint64 length, uint64 track_number,
+                uint64 timestamp, bool is_key, uint64 ingest_time) {
+  Frame* const frame = new (std::nothrow) Frame();  // NOLINT
+  if (frame == NULL || !frame->Init(data, length)) {
+    delete frame;
+    return NULL;
+  }
+  frame->set_track_number(track_number);
+  frame->set_timestamp(timestamp);
+  frame->set_is_key(is_key);
+  frame->set_ingest_time(ingest_time);
+  return frame;
+}
+
+// Returns a new copy of |frame| that was passed to the muxer at
+// |ingest_time|, or NULL on failure. The caller owns the copy.
+Frame* CopyFrame(const Frame& frame, uint64 ingest_time) {
+  Frame* const copy = new (std::nothrow) Frame();  // NOLINT
+  if (copy == NULL || !copy->CopyFrom(frame)) {
+    delete copy;
+    return NULL;
+  }
+  copy->set_ingest_time(ingest_time);
+  return copy;
+}
+
+#ifdef MKVMUXER_KERNEL_COPY
+// Copies |size| bytes starting at |start| in |source| to the current position
+// of |dst| without passing the data through user space. Uses copy_file_range()
+// and falls back to sendfile() when the kernel or file system does not support
+// it. Returns the number of bytes copied, which is less than |size| when
+// neither call could copy the rest, or -1 on error.
+int64 KernelCopy(FILE* source, FILE* dst, int64 start, int64 size) {
+  // Pass the data buffered in |dst| to the kernel first.
+  if (fflush(dst))
+    return -1;
+
+  const int in_fd = fileno(source);
+  const int out_fd = fileno(dst);
+  const off_t out_start = ftello(dst);
+  if (in_fd < 0 || out_fd < 0 || out_start < 0)
+    return -1;
+
+  const int64 kMaxChunkSize = 1 << 30;
+  off_t in_offset = start;
+  int64 copied = 0;
+
+#ifdef SYS_copy_file_range
+  off_t out_offset = out_start;
+  while (copied < size) {
+    const int64 chunk = size - copied;
+    const long result = syscall(  // NOLINT
+        SYS_copy_file_range, in_fd, &in_offset, out_fd, &out_offset,
+        static_cast<size_t>(chunk < kMaxChunkSize ? chunk : kMaxChunkSize), 0);
+    if (result <= 0)
+      break;
+    copied += result;
+  }
+#endif
+
+  if (copied < size) {
+    // sendfile() writes at the file offset of |out_fd|.
+    if (lseek(out_fd, out_start + copied, SEEK_SET) < 0)
+      return -1;
+
+    in_offset = start + copied;
+    while (copied < size) {
+      const int64 chunk = size - copied;
+      const ssize_t result =
+          sendfile(out_fd, in_fd, &in_offset,
+                   static_cast<size_t>(chunk < kMaxChunkSize ? chunk
+                                                             : kMaxChunkSize));
+      if (result <= 0)
+        break;
+      copied += result;
+    }
+  }
+
+  // Bring the stream position of |dst| past the copied data.
+  if (fseeko(dst, out_start + copied, SEEK_SET))
+    return -1;
+
+  return copied;
+}
+#endif
 }  // namespace
 
 ///////////////////////////////////////////////////////////////
@@ -65,6 +172,30 @@ IMkvWriter::IMkvWriter() {}
 
 IMkvWriter::~IMkvWriter() {}
 
+///////////////////////////////////////////////////////////////
+//
+// IMkvChunkSink Class
+
+IMkvChunkSink::IMkvChunkSink() {}
+
+IMkvChunkSink::~IMkvChunkSink() {}
+
+///////////////////////////////////////////////////////////////
+//
+// IMkvFrameTransform Class
+
+IMkvFrameTransform::IMkvFrameTransform() {}
+
+IMkvFrameTransform::~IMkvFrameTransform() {}
+
+///////////////////////////////////////////////////////////////
+//
+// IMkvFlushCallback Class
+
+IMkvFlushCallback::IMkvFlushCallback() {}
+
+IMkvFlushCallback::~IMkvFlushCallback() {}
+
 bool WriteEbmlHeader(IMkvWriter* writer, uint64 doc_type_version) {
   // Level 0
   uint64 size = EbmlElementSize(kMkvEBMLVersion, 1ULL);
@@ -101,20 +232,60 @@ bool WriteEbmlHeader(IMkvWriter* writer) {
 
 bool ChunkedCopy(mkvparser::IMkvReader* source, mkvmuxer::IMkvWriter* dst,
                  mkvmuxer::int64 start, int64 size) {
-  // TODO(vigneshv): Check if this is a reasonable value.
-  const uint32 kBufSize = 2048;
-  uint8* buf = new uint8[kBufSize];
+  if (!source || !dst || start < 0 || size < 0)
+    return false;
+
+#ifdef MKVMUXER_KERNEL_COPY
+  // Only the exact types are known to read and write the files directly.
+  if (typeid(*source) == typeid(mkvparser::MkvReader) &&
+      typeid(*dst) == typeid(MkvWriter)) {
+    MkvWriter* const writer = static_cast<MkvWriter*>(dst);
+    FILE* const in_file = static_cast<mkvparser::MkvReader*>(source)->file();
+    FILE* const out_file = writer->file();
+    if (in_file && out_file) {
+      // Copy at most one write back interval at a time, so the copied data is
+      // written back as if it had gone through Write().
+      const int64 interval = writer->writeback_interval();
+      while (size > 0) {
+        const int64 piece = (interval > 0 && interval < size) ? interval : size;
+        const int64 copied = KernelCopy(in_file, out_file, start, piece);
+        if (copied < 0 || !writer->AddWrittenBytes(copied))
+          return false;
+        start += copied;
+        size -= copied;
+        if (copied < piece)
+          break;
+      }
+    }
+  }
+#endif
+
+  if (size == 0)
+    return true;
+
+  // Copy whatever is left through a buffer large enough to keep the number of
+  // Read and Write calls low.
+  const int64 kMaxBufSize = 1024 * 1024;
+  const int64 buf_size = (size < kMaxBufSize) ? size : kMaxBufSize;
+  uint8* const buf = new (std::nothrow) uint8[buf_size];  // NOLINT
+  if (!buf)
+    return false;
+
+  bool ok = true;
   int64 offset = start;
   while (size > 0) {
-    const int64 read_len = (size > kBufSize) ? kBufSize : size;
-    if (source->Read(offset, static_cast<long>(read_len), buf))
-      return false;
-    dst->Write(buf, static_cast<uint32>(read_len));
+    const int64 read_len = (size > buf_size) ? buf_size : size;
+    if (source->Read(offset, static_cast<long>(read_len), buf) ||
+        dst->Write(buf, static_cast<uint32>(read_len))) {
+      ok = false;
+      break;
+    }
     offset += read_len;
     size -= read_len;
   }
+
   delete[] buf;
-  return true;
+  return ok;
 }
 
 ///////////////////////////////////////////////////////////////
@@ -129,9 +300,12 @@ Frame::Frame()
       frame_(NULL),
       is_key_(false),
       length_(0),
+      passthrough_reader_(NULL),
+      passthrough_position_(0),
       track_number_(0),
       timestamp_(0),
-      discard_padding_(0) {}
+      discard_padding_(0),
+      ingest_time_(0) {}
 
 Frame::~Frame() {
   delete[] frame_;
@@ -147,6 +321,7 @@ bool Frame::Init(const uint8* frame, uint64 length) {
   delete[] frame_;
   frame_ = data;
   length_ = length;
+  passthrough_reader_ = NULL;
 
   memcpy(frame_, frame, static_cast<size_t>(length_));
   return true;
@@ -168,89 +343,512 @@ bool Frame::AddAdditionalData(const uint8* additional, uint64 length,
   return true;
 }
 
+bool Frame::InitPassthrough(mkvparser::IMkvReader* reader, int64 position,
+                            uint64 size) {
+  if (!reader || position < 0 || size == 0)
+    return false;
+
+  delete[] frame_;
+  frame_ = NULL;
+  length_ = size;
+  passthrough_reader_ = reader;
+  passthrough_position_ = position;
+  return true;
+}
+
+bool Frame::CopyFrom(const Frame& frame) {
+  if (frame.passthrough_reader()) {
+    if (!InitPassthrough(frame.passthrough_reader(),
+                         frame.passthrough_position(), frame.length()))
+      return false;
+  } else if (!frame.frame() || !Init(frame.frame(), frame.length())) {
+    return false;
+  }
+
+  if (frame.additional() &&
+      !AddAdditionalData(frame.additional(), frame.additional_length(),
+                         frame.add_id()))
+    return false;
+
+  duration_ = frame.duration();
+  is_key_ = frame.is_key();
+  track_number_ = frame.track_number();
+  timestamp_ = frame.timestamp();
+  discard_padding_ = frame.discard_padding();
+  ingest_time_ = frame.ingest_time();
+  return true;
+}
+
+bool Frame::Transform(const IMkvFrameTransform* transform, uint64 sequence) {
+  if (!transform || !frame_)
+    return false;
+
+  const uint64 max_length = transform->MaxTransformedSize(length_);
+  uint8* const data =
+      new (std::nothrow) uint8[static_cast<size_t>(max_length)];  // NOLINT
+  if (!data)
+    return false;
+
+  uint64 length = 0;
+  if (!transform->Transform(frame_, length_, sequence, data, &length) ||
+      length > max_length) {
+    delete[] data;
+    return false;
+  }
+
+  delete[] frame_;
+  frame_ = data;
+  length_ = length;
+  return true;
+}
+
+///////////////////////////////////////////////////////////////
+//
+// LatencyHistogram Class
+
+LatencyHistogram::LatencyHistogram() { Reset(); }
+
+void LatencyHistogram::Add(uint64 latency_ns) {
+  uint64 latency_us = latency_ns / 1000;
+  int32 bucket = 0;
+  while (latency_us > 0 && bucket < kNumBuckets - 1) {
+    latency_us >>= 1;
+    ++bucket;
+  }
+
+  ++buckets_[bucket];
+  ++count_;
+  total_ns_ += latency_ns;
+  if (latency_ns > max_ns_)
+    max_ns_ = latency_ns;
+}
+
+void LatencyHistogram::Reset() {
+  for (int32 i = 0; i < kNumBuckets; ++i)
+    buckets_[i] = 0;
+  count_ = 0;
+  max_ns_ = 0;
+  total_ns_ = 0;
+}
+
+uint64 LatencyHistogram::Percentile(double percentile) const {
+  if (count_ == 0)
+    return 0;
+
+  if (percentile < 0.0)
+    percentile = 0.0;
+  else if (percentile > 100.0)
+    percentile = 100.0;
+
+  uint64 target = static_cast<uint64>(ceil(percentile / 100.0 * count_));
+  if (target < 1)
+    target = 1;
+
+  uint64 samples = 0;
+  for (int32 i = 0; i < kNumBuckets; ++i) {
+    samples += buckets_[i];
+    if (samples >= target) {
+      const uint64 limit = BucketLimit(i);
+      return (limit < max_ns_) ? limit : max_ns_;
+    }
+  }
+
+  return max_ns_;
+}
+
+uint64 LatencyHistogram::BucketLimit(int32 bucket) {
+  return (1ULL << bucket) * 1000;
+}
+
+///////////////////////////////////////////////////////////////
+//
+// MuxerStatistics Class
+
+MuxerStatistics::MuxerStatistics()
+    : tracks_(NULL), track_count_(0), tracks_capacity_(0) {
+  Reset();
+}
+
+MuxerStatistics::~MuxerStatistics() { delete[] tracks_; }
+
+void MuxerStatistics::Reset() {
+  clusters_ = 0;
+  for (int32 i = 0; i < kNumClusterReasons; ++i)
+    cluster_counts_[i] = 0;
+  largest_cluster_size_ = 0;
+  track_count_ = 0;
+  for (int32 i = 0; i < kNumElements; ++i)
+    element_bytes_[i] = 0;
+  bytes_written_ = 0;
+  bytes_rewritten_ = 0;
+  writes_ = 0;
+  seeks_ = 0;
+  max_audio_queue_depth_ = 0;
+  for (int32 i = 0; i < kNumFinalizePhases; ++i)
+    finalize_ns_[i] = 0;
+}
+
+void MuxerStatistics::AddCluster(ClusterReason reason) {
+  ++clusters_;
+  ++cluster_counts_[reason];
+}
+
+void MuxerStatistics::AddClosedCluster(uint64 size) {
+  if (size > largest_cluster_size_)
+    largest_cluster_size_ = size;
+}
+
+bool MuxerStatistics::AddBlock(uint64 track_number, int32 frames,
+                               uint64 size) {
+  TrackCounts* counts = NULL;
+  for (int32 i = 0; i < track_count_ && !counts; ++i) {
+    if (tracks_[i].track_number == track_number)
+      counts = &tracks_[i];
+  }
+
+  if (!counts) {
+    if (track_count_ + 1 > tracks_capacity_) {
+      const int32 new_capacity =
+          (tracks_capacity_ <= 0) ? 2 : tracks_capacity_ * 2;
+      TrackCounts* const tracks =
+          new (std::nothrow) TrackCounts[new_capacity];  // NOLINT
+      if (!tracks)
+        return false;
+
+      for (int32 i = 0; i < track_count_; ++i)
+        tracks[i] = tracks_[i];
+
+      delete[] tracks_;
+      tracks_ = tracks;
+      tracks_capacity_ = new_capacity;
+    }
+
+    counts = &tracks_[track_count_++];
+    counts->track_number = track_number;
+    counts->blocks = 0;
+    counts->frames = 0;
+    counts->bytes = 0;
+  }
+
+  ++counts->blocks;
+  counts->frames += frames;
+  counts->bytes += size;
+  return true;
+}
+
+void MuxerStatistics::AddWrite(Element element, uint64 length,
+                               uint64 rewritten) {
+  ++writes_;
+  element_bytes_[element] += length;
+  bytes_written_ += length;
+  bytes_rewritten_ += rewritten;
+}
+
+void MuxerStatistics::UpdateAudioQueueDepth(int32 depth) {
+  if (depth > max_audio_queue_depth_)
+    max_audio_queue_depth_ = depth;
+}
+
+void MuxerStatistics::AddFinalizeTime(FinalizePhase phase, uint64 time_ns) {
+  finalize_ns_[phase] += time_ns;
+}
+
+MuxerStatistics::Element MuxerStatistics::GetElement(uint64 element_id) {
+  switch (element_id) {
+    case kMkvEBML:
+      return kEbmlHeaderElement;
+    case kMkvSegment:
+      return kSegmentElement;
+    case kMkvSeekHead:
+      return kSeekHeadElement;
+    case kMkvInfo:
+      return kInfoElement;
+    case kMkvTracks:
+      return kTracksElement;
+    case kMkvChapters:
+      return kChaptersElement;
+    case kMkvCluster:
+      return kClusterElement;
+    case kMkvCues:
+      return kCuesElement;
+    case kMkvVoid:
+      return kVoidElement;
+    default:
+      return kNumElements;
+  }
+}
+
+const MuxerStatistics::TrackCounts* MuxerStatistics::GetTrack(
+    uint64 track_number) const {
+  for (int32 i = 0; i < track_count_; ++i) {
+    if (tracks_[i].track_number == track_number)
+      return &tracks_[i];
+  }
+  return NULL;
+}
+
 ///////////////////////////////////////////////////////////////
 //
 // CuePoint Class
 
 CuePoint::CuePoint()
     : time_(0),
-      track_(0),
-      cluster_pos_(0),
-      block_number_(1),
-      output_block_number_(true) {}
+      extra_positions_(NULL),
+      extra_positions_size_(0),
+      output_block_number_(true),
+      size_(0) {
+  position_.track = 0;
+  position_.cluster_pos = 0;
+  position_.block_number = 1;
+}
 
-CuePoint::~CuePoint() {}
+CuePoint::~CuePoint() { delete[] extra_positions_; }
 
 bool CuePoint::Write(IMkvWriter* writer) const {
-  if (!writer || track_ < 1 || cluster_pos_ < 1)
+  if (!writer)
     return false;
 
-  uint64 size = EbmlElementSize(kMkvCueClusterPosition, cluster_pos_);
-  size += EbmlElementSize(kMkvCueTrack, track_);
-  if (output_block_number_ && block_number_ > 1)
-    size += EbmlElementSize(kMkvCueBlockNumber, block_number_);
-  const uint64 track_pos_size =
-      EbmlMasterElementSize(kMkvCueTrackPositions, size) + size;
-  const uint64 payload_size =
-      EbmlElementSize(kMkvCueTime, time_) + track_pos_size;
+  for (int32 i = 0; i < track_positions_size(); ++i) {
+    const TrackPosition* const track_position = GetTrackPosition(i);
+    if (track_position->track < 1 || track_position->cluster_pos < 1)
+      return false;
+  }
 
-  if (!WriteEbmlMasterElement(writer, kMkvCuePoint, payload_size))
-    return false;
+  const uint64 payload_size = PayloadSize();
 
-  const int64 payload_position = writer->Position();
-  if (payload_position < 0)
-    return false;
+  // The CuePoint is assembled in |buffer| and output with one write, unless
+  // it has more CueTrackPositions elements than fit in |buffer|.
+  const int32 kMaxTrackPositionSize =
+      kMaxMasterElementHeaderSize + 3 * kMaxUIntElementSize;
+  uint8 buffer[kMaxMasterElementHeaderSize + kMaxUIntElementSize +
+               4 * kMaxTrackPositionSize];
 
-  if (!WriteEbmlElement(writer, kMkvCueTime, time_))
+  int64 position = writer->Position();
+  if (position < 0)
     return false;
 
-  if (!WriteEbmlMasterElement(writer, kMkvCueTrackPositions, size))
-    return false;
-  if (!WriteEbmlElement(writer, kMkvCueTrack, track_))
+  int32 pos = PutEbmlMasterElement<kMkvCuePoint>(buffer, payload_size);
+  writer->ElementStartNotify(kMkvCuePoint, position);
+  writer->ElementStartNotify(kMkvCueTime, position + pos);
+  uint64 payload_bytes = PutEbmlElement<kMkvCueTime>(buffer + pos, time_);
+  pos += static_cast<int32>(payload_bytes);
+
+  for (int32 i = 0; i < track_positions_size(); ++i) {
+    if (pos + kMaxTrackPositionSize > static_cast<int32>(sizeof(buffer))) {
+      if (writer->Write(buffer, pos))
+        return false;
+      position += pos;
+      pos = 0;
+    }
+
+    const TrackPosition& track_position = *GetTrackPosition(i);
+    const bool write_block_number =
+        output_block_number_ && track_position.block_number > 1;
+    const int32 start = pos;
+
+    writer->ElementStartNotify(kMkvCueTrackPositions, position + pos);
+    pos += PutEbmlMasterElement<kMkvCueTrackPositions>(
+        buffer + pos, TrackPositionPayloadSize(track_position));
+    writer->ElementStartNotify(kMkvCueTrack, position + pos);
+    pos += PutEbmlElement<kMkvCueTrack>(buffer + pos, track_position.track);
+    writer->ElementStartNotify(kMkvCueClusterPosition, position + pos);
+    pos += PutEbmlElement<kMkvCueClusterPosition>(buffer + pos,
+                                                  track_position.cluster_pos);
+    if (write_block_number) {
+      writer->ElementStartNotify(kMkvCueBlockNumber, position + pos);
+      pos += PutEbmlElement<kMkvCueBlockNumber>(buffer + pos,
+                                                track_position.block_number);
+    }
+    payload_bytes += pos - start;
+  }
+
+  if (payload_bytes != payload_size)
     return false;
-  if (!WriteEbmlElement(writer, kMkvCueClusterPosition, cluster_pos_))
+
+  if (writer->Write(buffer, pos))
     return false;
-  if (output_block_number_ && block_number_ > 1)
-    if (!WriteEbmlElement(writer, kMkvCueBlockNumber, block_number_))
-      return false;
 
-  const int64 stop_position = writer->Position();
-  if (stop_position < 0)
+  return true;
+}
+
+bool CuePoint::AddTrackPosition(uint64 track, uint64 cluster_pos,
+                                uint64 block_number) {
+  if (track < 1 || HasTrack(track))
     return false;
 
-  if (stop_position - payload_position != static_cast<int64>(payload_size))
+  TrackPosition* const positions =
+      new (std::nothrow) TrackPosition[extra_positions_size_ + 1];  // NOLINT
+  if (!positions)
     return false;
 
+  for (int32 i = 0; i < extra_positions_size_; ++i)
+    positions[i] = extra_positions_[i];
+
+  delete[] extra_positions_;
+  extra_positions_ = positions;
+
+  TrackPosition& track_position = extra_positions_[extra_positions_size_++];
+  track_position.track = track;
+  track_position.cluster_pos = cluster_pos;
+  track_position.block_number = block_number;
+  size_ = 0;
   return true;
 }
 
+bool CuePoint::HasTrack(uint64 track) const {
+  for (int32 i = 0; i < track_positions_size(); ++i) {
+    if (GetTrackPosition(i)->track == track)
+      return true;
+  }
+  return false;
+}
+
+void CuePoint::ShiftClusterPositions(uint64 offset) {
+  position_.cluster_pos += offset;
+  for (int32 i = 0; i < extra_positions_size_; ++i)
+    extra_positions_[i].cluster_pos += offset;
+  size_ = 0;
+}
+
+const CuePoint::TrackPosition* CuePoint::GetTrackPosition(int32 index) const {
+  if (index < 0 || index > extra_positions_size_)
+    return NULL;
+
+  return index == 0 ? &position_ : &extra_positions_[index - 1];
+}
+
+uint64 CuePoint::TrackPositionPayloadSize(
+    const TrackPosition& position) const {
+  uint64 size = EbmlElementSize(kMkvCueClusterPosition, position.cluster_pos);
+  size += EbmlElementSize(kMkvCueTrack, position.track);
+  if (output_block_number_ && position.block_number > 1)
+    size += EbmlElementSize(kMkvCueBlockNumber, position.block_number);
+  return size;
+}
+
 uint64 CuePoint::PayloadSize() const {
-  uint64 size = EbmlElementSize(kMkvCueClusterPosition, cluster_pos_);
-  size += EbmlElementSize(kMkvCueTrack, track_);
-  if (output_block_number_ && block_number_ > 1)
-    size += EbmlElementSize(kMkvCueBlockNumber, block_number_);
-  const uint64 track_pos_size =
-      EbmlMasterElementSize(kMkvCueTrackPositions, size) + size;
-  const uint64 payload_size =
-      EbmlElementSize(kMkvCueTime, time_) + track_pos_size;
+  uint64 payload_size = EbmlElementSize(kMkvCueTime, time_);
+  for (int32 i = 0; i < track_positions_size(); ++i) {
+    const uint64 size = TrackPositionPayloadSize(*GetTrackPosition(i));
+    payload_size += EbmlMasterElementSize(kMkvCueTrackPositions, size) + size;
+  }
 
   return payload_size;
 }
 
 uint64 CuePoint::Size() const {
-  const uint64 payload_size = PayloadSize();
-  return EbmlMasterElementSize(kMkvCuePoint, payload_size) + payload_size;
+  if (size_ == 0) {
+    const uint64 payload_size = PayloadSize();
+    size_ = EbmlMasterElementSize(kMkvCuePoint, payload_size) + payload_size;
+  }
+  return size_;
 }
 
 ///////////////////////////////////////////////////////////////
 //
 // Cues Class
 
+// Cue points are spilled as one fixed-size record per CueTrackPositions
+// element, in the byte order of the machine. The first record of a cue point
+// holds the number of records of the cue point, the others hold 0.
+class Cues::SpillFile {
+ public:
+  SpillFile() : file_(NULL) {}
+  ~SpillFile() {
+    if (file_)
+      fclose(file_);
+  }
+
+  // Creates the temporary file. Returns true on success.
+  bool Init() {
+    file_ = tmpfile();
+    return file_ != NULL;
+  }
+
+  // Appends the records of |cue|, with |offset| subtracted from the cluster
+  // positions. Returns true on success.
+  bool Append(const CuePoint& cue, uint64 offset);
+
+  // Starts reading the cue points from the first one. Returns true on
+  // success.
+  bool Rewind() { return fseek(file_, 0, SEEK_SET) == 0; }
+
+  // Reads the next cue point into |cue|, which must have no track positions
+  // added, with |offset| added to the cluster positions. Returns true on
+  // success.
+  bool Read(uint64 offset, CuePoint* cue);
+
+ private:
+  struct Record {
+    uint64 time;
+    uint64 cluster_pos;
+    uint64 block_number;
+    uint64 track;
+    uint32 positions;
+  };
+
+  FILE* file_;
+};
+
+bool Cues::SpillFile::Append(const CuePoint& cue, uint64 offset) {
+  // Reads may have moved the file position since the last append.
+  if (fseek(file_, 0, SEEK_END))
+    return false;
+
+  for (int32 i = 0; i < cue.track_positions_size(); ++i) {
+    const CuePoint::TrackPosition* const position = cue.GetTrackPosition(i);
+    if (position->cluster_pos < offset)
+      return false;
+
+    Record record;
+    record.time = cue.time();
+    record.cluster_pos = position->cluster_pos - offset;
+    // A block number of 1 is never written, so it also stands for block
+    // numbers that are not output.
+    record.block_number =
+        cue.output_block_number() ? position->block_number : 1;
+    record.track = position->track;
+    record.positions =
+        i == 0 ? static_cast<uint32>(cue.track_positions_size()) : 0;
+    if (fwrite(&record, sizeof(record), 1, file_) != 1)
+      return false;
+  }
+
+  return true;
+}
+
+bool Cues::SpillFile::Read(uint64 offset, CuePoint* cue) {
+  Record record;
+  if (fread(&record, sizeof(record), 1, file_) != 1 || record.positions < 1)
+    return false;
+
+  cue->set_time(record.time);
+  cue->set_track(record.track);
+  cue->set_cluster_pos(record.cluster_pos + offset);
+  cue->set_block_number(record.block_number);
+
+  for (uint32 i = 1; i < record.positions; ++i) {
+    if (fread(&record, sizeof(record), 1, file_) != 1 ||
+        record.positions != 0 ||
+        !cue->AddTrackPosition(record.track, record.cluster_pos + offset,
+                               record.block_number))
+      return false;
+  }
+
+  return true;
+}
+
 Cues::Cues()
     : cue_entries_capacity_(0),
       cue_entries_size_(0),
       cue_entries_(NULL),
-      output_block_number_(true) {}
+      payload_size_(0),
+      spill_threshold_(0),
+      spilled_size_(0),
+      spill_file_(NULL),
+      spilled_offset_(0),
+      output_block_number_(true),
+      output_crc32_(false) {}
 
 Cues::~Cues() {
   if (cue_entries_) {
@@ -260,12 +858,19 @@ Cues::~Cues() {
     }
     delete[] cue_entries_;
   }
+  delete spill_file_;
 }
 
 bool Cues::AddCue(CuePoint* cue) {
   if (!cue)
     return false;
 
+  // The cue points before |cue| can no longer get track positions from the
+  // muxer, so they are all spilled at once.
+  if (spill_threshold_ > 0 && cue_entries_size_ >= spill_threshold_ &&
+      !SpillCuePoints())
+    return false;
+
   if ((cue_entries_size_ + 1) > cue_entries_capacity_) {
     // Add more CuePoints.
     const int32 new_capacity =
@@ -291,6 +896,7 @@ bool Cues::AddCue(CuePoint* cue) {
 
   cue->set_output_block_number(output_block_number_);
   cue_entries_[cue_entries_size_++] = cue;
+  payload_size_ += cue->Size();
   return true;
 }
 
@@ -298,34 +904,70 @@ CuePoint* Cues::GetCueByIndex(int32 index) const {
   if (cue_entries_ == NULL)
     return NULL;
 
-  if (index >= cue_entries_size_)
+  index -= spilled_size_;
+  if (index < 0 || index >= cue_entries_size_)
     return NULL;
 
   return cue_entries_[index];
 }
 
-uint64 Cues::Size() {
-  uint64 size = 0;
-  for (int32 i = 0; i < cue_entries_size_; ++i)
-    size += GetCueByIndex(i)->Size();
-  size += EbmlMasterElementSize(kMkvCues, size);
-  return size;
-}
+bool Cues::AddTrackPosition(int32 index, uint64 track, uint64 cluster_pos,
+                            uint64 block_number) {
+  CuePoint* const cue = GetCueByIndex(index);
+  if (!cue)
+    return false;
 
-bool Cues::Write(IMkvWriter* writer) const {
-  if (!writer)
+  const uint64 old_size = cue->Size();
+  if (!cue->AddTrackPosition(track, cluster_pos, block_number))
     return false;
 
-  uint64 size = 0;
-  for (int32 i = 0; i < cue_entries_size_; ++i) {
-    const CuePoint* const cue = GetCueByIndex(i);
+  payload_size_ += cue->Size() - old_size;
+  return true;
+}
+
+bool Cues::ShiftClusterPositions(uint64 offset) {
+  uint64 payload_size = 0;
+  spilled_offset_ += offset;
+  if (spilled_size_ > 0) {
+    if (!spill_file_->Rewind())
+      return false;
+
+    for (int32 i = 0; i < spilled_size_; ++i) {
+      CuePoint cue;
+      if (!spill_file_->Read(spilled_offset_, &cue))
+        return false;
+      payload_size += cue.Size();
+    }
+  }
 
+  for (int32 i = 0; i < cue_entries_size_; ++i) {
+    CuePoint* const cue = cue_entries_[i];
     if (!cue)
       return false;
 
-    size += cue->Size();
+    cue->ShiftClusterPositions(offset);
+    payload_size += cue->Size();
   }
 
+  payload_size_ = payload_size;
+  return true;
+}
+
+uint64 Cues::Size() {
+  uint64 size = payload_size_;
+  if (output_crc32_)
+    size += kCrc32ElementSize;
+  return EbmlMasterElementSize(kMkvCues, size) + size;
+}
+
+bool Cues::Write(IMkvWriter* writer) const {
+  if (!writer)
+    return false;
+
+  uint64 size = payload_size_;
+  if (output_crc32_)
+    size += kCrc32ElementSize;
+
   if (!WriteEbmlMasterElement(writer, kMkvCues, size))
     return false;
 
@@ -333,14 +975,18 @@ bool Cues::Write(IMkvWriter* writer) const {
   if (payload_position < 0)
     return false;
 
-  for (int32 i = 0; i < cue_entries_size_; ++i) {
-    const CuePoint* const cue = GetCueByIndex(i);
-
-    if (!cue->Write(writer))
+  if (output_crc32_) {
+    // The checksum precedes the data it covers, so compute it from a dry run.
+    Crc32MkvWriter crc32_writer(NULL);
+    if (!WriteCuePoints(&crc32_writer) ||
+        !WriteCrc32Element(writer, crc32_writer.crc()))
       return false;
   }
 
-  const int64 stop_position = writer->Position();
+  if (!WriteCuePoints(writer))
+    return false;
+
+  const int64 stop_position = writer->Position();
   if (stop_position < 0)
     return false;
 
@@ -350,6 +996,62 @@ bool Cues::Write(IMkvWriter* writer) const {
   return true;
 }
 
+bool Cues::SetSpillThreshold(int32 max_cue_points) {
+  if (max_cue_points < 0 || cue_entries_size() > 0)
+    return false;
+
+  spill_threshold_ = max_cue_points;
+  return true;
+}
+
+bool Cues::WriteCuePoints(IMkvWriter* writer) const {
+  if (spilled_size_ > 0) {
+    if (!spill_file_->Rewind())
+      return false;
+
+    for (int32 i = 0; i < spilled_size_; ++i) {
+      CuePoint cue;
+      if (!spill_file_->Read(spilled_offset_, &cue) || !cue.Write(writer))
+        return false;
+    }
+  }
+
+  for (int32 i = 0; i < cue_entries_size_; ++i) {
+    const CuePoint* const cue = cue_entries_[i];
+
+    if (!cue || !cue->Write(writer))
+      return false;
+  }
+
+  return true;
+}
+
+bool Cues::SpillCuePoints() {
+  if (!spill_file_) {
+    spill_file_ = new (std::nothrow) SpillFile();  // NOLINT
+    if (!spill_file_)
+      return false;
+
+    if (!spill_file_->Init()) {
+      delete spill_file_;
+      spill_file_ = NULL;
+      return false;
+    }
+  }
+
+  for (int32 i = 0; i < cue_entries_size_; ++i) {
+    if (!spill_file_->Append(*cue_entries_[i], spilled_offset_))
+      return false;
+  }
+
+  for (int32 i = 0; i < cue_entries_size_; ++i)
+    delete cue_entries_[i];
+
+  spilled_size_ += cue_entries_size_;
+  cue_entries_size_ = 0;
+  return true;
+}
+
 ///////////////////////////////////////////////////////////////
 //
 // ContentEncAESSettings Class
@@ -515,7 +1217,9 @@ Track::Track(unsigned int* seed)
       default_duration_(0),
       codec_private_length_(0),
       content_encoding_entries_(NULL),
-      content_encoding_entries_size_(0) {}
+      content_encoding_entries_size_(0),
+      frame_transform_(NULL),
+      elements_size_(0) {}
 
 Track::~Track() {
   delete[] codec_id_;
@@ -570,26 +1274,7 @@ ContentEncoding* Track::GetContentEncodingByIndex(uint32 index) const {
 }
 
 uint64 Track::PayloadSize() const {
-  uint64 size = EbmlElementSize(kMkvTrackNumber, number_);
-  size += EbmlElementSize(kMkvTrackUID, uid_);
-  size += EbmlElementSize(kMkvTrackType, type_);
-  if (codec_id_)
-    size += EbmlElementSize(kMkvCodecID, codec_id_);
-  if (codec_private_)
-    size += EbmlElementSize(kMkvCodecPrivate, codec_private_,
-                            codec_private_length_);
-  if (language_)
-    size += EbmlElementSize(kMkvLanguage, language_);
-  if (name_)
-    size += EbmlElementSize(kMkvName, name_);
-  if (max_block_additional_id_)
-    size += EbmlElementSize(kMkvMaxBlockAdditionID, max_block_additional_id_);
-  if (codec_delay_)
-    size += EbmlElementSize(kMkvCodecDelay, codec_delay_);
-  if (seek_pre_roll_)
-    size += EbmlElementSize(kMkvSeekPreRoll, seek_pre_roll_);
-  if (default_duration_)
-    size += EbmlElementSize(kMkvDefaultDuration, default_duration_);
+  uint64 size = ElementsSize();
 
   if (content_encoding_entries_size_ > 0) {
     uint64 content_encodings_size = 0;
@@ -627,26 +1312,7 @@ bool Track::Write(IMkvWriter* writer) const {
   if (!WriteEbmlMasterElement(writer, kMkvTrackEntry, payload_size))
     return false;
 
-  uint64 size = EbmlElementSize(kMkvTrackNumber, number_);
-  size += EbmlElementSize(kMkvTrackUID, uid_);
-  size += EbmlElementSize(kMkvTrackType, type_);
-  if (codec_id_)
-    size += EbmlElementSize(kMkvCodecID, codec_id_);
-  if (codec_private_)
-    size += EbmlElementSize(kMkvCodecPrivate, codec_private_,
-                            codec_private_length_);
-  if (language_)
-    size += EbmlElementSize(kMkvLanguage, language_);
-  if (name_)
-    size += EbmlElementSize(kMkvName, name_);
-  if (max_block_additional_id_)
-    size += EbmlElementSize(kMkvMaxBlockAdditionID, max_block_additional_id_);
-  if (codec_delay_)
-    size += EbmlElementSize(kMkvCodecDelay, codec_delay_);
-  if (seek_pre_roll_)
-    size += EbmlElementSize(kMkvSeekPreRoll, seek_pre_roll_);
-  if (default_duration_)
-    size += EbmlElementSize(kMkvDefaultDuration, default_duration_);
+  const uint64 size = ElementsSize();
 
   const int64 payload_position = writer->Position();
   if (payload_position < 0)
@@ -728,6 +1394,7 @@ bool Track::SetCodecPrivate(const uint8* codec_private, uint64 length) {
     return false;
 
   delete[] codec_private_;
+  elements_size_ = 0;
 
   codec_private_ =
       new (std::nothrow) uint8[static_cast<size_t>(length)];  // NOLINT
@@ -743,6 +1410,7 @@ bool Track::SetCodecPrivate(const uint8* codec_private, uint64 length) {
 void Track::set_codec_id(const char* codec_id) {
   if (codec_id) {
     delete[] codec_id_;
+    elements_size_ = 0;
 
     const size_t length = strlen(codec_id) + 1;
     codec_id_ = new (std::nothrow) char[length];  // NOLINT
@@ -760,6 +1428,7 @@ void Track::set_codec_id(const char* codec_id) {
 void Track::set_language(const char* language) {
   if (language) {
     delete[] language_;
+    elements_size_ = 0;
 
     const size_t length = strlen(language) + 1;
     language_ = new (std::nothrow) char[length];  // NOLINT
@@ -776,6 +1445,7 @@ void Track::set_language(const char* language) {
 void Track::set_name(const char* name) {
   if (name) {
     delete[] name_;
+    elements_size_ = 0;
 
     const size_t length = strlen(name) + 1;
     name_ = new (std::nothrow) char[length];  // NOLINT
@@ -789,6 +1459,35 @@ void Track::set_name(const char* name) {
   }
 }
 
+uint64 Track::ElementsSize() const {
+  if (elements_size_ > 0)
+    return elements_size_;
+
+  uint64 size = EbmlElementSize(kMkvTrackNumber, number_);
+  size += EbmlElementSize(kMkvTrackUID, uid_);
+  size += EbmlElementSize(kMkvTrackType, type_);
+  if (codec_id_)
+    size += EbmlElementSize(kMkvCodecID, codec_id_);
+  if (codec_private_)
+    size += EbmlElementSize(kMkvCodecPrivate, codec_private_,
+                            codec_private_length_);
+  if (language_)
+    size += EbmlElementSize(kMkvLanguage, language_);
+  if (name_)
+    size += EbmlElementSize(kMkvName, name_);
+  if (max_block_additional_id_)
+    size += EbmlElementSize(kMkvMaxBlockAdditionID, max_block_additional_id_);
+  if (codec_delay_)
+    size += EbmlElementSize(kMkvCodecDelay, codec_delay_);
+  if (seek_pre_roll_)
+    size += EbmlElementSize(kMkvSeekPreRoll, seek_pre_roll_);
+  if (default_duration_)
+    size += EbmlElementSize(kMkvDefaultDuration, default_duration_);
+
+  elements_size_ = size;
+  return size;
+}
+
 ///////////////////////////////////////////////////////////////
 //
 // VideoTrack Class
@@ -805,7 +1504,8 @@ VideoTrack::VideoTrack(unsigned int* seed)
       height_(0),
       stereo_mode_(0),
       alpha_mode_(0),
-      width_(0) {}
+      width_(0),
+      video_payload_size_(0) {}
 
 VideoTrack::~VideoTrack() {}
 
@@ -817,6 +1517,7 @@ bool VideoTrack::SetStereoMode(uint64 stereo_mode) {
     return false;
 
   stereo_mode_ = stereo_mode;
+  video_payload_size_ = 0;
   return true;
 }
 
@@ -825,6 +1526,7 @@ bool VideoTrack::SetAlphaMode(uint64 alpha_mode) {
     return false;
 
   alpha_mode_ = alpha_mode;
+  video_payload_size_ = 0;
   return true;
 }
 
@@ -903,6 +1605,9 @@ bool VideoTrack::Write(IMkvWriter* writer) const {
 }
 
 uint64 VideoTrack::VideoPayloadSize() const {
+  if (video_payload_size_ > 0)
+    return video_payload_size_;
+
   uint64 size = EbmlElementSize(kMkvPixelWidth, width_);
   size += EbmlElementSize(kMkvPixelHeight, height_);
   if (display_width_ > 0)
@@ -924,6 +1629,7 @@ uint64 VideoTrack::VideoPayloadSize() const {
   if (frame_rate_ > 0.0)
     size += EbmlElementSize(kMkvFrameRate, static_cast<float>(frame_rate_));
 
+  video_payload_size_ = size;
   return size;
 }
 
@@ -993,7 +1699,12 @@ const char Tracks::kVorbisCodecId[] = "A_VORBIS";
 const char Tracks::kVp8CodecId[] = "V_VP8";
 const char Tracks::kVp9CodecId[] = "V_VP9";
 
-Tracks::Tracks() : track_entries_(NULL), track_entries_size_(0) {}
+Tracks::Tracks()
+    : track_entries_(NULL),
+      track_entries_size_(0),
+      track_number_table_(NULL),
+      track_number_table_size_(0),
+      output_crc32_(false) {}
 
 Tracks::~Tracks() {
   if (track_entries_) {
@@ -1003,28 +1714,24 @@ Tracks::~Tracks() {
     }
     delete[] track_entries_;
   }
+  delete[] track_number_table_;
 }
 
 bool Tracks::AddTrack(Track* track, int32 number) {
   if (number < 0)
     return false;
 
-  // This muxer only supports track numbers in the range [1, 126], in
-  // order to be able (to use Matroska integer representation) to
-  // serialize the block header (of which the track number is a part)
-  // for a frame using exactly 4 bytes.
-
-  if (number > 0x7E)
-    return false;
-
   uint32 track_num = number;
 
   if (track_num > 0) {
     // Check to make sure a track does not already have |track_num|.
-    for (uint32 i = 0; i < track_entries_size_; ++i) {
-      if (track_entries_[i]->number() == track_num)
-        return false;
-    }
+    if (GetTrackByNumber(track_num))
+      return false;
+  } else {
+    // Find the lowest availible track number > the number of tracks.
+    track_num = track_entries_size_ + 1;
+    while (GetTrackByNumber(track_num))
+      track_num++;
   }
 
   const uint32 count = track_entries_size_ + 1;
@@ -1039,29 +1746,12 @@ bool Tracks::AddTrack(Track* track, int32 number) {
 
   delete[] track_entries_;
 
-  // Find the lowest availible track number > 0.
-  if (track_num == 0) {
-    track_num = count;
-
-    // Check to make sure a track does not already have |track_num|.
-    bool exit = false;
-    do {
-      exit = true;
-      for (uint32 i = 0; i < track_entries_size_; ++i) {
-        if (track_entries[i]->number() == track_num) {
-          track_num++;
-          exit = false;
-          break;
-        }
-      }
-    } while (!exit);
-  }
   track->set_number(track_num);
 
   track_entries_ = track_entries;
   track_entries_[track_entries_size_] = track;
   track_entries_size_ = count;
-  return true;
+  return UpdateTrackNumberTable();
 }
 
 const Track* Tracks::GetTrackByIndex(uint32 index) const {
@@ -1075,6 +1765,14 @@ const Track* Tracks::GetTrackByIndex(uint32 index) const {
 }
 
 Track* Tracks::GetTrackByNumber(uint64 track_number) const {
+  if (track_number < track_number_table_size_) {
+    Track* const track = track_number_table_[track_number];
+    if (track && track->number() == track_number)
+      return track;
+  }
+
+  // The number is too large for the table, or the track has been renumbered
+  // after it was added.
   const int32 count = track_entries_size();
   for (int32 i = 0; i < count; ++i) {
     if (track_entries_[i]->number() == track_number)
@@ -1087,7 +1785,7 @@ Track* Tracks::GetTrackByNumber(uint64 track_number) const {
 bool Tracks::TrackIsAudio(uint64 track_number) const {
   const Track* const track = GetTrackByNumber(track_number);
 
-  if (track->type() == kAudio)
+  if (track && track->type() == kAudio)
     return true;
 
   return false;
@@ -1096,12 +1794,44 @@ bool Tracks::TrackIsAudio(uint64 track_number) const {
 bool Tracks::TrackIsVideo(uint64 track_number) const {
   const Track* const track = GetTrackByNumber(track_number);
 
-  if (track->type() == kVideo)
+  if (track && track->type() == kVideo)
     return true;
 
   return false;
 }
 
+bool Tracks::UpdateTrackNumberTable() {
+  uint64 max_number = 0;
+  for (uint32 i = 0; i < track_entries_size_; ++i) {
+    const uint64 number = track_entries_[i]->number();
+    if (number < kMaxTrackNumberTableSize && number > max_number)
+      max_number = number;
+  }
+
+  const uint32 size = static_cast<uint32>(max_number) + 1;
+  if (size > track_number_table_size_) {
+    Track** const table = new (std::nothrow) Track* [size];  // NOLINT
+    if (!table)
+      return false;
+
+    delete[] track_number_table_;
+    track_number_table_ = table;
+    track_number_table_size_ = size;
+  }
+
+  for (uint32 i = 0; i < track_number_table_size_; ++i)
+    track_number_table_[i] = NULL;
+
+  for (uint32 i = 0; i < track_entries_size_; ++i) {
+    Track* const track = track_entries_[i];
+    if (track->number() < track_number_table_size_ &&
+        !track_number_table_[track->number()])
+      track_number_table_[track->number()] = track;
+  }
+
+  return true;
+}
+
 bool Tracks::Write(IMkvWriter* writer) const {
   uint64 size = 0;
   const int32 count = track_entries_size();
@@ -1113,6 +1843,8 @@ bool Tracks::Write(IMkvWriter* writer) const {
 
     size += track->Size();
   }
+  if (output_crc32_)
+    size += kCrc32ElementSize;
 
   if (!WriteEbmlMasterElement(writer, kMkvTracks, size))
     return false;
@@ -1121,12 +1853,16 @@ bool Tracks::Write(IMkvWriter* writer) const {
   if (payload_position < 0)
     return false;
 
-  for (int32 i = 0; i < count; ++i) {
-    const Track* const track = GetTrackByIndex(i);
-    if (!track->Write(writer))
+  if (output_crc32_) {
+    Crc32MkvWriter crc32_writer(NULL);
+    if (!WriteTrackEntries(&crc32_writer) ||
+        !WriteCrc32Element(writer, crc32_writer.crc()))
       return false;
   }
 
+  if (!WriteTrackEntries(writer))
+    return false;
+
   const int64 stop_position = writer->Position();
   if (stop_position < 0 ||
       stop_position - payload_position != static_cast<int64>(size))
@@ -1135,6 +1871,17 @@ bool Tracks::Write(IMkvWriter* writer) const {
   return true;
 }
 
+bool Tracks::WriteTrackEntries(IMkvWriter* writer) const {
+  const int32 count = track_entries_size();
+  for (int32 i = 0; i < count; ++i) {
+    const Track* const track = GetTrackByIndex(i);
+    if (!track->Write(writer))
+      return false;
+  }
+
+  return true;
+}
+
 ///////////////////////////////////////////////////////////////
 //
 // Chapter Class
@@ -1356,7 +2103,11 @@ uint64 Chapter::Display::WriteDisplay(IMkvWriter* writer) const {
 //
 // Chapters Class
 
-Chapters::Chapters() : chapters_size_(0), chapters_count_(0), chapters_(NULL) {}
+Chapters::Chapters()
+    : chapters_size_(0),
+      chapters_count_(0),
+      chapters_(NULL),
+      output_crc32_(false) {}
 
 Chapters::~Chapters() {
   while (chapters_count_ > 0) {
@@ -1384,13 +2135,22 @@ bool Chapters::Write(IMkvWriter* writer) const {
   if (writer == NULL)
     return false;
 
-  const uint64 payload_size = WriteEdition(NULL);  // return size only
+  uint64 payload_size = WriteEdition(NULL);  // return size only
+  if (output_crc32_)
+    payload_size += kCrc32ElementSize;
 
   if (!WriteEbmlMasterElement(writer, kMkvChapters, payload_size))
     return false;
 
   const int64 start = writer->Position();
 
+  if (output_crc32_) {
+    Crc32MkvWriter crc32_writer(NULL);
+    if (WriteEdition(&crc32_writer) == 0 ||
+        !WriteCrc32Element(writer, crc32_writer.crc()))
+      return false;
+  }
+
   if (WriteEdition(writer) == 0)  // error
     return false;
 
@@ -1463,140 +2223,594 @@ uint64 Chapters::WriteEdition(IMkvWriter* writer) const {
 
 ///////////////////////////////////////////////////////////////
 //
-// Cluster class
-
-Cluster::Cluster(uint64 timecode, int64 cues_pos)
-    : blocks_added_(0),
-      finalized_(false),
-      header_written_(false),
-      payload_size_(0),
-      position_for_cues_(cues_pos),
-      size_position_(-1),
-      timecode_(timecode),
-      writer_(NULL) {}
+// Cluster::Buffer class
+
+// Seekable in-memory writer that collects a cluster so it can be output in
+// one write once its size is known. Positions are reported relative to the
+// destination writer, so elements written to the buffer see the offsets they
+// will have in the output. When the buffer would grow beyond its limit, the
+// buffered data is output and all further calls are passed through to the
+// destination writer.
+class Cluster::Buffer : public IMkvWriter {
+ public:
+  Buffer(IMkvWriter* writer, uint64 max_size);
+  virtual ~Buffer();
+
+  // IMkvWriter interface
+  virtual int32 Write(const void* buf, uint32 len);
+  virtual int64 Position() const;
+  virtual int32 Position(int64 position);
+  virtual bool Seekable() const;
+  virtual void ElementStartNotify(uint64 element_id, int64 position);
+
+  // Outputs the buffered data to the destination writer. Returns 0 on
+  // success.
+  int32 Flush();
+
+  // Returns true if the buffer limit has been exceeded and calls are passed
+  // through to the destination writer.
+  bool pass_through() const { return pass_through_; }
+
+ private:
+  // Outputs the buffered data and switches to pass-through mode. Returns 0
+  // on success.
+  int32 Spill();
+
+  // Destination writer. Not owned by this class.
+  IMkvWriter* const writer_;
+
+  // Position of the destination writer when buffering started.
+  const int64 base_position_;
+
+  // Maximum number of bytes to hold in |data_|.
+  const uint64 max_size_;
+
+  uint8* data_;
+  uint64 capacity_;
+
+  // Number of valid bytes in |data_|.
+  uint64 size_;
+
+  // Current write offset within |data_|.
+  uint64 cursor_;
+
+  // Flag telling if the buffer limit has been exceeded and calls are passed
+  // through to |writer_|.
+  bool pass_through_;
+
+  LIBWEBM_DISALLOW_COPY_AND_ASSIGN(Buffer);
+};
+
+Cluster::Buffer::Buffer(IMkvWriter* writer, uint64 max_size)
+    : writer_(writer),
+      base_position_(writer->Position()),
+      max_size_(max_size),
+      data_(NULL),
+      capacity_(0),
+      size_(0),
+      cursor_(0),
+      pass_through_(false) {}
+
+Cluster::Buffer::~Buffer() { delete[] data_; }
+
+int32 Cluster::Buffer::Write(const void* buf, uint32 len) {
+  if (pass_through_)
+    return writer_->Write(buf, len);
+
+  if (buf == NULL && len > 0)
+    return -1;
 
-Cluster::~Cluster() {}
+  const uint64 end = cursor_ + len;
+  if (end > max_size_) {
+    if (Spill())
+      return -1;
+    return writer_->Write(buf, len);
+  }
 
-bool Cluster::Init(IMkvWriter* ptr_writer) {
-  if (!ptr_writer) {
-    return false;
+  if (end > capacity_) {
+    uint64 new_capacity = (capacity_ == 0) ? 4096 : capacity_ * 2;
+    while (new_capacity < end)
+      new_capacity *= 2;
+    if (new_capacity > max_size_)
+      new_capacity = max_size_;
+
+    uint8* const data = new (std::nothrow) uint8[new_capacity];  // NOLINT
+    if (!data)
+      return -1;
+
+    if (size_ > 0)
+      memcpy(data, data_, static_cast<size_t>(size_));
+    delete[] data_;
+    data_ = data;
+    capacity_ = new_capacity;
   }
-  writer_ = ptr_writer;
-  return true;
-}
 
-bool Cluster::AddFrame(const uint8* frame, uint64 length, uint64 track_number,
-                       uint64 abs_timecode, bool is_key) {
-  return DoWriteBlock(frame, length, track_number, abs_timecode, is_key ? 1 : 0,
-                      &WriteSimpleBlock);
-}
+  if (len > 0)
+    memcpy(data_ + cursor_, buf, len);
+  cursor_ = end;
+  if (cursor_ > size_)
+    size_ = cursor_;
 
-bool Cluster::AddFrameWithAdditional(const uint8* frame, uint64 length,
-                                     const uint8* additional,
-                                     uint64 additional_length, uint64 add_id,
-                                     uint64 track_number, uint64 abs_timecode,
-                                     bool is_key) {
-  return DoWriteBlockWithAdditional(
-      frame, length, additional, additional_length, add_id, track_number,
-      abs_timecode, is_key ? 1 : 0, &WriteBlockWithAdditional);
+  return 0;
 }
 
-bool Cluster::AddFrameWithDiscardPadding(const uint8* frame, uint64 length,
-                                         int64 discard_padding,
-                                         uint64 track_number,
-                                         uint64 abs_timecode, bool is_key) {
-  return DoWriteBlockWithDiscardPadding(
-      frame, length, discard_padding, track_number, abs_timecode,
-      is_key ? 1 : 0, &WriteBlockWithDiscardPadding);
+int64 Cluster::Buffer::Position() const {
+  if (pass_through_)
+    return writer_->Position();
+  return base_position_ + cursor_;
 }
 
-bool Cluster::AddMetadata(const uint8* frame, uint64 length,
-                          uint64 track_number, uint64 abs_timecode,
-                          uint64 duration_timecode) {
-  return DoWriteBlock(frame, length, track_number, abs_timecode,
-                      duration_timecode, &WriteMetadataBlock);
+int32 Cluster::Buffer::Position(int64 position) {
+  if (pass_through_)
+    return writer_->Position(position);
+
+  if (position < base_position_ ||
+      static_cast<uint64>(position - base_position_) > size_)
+    return -1;
+
+  cursor_ = position - base_position_;
+  return 0;
 }
 
-void Cluster::AddPayloadSize(uint64 size) { payload_size_ += size; }
+bool Cluster::Buffer::Seekable() const {
+  if (pass_through_)
+    return writer_->Seekable();
+  return true;
+}
 
-bool Cluster::Finalize() {
-  if (!writer_ || finalized_ || size_position_ == -1)
-    return false;
+void Cluster::Buffer::ElementStartNotify(uint64 element_id, int64 position) {
+  writer_->ElementStartNotify(element_id, position);
+}
 
-  if (writer_->Seekable()) {
-    const int64 pos = writer_->Position();
+int32 Cluster::Buffer::Flush() {
+  if (pass_through_)
+    return 0;
 
-    if (writer_->Position(size_position_))
-      return false;
+  if (writer_->Position() != base_position_)
+    return -1;
 
-    if (WriteUIntSize(writer_, payload_size(), 8))
-      return false;
+  uint64 offset = 0;
+  while (offset < size_) {
+    const uint64 remaining = size_ - offset;
+    const uint32 length = (remaining > 0x7FFFFFFFULL)
+                              ? 0x7FFFFFFF
+                              : static_cast<uint32>(remaining);
+    if (writer_->Write(data_ + offset, length))
+      return -1;
+    offset += length;
+  }
 
-    if (writer_->Position(pos))
-      return false;
+  if (writer_->Seekable() && cursor_ != size_) {
+    if (writer_->Position(base_position_ + cursor_))
+      return -1;
   }
 
-  finalized_ = true;
+  delete[] data_;
+  data_ = NULL;
+  capacity_ = 0;
+  size_ = 0;
+  cursor_ = 0;
+  pass_through_ = true;
 
-  return true;
+  return 0;
 }
 
-uint64 Cluster::Size() const {
-  const uint64 element_size =
-      EbmlMasterElementSize(kMkvCluster, 0xFFFFFFFFFFFFFFFFULL) + payload_size_;
-  return element_size;
+int32 Cluster::Buffer::Spill() {
+  // Data can only be appended once it has been passed on to |writer_|.
+  if (cursor_ != size_)
+    return -1;
+  return Flush();
 }
 
-template <typename Type>
-bool Cluster::PreWriteBlock(Type* write_function) {
-  if (write_function == NULL)
-    return false;
+class Cluster::Lace {
+ public:
+  Lace();
+  ~Lace();
 
-  if (finalized_)
-    return false;
+  // Returns true if a frame with the given properties can be appended to the
+  // lace without exceeding |max_duration| timecode units. The frame must
+  // start |frame_duration| timecode units after the previous frame, so that
+  // its timecode can be recovered from the track's DefaultDuration.
+  bool Fits(uint64 track_number, uint64 abs_timecode, uint64 frame_duration,
+            bool is_key, uint64 max_duration) const;
 
-  if (!header_written_) {
-    if (!WriteClusterHeader())
-      return false;
-  }
+  // Appends |frame| to the lace. The first frame sets the track, timecode and
+  // key flag of the lace. Returns true on success.
+  bool Add(const uint8* frame, uint64 length, uint64 track_number,
+           uint64 abs_timecode, bool is_key);
 
-  return true;
-}
+  // Empties the lace. The memory is kept for reuse.
+  void Reset();
 
-void Cluster::PostWriteBlock(uint64 element_size) {
-  AddPayloadSize(element_size);
-  ++blocks_added_;
-}
+  // Returns the number of bytes of frame data in the lace.
+  uint64 size() const { return size_; }
 
-bool Cluster::IsValidTrackNumber(uint64 track_number) const {
-  return (track_number > 0 && track_number <= 0x7E);
-}
+  const uint8* data() const { return data_; }
+  const uint64* frame_sizes() const { return frame_sizes_; }
+  int32 frame_count() const { return frame_count_; }
+  uint64 track_number() const { return track_number_; }
+  uint64 timecode() const { return timecode_; }
+  bool is_key() const { return is_key_; }
 
-int64 Cluster::GetRelativeTimecode(int64 abs_timecode) const {
-  const int64 cluster_timecode = this->Cluster::timecode();
-  const int64 rel_timecode =
-      static_cast<int64>(abs_timecode) - cluster_timecode;
+ private:
+  // Frame data, stored back to back.
+  uint8* data_;
+  uint64 capacity_;
+  uint64 size_;
 
-  if (rel_timecode < 0 || rel_timecode > kMaxBlockTimecode)
-    return -1;
+  uint64 frame_sizes_[kMaxLaceFrames];
+  int32 frame_count_;
 
-  return rel_timecode;
-}
+  uint64 track_number_;
 
-bool Cluster::DoWriteBlock(const uint8* frame, uint64 length,
-                           uint64 track_number, uint64 abs_timecode,
-                           uint64 generic_arg, WriteBlock write_block) {
-  if (frame == NULL || length == 0)
-    return false;
+  // Absolute timecode of the first frame.
+  uint64 timecode_;
 
-  if (!IsValidTrackNumber(track_number))
-    return false;
+  bool is_key_;
 
-  const int64 rel_timecode = GetRelativeTimecode(abs_timecode);
-  if (rel_timecode < 0)
-    return false;
+  LIBWEBM_DISALLOW_COPY_AND_ASSIGN(Lace);
+};
 
-  if (!PreWriteBlock(write_block))
+Cluster::Lace::Lace()
+    : data_(NULL),
+      capacity_(0),
+      size_(0),
+      frame_count_(0),
+      track_number_(0),
+      timecode_(0),
+      is_key_(false) {}
+
+Cluster::Lace::~Lace() { delete[] data_; }
+
+bool Cluster::Lace::Fits(uint64 track_number, uint64 abs_timecode,
+                         uint64 frame_duration, bool is_key,
+                         uint64 max_duration) const {
+  if (frame_count_ == 0)
+    return true;
+
+  return frame_count_ < kMaxLaceFrames && track_number == track_number_ &&
+         is_key == is_key_ &&
+         abs_timecode == timecode_ + frame_count_ * frame_duration &&
+         abs_timecode - timecode_ <= max_duration;
+}
+
+bool Cluster::Lace::Add(const uint8* frame, uint64 length, uint64 track_number,
+                        uint64 abs_timecode, bool is_key) {
+  if (frame_count_ >= kMaxLaceFrames)
+    return false;
+
+  const uint64 end = size_ + length;
+  if (end > capacity_) {
+    uint64 new_capacity = (capacity_ == 0) ? 4096 : capacity_ * 2;
+    while (new_capacity < end)
+      new_capacity *= 2;
+
+    uint8* const data = new (std::nothrow) uint8[new_capacity];  // NOLINT
+    if (!data)
+      return false;
+
+    if (size_ > 0)
+      memcpy(data, data_, static_cast<size_t>(size_));
+    delete[] data_;
+    data_ = data;
+    capacity_ = new_capacity;
+  }
+
+  memcpy(data_ + size_, frame, static_cast<size_t>(length));
+  size_ = end;
+
+  if (frame_count_ == 0) {
+    track_number_ = track_number;
+    timecode_ = abs_timecode;
+    is_key_ = is_key;
+  }
+  frame_sizes_[frame_count_++] = length;
+
+  return true;
+}
+
+void Cluster::Lace::Reset() {
+  size_ = 0;
+  frame_count_ = 0;
+}
+
+///////////////////////////////////////////////////////////////
+//
+// Cluster class
+
+Cluster::Cluster(uint64 timecode, int64 cues_pos)
+    : blocks_added_(0),
+      finalized_(false),
+      header_written_(false),
+      payload_size_(0),
+      position_for_cues_(cues_pos),
+      size_position_(-1),
+      timecode_(timecode),
+      writer_(NULL),
+      buffer_(NULL),
+      lace_(NULL),
+      max_lace_duration_(0),
+      output_crc32_(false),
+      crc32_writer_(NULL),
+      crc32_position_(-1),
+      statistics_(NULL) {}
+
+Cluster::~Cluster() {
+  delete crc32_writer_;
+  delete lace_;
+  delete buffer_;
+}
+
+bool Cluster::Init(IMkvWriter* ptr_writer) {
+  if (!ptr_writer) {
+    return false;
+  }
+  writer_ = ptr_writer;
+  return true;
+}
+
+bool Cluster::EnableBuffering(uint64 max_buffer_size) {
+  if (!writer_ || buffer_ || header_written_ || finalized_)
+    return false;
+
+  buffer_ = new (std::nothrow) Buffer(writer_, max_buffer_size);  // NOLINT
+  if (!buffer_)
+    return false;
+
+  writer_ = buffer_;
+  return true;
+}
+
+bool Cluster::AddFrame(const uint8* frame, uint64 length, uint64 track_number,
+                       uint64 abs_timecode, bool is_key) {
+  return DoWriteBlock(frame, length, track_number, abs_timecode, is_key ? 1 : 0,
+                      &WriteSimpleBlock);
+}
+
+bool Cluster::AddBlockPassthrough(mkvparser::IMkvReader* reader,
+                                  int64 position,
+                                  uint64 size, uint64 track_number,
+                                  uint64 abs_timecode, bool is_key) {
+  if (reader == NULL || size == 0)
+    return false;
+
+  if (!IsValidTrackNumber(track_number))
+    return false;
+
+  const int64 rel_timecode = GetRelativeTimecode(abs_timecode);
+  if (rel_timecode < 0)
+    return false;
+
+  if (!PreWriteBlock(&WriteSimpleBlockPassthrough))
+    return false;
+
+  const uint64 element_size =
+      WriteSimpleBlockPassthrough(writer_, reader, position, size,
+                                  track_number, rel_timecode, is_key ? 1 : 0);
+  if (element_size == 0)
+    return false;
+
+  PostWriteBlock(track_number, element_size);
+  return true;
+}
+
+bool Cluster::EnableLacing(uint64 max_lace_duration) {
+  if (!writer_ || lace_ || header_written_ || finalized_)
+    return false;
+
+  lace_ = new (std::nothrow) Lace();  // NOLINT
+  if (!lace_)
+    return false;
+
+  max_lace_duration_ = max_lace_duration;
+  return true;
+}
+
+bool Cluster::AddLacedFrame(const uint8* frame, uint64 length,
+                            uint64 track_number, uint64 abs_timecode,
+                            uint64 frame_duration, bool is_key) {
+  if (!lace_ || frame_duration == 0)
+    return AddFrame(frame, length, track_number, abs_timecode, is_key);
+
+  if (frame == NULL || length == 0 || finalized_)
+    return false;
+
+  if (!IsValidTrackNumber(track_number))
+    return false;
+
+  if (GetRelativeTimecode(abs_timecode) < 0)
+    return false;
+
+  if (!lace_->Fits(track_number, abs_timecode, frame_duration, is_key,
+                   max_lace_duration_)) {
+    if (!FlushLace())
+      return false;
+  }
+
+  // The lace counts as a block from its first frame on, so that cue points
+  // refer to it correctly.
+  if (lace_->frame_count() == 0)
+    ++blocks_added_;
+
+  return lace_->Add(frame, length, track_number, abs_timecode, is_key);
+}
+
+uint64 Cluster::pending_size() const { return lace_ ? lace_->size() : 0; }
+
+bool Cluster::FlushLace() {
+  if (!lace_ || lace_->frame_count() == 0)
+    return true;
+
+  if (finalized_)
+    return false;
+
+  if (!header_written_) {
+    if (!WriteClusterHeader())
+      return false;
+  }
+
+  const int64 rel_timecode = GetRelativeTimecode(lace_->timecode());
+  if (rel_timecode < 0)
+    return false;
+
+  const uint64 element_size = WriteLacedSimpleBlock(
+      writer_, lace_->data(), lace_->frame_sizes(), lace_->frame_count(),
+      lace_->track_number(), rel_timecode, lace_->is_key() ? 1 : 0);
+  const uint64 track_number = lace_->track_number();
+  const int32 frame_count = lace_->frame_count();
+  lace_->Reset();
+  if (element_size == 0)
+    return false;
+
+  AddPayloadSize(element_size);
+  if (statistics_)
+    statistics_->AddBlock(track_number, frame_count, element_size);
+  return true;
+}
+
+bool Cluster::EnableCrc32() {
+  if (!writer_ || header_written_ || finalized_)
+    return false;
+
+  output_crc32_ = true;
+  return true;
+}
+
+bool Cluster::AddFrameWithAdditional(const uint8* frame, uint64 length,
+                                     const uint8* additional,
+                                     uint64 additional_length, uint64 add_id,
+                                     uint64 track_number, uint64 abs_timecode,
+                                     bool is_key) {
+  return DoWriteBlockWithAdditional(
+      frame, length, additional, additional_length, add_id, track_number,
+      abs_timecode, is_key ? 1 : 0, &WriteBlockWithAdditional);
+}
+
+bool Cluster::AddFrameWithDiscardPadding(const uint8* frame, uint64 length,
+                                         int64 discard_padding,
+                                         uint64 track_number,
+                                         uint64 abs_timecode, bool is_key) {
+  return DoWriteBlockWithDiscardPadding(
+      frame, length, discard_padding, track_number, abs_timecode,
+      is_key ? 1 : 0, &WriteBlockWithDiscardPadding);
+}
+
+bool Cluster::AddMetadata(const uint8* frame, uint64 length,
+                          uint64 track_number, uint64 abs_timecode,
+                          uint64 duration_timecode) {
+  return DoWriteBlock(frame, length, track_number, abs_timecode,
+                      duration_timecode, &WriteMetadataBlock);
+}
+
+void Cluster::AddPayloadSize(uint64 size) { payload_size_ += size; }
+
+bool Cluster::Finalize() { return Finalize(NULL); }
+
+bool Cluster::Finalize(IMkvWriter* patch_writer) {
+  if (!FlushLace())
+    return false;
+
+  if (!writer_ || finalized_ || size_position_ == -1)
+    return false;
+
+  // The payload is complete; stop computing the checksum before seeking back.
+  if (crc32_writer_)
+    writer_ = crc32_writer_->writer();
+
+  // Data held in the buffer is updated in place.
+  IMkvWriter* writer = writer_;
+  if (patch_writer && (!buffer_ || buffer_->pass_through()))
+    writer = patch_writer;
+
+  if (writer->Seekable()) {
+    const int64 pos = writer->Position();
+
+    if (writer->Position(size_position_))
+      return false;
+
+    if (WriteUIntSize(writer, payload_size(), 8))
+      return false;
+
+    if (crc32_writer_) {
+      if (writer->Position(crc32_position_) ||
+          !WriteCrc32Element(writer, crc32_writer_->crc()))
+        return false;
+    }
+
+    if (writer->Position(pos))
+      return false;
+  }
+
+  if (buffer_ && buffer_->Flush())
+    return false;
+
+  delete lace_;
+  lace_ = NULL;
+
+  finalized_ = true;
+
+  return true;
+}
+
+uint64 Cluster::Size() const {
+  const uint64 element_size =
+      EbmlMasterElementSize(kMkvCluster, 0xFFFFFFFFFFFFFFFFULL) + payload_size_;
+  return element_size;
+}
+
+template <typename Type>
+bool Cluster::PreWriteBlock(Type* write_function) {
+  if (write_function == NULL)
+    return false;
+
+  if (finalized_)
+    return false;
+
+  if (!header_written_) {
+    if (!WriteClusterHeader())
+      return false;
+  }
+
+  // Keep the blocks in order by writing out the pending lace first.
+  return FlushLace();
+}
+
+void Cluster::PostWriteBlock(uint64 track_number, uint64 element_size) {
+  AddPayloadSize(element_size);
+  ++blocks_added_;
+  if (statistics_)
+    statistics_->AddBlock(track_number, 1, element_size);
+}
+
+bool Cluster::IsValidTrackNumber(uint64 track_number) const {
+  return (track_number > 0 && track_number <= kMaxTrackNumber);
+}
+
+int64 Cluster::GetRelativeTimecode(int64 abs_timecode) const {
+  const int64 cluster_timecode = this->Cluster::timecode();
+  const int64 rel_timecode =
+      static_cast<int64>(abs_timecode) - cluster_timecode;
+
+  if (rel_timecode < 0 || rel_timecode > kMaxBlockTimecode)
+    return -1;
+
+  return rel_timecode;
+}
+
+bool Cluster::DoWriteBlock(const uint8* frame, uint64 length,
+                           uint64 track_number, uint64 abs_timecode,
+                           uint64 generic_arg, WriteBlock write_block) {
+  if (frame == NULL || length == 0)
+    return false;
+
+  if (!IsValidTrackNumber(track_number))
+    return false;
+
+  const int64 rel_timecode = GetRelativeTimecode(abs_timecode);
+  if (rel_timecode < 0)
+    return false;
+
+  if (!PreWriteBlock(write_block))
     return false;
 
   const uint64 element_size = (*write_block)(
@@ -1604,7 +2818,7 @@ bool Cluster::DoWriteBlock(const uint8* frame, uint64 length,
   if (element_size == 0)
     return false;
 
-  PostWriteBlock(element_size);
+  PostWriteBlock(track_number, element_size);
   return true;
 }
 
@@ -1632,7 +2846,7 @@ bool Cluster::DoWriteBlockWithAdditional(
   if (element_size == 0)
     return false;
 
-  PostWriteBlock(element_size);
+  PostWriteBlock(track_number, element_size);
   return true;
 }
 
@@ -1659,7 +2873,7 @@ bool Cluster::DoWriteBlockWithDiscardPadding(
   if (element_size == 0)
     return false;
 
-  PostWriteBlock(element_size);
+  PostWriteBlock(track_number, element_size);
   return true;
 }
 
@@ -1678,6 +2892,20 @@ bool Cluster::WriteClusterHeader() {
   if (SerializeInt(writer_, kEbmlUnknownValue, 8))
     return false;
 
+  if (output_crc32_) {
+    // Reserve the first child for the CRC-32 element, which is written once
+    // the checksum of the rest of the cluster is known.
+    crc32_position_ = writer_->Position();
+    if (WriteVoidElement(writer_, kCrc32ElementSize) != kCrc32ElementSize)
+      return false;
+    AddPayloadSize(kCrc32ElementSize);
+
+    crc32_writer_ = new (std::nothrow) Crc32MkvWriter(writer_);  // NOLINT
+    if (!crc32_writer_)
+      return false;
+    writer_ = crc32_writer_;
+  }
+
   if (!WriteEbmlElement(writer_, kMkvTimecode, timecode()))
     return false;
   AddPayloadSize(EbmlElementSize(kMkvTimecode, timecode()));
@@ -1690,7 +2918,7 @@ bool Cluster::WriteClusterHeader() {
 //
 // SeekHead Class
 
-SeekHead::SeekHead() : start_pos_(0ULL) {
+SeekHead::SeekHead() : start_pos_(0ULL), output_crc32_(false) {
   for (int32 i = 0; i < kSeekEntryCount; ++i) {
     seek_entry_id_[i] = 0;
     seek_entry_pos_[i] = 0;
@@ -1722,6 +2950,9 @@ bool SeekHead::Finalize(IMkvWriter* writer) const {
     if (payload_size == 0)
       return true;
 
+    if (output_crc32_)
+      payload_size += kCrc32ElementSize;
+
     const int64 pos = writer->Position();
     if (writer->Position(start_pos_))
       return false;
@@ -1729,21 +2960,17 @@ bool SeekHead::Finalize(IMkvWriter* writer) const {
     if (!WriteEbmlMasterElement(writer, kMkvSeekHead, payload_size))
       return false;
 
-    for (int32 i = 0; i < kSeekEntryCount; ++i) {
-      if (seek_entry_id_[i] != 0) {
-        if (!WriteEbmlMasterElement(writer, kMkvSeek, entry_size[i]))
-          return false;
-
-        if (!WriteEbmlElement(writer, kMkvSeekID,
-                              static_cast<uint64>(seek_entry_id_[i])))
-          return false;
-
-        if (!WriteEbmlElement(writer, kMkvSeekPosition, seek_entry_pos_[i]))
-          return false;
-      }
+    if (output_crc32_) {
+      Crc32MkvWriter crc32_writer(NULL);
+      if (!WriteSeekEntries(&crc32_writer, entry_size) ||
+          !WriteCrc32Element(writer, crc32_writer.crc()))
+        return false;
     }
 
-    const uint64 total_entry_size = kSeekEntryCount * MaxEntrySize();
+    if (!WriteSeekEntries(writer, entry_size))
+      return false;
+
+    const uint64 total_entry_size = ReservedPayloadSize();
     const uint64 total_size =
         EbmlMasterElementSize(kMkvSeekHead, total_entry_size) +
         total_entry_size;
@@ -1761,7 +2988,7 @@ bool SeekHead::Finalize(IMkvWriter* writer) const {
 }
 
 bool SeekHead::Write(IMkvWriter* writer) {
-  const uint64 entry_size = kSeekEntryCount * MaxEntrySize();
+  const uint64 entry_size = ReservedPayloadSize();
   const uint64 size = EbmlMasterElementSize(kMkvSeekHead, entry_size);
 
   start_pos_ = writer->Position();
@@ -1815,6 +3042,32 @@ uint64 SeekHead::MaxEntrySize() const {
   return max_entry_size;
 }
 
+uint64 SeekHead::ReservedPayloadSize() const {
+  uint64 size = kSeekEntryCount * MaxEntrySize();
+  if (output_crc32_)
+    size += kCrc32ElementSize;
+  return size;
+}
+
+bool SeekHead::WriteSeekEntries(IMkvWriter* writer,
+                                const uint64* entry_size) const {
+  for (int32 i = 0; i < kSeekEntryCount; ++i) {
+    if (seek_entry_id_[i] != 0) {
+      if (!WriteEbmlMasterElement(writer, kMkvSeek, entry_size[i]))
+        return false;
+
+      if (!WriteEbmlElement(writer, kMkvSeekID,
+                            static_cast<uint64>(seek_entry_id_[i])))
+        return false;
+
+      if (!WriteEbmlElement(writer, kMkvSeekPosition, seek_entry_pos_[i]))
+        return false;
+    }
+  }
+
+  return true;
+}
+
 ///////////////////////////////////////////////////////////////
 //
 // SegmentInfo Class
@@ -1825,7 +3078,9 @@ SegmentInfo::SegmentInfo()
       timecode_scale_(1000000ULL),
       writing_app_(NULL),
       date_utc_(LLONG_MIN),
-      duration_pos_(-1) {}
+      duration_pos_(-1),
+      output_crc32_(false),
+      crc32_pos_(-1) {}
 
 SegmentInfo::~SegmentInfo() {
   delete[] muxing_app_;
@@ -1885,6 +3140,16 @@ bool SegmentInfo::Finalize(IMkvWriter* writer) const {
                             static_cast<float>(duration_)))
         return false;
 
+      if (crc32_pos_ != -1) {
+        Crc32MkvWriter crc32_writer(NULL);
+        if (!WritePayload(&crc32_writer))
+          return false;
+
+        if (writer->Position(crc32_pos_) ||
+            !WriteCrc32Element(writer, crc32_writer.crc()))
+          return false;
+      }
+
       if (writer->Position(pos))
         return false;
     }
@@ -1897,13 +3162,9 @@ bool SegmentInfo::Write(IMkvWriter* writer) {
   if (!writer || !muxing_app_ || !writing_app_)
     return false;
 
-  uint64 size = EbmlElementSize(kMkvTimecodeScale, timecode_scale_);
-  if (duration_ > 0.0)
-    size += EbmlElementSize(kMkvDuration, static_cast<float>(duration_));
-  if (date_utc_ != LLONG_MIN)
-    size += EbmlDateElementSize(kMkvDateUTC, date_utc_);
-  size += EbmlElementSize(kMkvMuxingApp, muxing_app_);
-  size += EbmlElementSize(kMkvWritingApp, writing_app_);
+  uint64 size = PayloadSize();
+  if (output_crc32_)
+    size += kCrc32ElementSize;
 
   if (!WriteEbmlMasterElement(writer, kMkvInfo, size))
     return false;
@@ -1912,13 +3173,49 @@ bool SegmentInfo::Write(IMkvWriter* writer) {
   if (payload_position < 0)
     return false;
 
+  if (output_crc32_) {
+    // Save for later
+    crc32_pos_ = payload_position;
+
+    Crc32MkvWriter crc32_writer(NULL);
+    if (!WritePayload(&crc32_writer) ||
+        !WriteCrc32Element(writer, crc32_writer.crc()))
+      return false;
+  }
+
+  if (duration_ > 0.0) {
+    // Save for later. The duration follows the timecode scale.
+    duration_pos_ = writer->Position() +
+                    EbmlElementSize(kMkvTimecodeScale, timecode_scale_);
+  }
+
+  if (!WritePayload(writer))
+    return false;
+
+  const int64 stop_position = writer->Position();
+  if (stop_position < 0 ||
+      stop_position - payload_position != static_cast<int64>(size))
+    return false;
+
+  return true;
+}
+
+uint64 SegmentInfo::PayloadSize() const {
+  uint64 size = EbmlElementSize(kMkvTimecodeScale, timecode_scale_);
+  if (duration_ > 0.0)
+    size += EbmlElementSize(kMkvDuration, static_cast<float>(duration_));
+  if (date_utc_ != LLONG_MIN)
+    size += EbmlDateElementSize(kMkvDateUTC, date_utc_);
+  size += EbmlElementSize(kMkvMuxingApp, muxing_app_);
+  size += EbmlElementSize(kMkvWritingApp, writing_app_);
+  return size;
+}
+
+bool SegmentInfo::WritePayload(IMkvWriter* writer) const {
   if (!WriteEbmlElement(writer, kMkvTimecodeScale, timecode_scale_))
     return false;
 
   if (duration_ > 0.0) {
-    // Save for later
-    duration_pos_ = writer->Position();
-
     if (!WriteEbmlElement(writer, kMkvDuration, static_cast<float>(duration_)))
       return false;
   }
@@ -1931,11 +3228,6 @@ bool SegmentInfo::Write(IMkvWriter* writer) {
   if (!WriteEbmlElement(writer, kMkvWritingApp, writing_app_))
     return false;
 
-  const int64 stop_position = writer->Position();
-  if (stop_position < 0 ||
-      stop_position - payload_position != static_cast<int64>(size))
-    return false;
-
   return true;
 }
 
@@ -1975,6 +3267,39 @@ void SegmentInfo::set_writing_app(const char* app) {
   }
 }
 
+///////////////////////////////////////////////////////////////
+//
+// ClusterPolicy Class
+
+ClusterPolicy::ClusterPolicy()
+    : min_cluster_duration_(0),
+      min_cluster_size_(0),
+      max_cluster_duration_(0),
+      max_cluster_size_(0),
+      lookahead_frames_(0) {}
+
+bool ClusterPolicy::IsValid() const {
+  if (max_cluster_duration_ > 0 &&
+      min_cluster_duration_ > max_cluster_duration_)
+    return false;
+  if (max_cluster_size_ > 0 && min_cluster_size_ > max_cluster_size_)
+    return false;
+  return lookahead_frames_ >= 0 && lookahead_frames_ <= kMaxLookaheadFrames;
+}
+
+bool ClusterPolicy::ReachedMin(uint64 duration, uint64 size) const {
+  if (min_cluster_duration_ == 0 && min_cluster_size_ == 0)
+    return true;
+
+  return (min_cluster_duration_ > 0 && duration >= min_cluster_duration_) ||
+         (min_cluster_size_ > 0 && size >= min_cluster_size_);
+}
+
+bool ClusterPolicy::ReachedMax(uint64 duration, uint64 size) const {
+  return (max_cluster_duration_ > 0 && duration >= max_cluster_duration_) ||
+         (max_cluster_size_ > 0 && size >= max_cluster_size_);
+}
+
 ///////////////////////////////////////////////////////////////
 //
 // Segment Class
@@ -1985,14 +3310,50 @@ Segment::Segment()
       chunk_writer_cluster_(NULL),
       chunk_writer_cues_(NULL),
       chunk_writer_header_(NULL),
+      chunk_sink_(NULL),
+      chunk_buffer_cluster_(NULL),
+      chunk_buffer_cues_(NULL),
+      chunk_buffer_header_(NULL),
       chunking_(false),
       chunking_base_name_(NULL),
       cluster_list_(NULL),
       cluster_list_capacity_(0),
       cluster_list_size_(0),
+      closed_clusters_size_(0),
       cues_position_(kAfterClusters),
-      cues_track_(0),
+      cues_reserve_duration_(0),
+      cues_reserve_interval_(0),
+      cues_reserved_size_(0),
+      cues_reserved_pos_(0),
+      cue_tracks_(NULL),
+      cue_tracks_size_(0),
+      cue_tracks_capacity_(0),
       force_new_cluster_(false),
+      buffer_clusters_(false),
+      max_cluster_buffer_size_(kDefaultMaxClusterBufferSize),
+      max_audio_hold_(0),
+      max_lace_duration_(0),
+      output_crc32_(false),
+      frame_transform_queue_(NULL),
+      frame_transform_threads_(0),
+      frame_transform_sequence_(0),
+      frame_transform_timestamp_(0),
+      frame_transform_error_(false),
+      has_cluster_policy_(false),
+      lookahead_frames_(NULL),
+      lookahead_head_(0),
+      lookahead_size_(0),
+      lookahead_key_frames_(0),
+      flush_callback_(NULL),
+      flush_max_blocks_(0),
+      flush_max_interval_(0),
+      flush_block_count_(0),
+      flush_timestamp_(0),
+      record_latency_(false),
+      collect_statistics_(false),
+      statistics_writer_cluster_(NULL),
+      statistics_writer_cues_(NULL),
+      statistics_writer_header_(NULL),
       frames_(NULL),
       frames_capacity_(0),
       frames_size_(0),
@@ -2003,7 +3364,6 @@ Segment::Segment()
       max_cluster_duration_(kDefaultMaxClusterDuration),
       max_cluster_size_(0),
       mode_(kFile),
-      new_cuepoint_(false),
       output_cues_(true),
       payload_pos_(0),
       size_position_(0),
@@ -2020,6 +3380,21 @@ Segment::Segment()
 }
 
 Segment::~Segment() {
+  delete frame_transform_queue_;
+
+  if (lookahead_frames_) {
+    for (int32 i = 0; i < lookahead_size_; ++i)
+      delete lookahead_frames_[(lookahead_head_ + i) % kLookaheadRingSize];
+    delete[] lookahead_frames_;
+  }
+
+  if (statistics_writer_cues_ != statistics_writer_cluster_ &&
+      statistics_writer_cues_ != statistics_writer_header_)
+    delete statistics_writer_cues_;
+  if (statistics_writer_cluster_ != statistics_writer_header_)
+    delete statistics_writer_cluster_;
+  delete statistics_writer_header_;
+
   if (cluster_list_) {
     for (int32 i = 0; i < cluster_list_size_; ++i) {
       Cluster* const cluster = cluster_list_[i];
@@ -2036,6 +3411,7 @@ Segment::~Segment() {
     delete[] frames_;
   }
 
+  delete[] cue_tracks_;
   delete[] chunk_name_;
   delete[] chunking_base_name_;
 
@@ -2051,44 +3427,27 @@ Segment::~Segment() {
     chunk_writer_header_->Close();
     delete chunk_writer_header_;
   }
-}
-
-void Segment::MoveCuesBeforeClustersHelper(uint64 diff, int32 index,
-                                           uint64* cues_size) {
-  CuePoint* const cue_point = cues_.GetCueByIndex(index);
-  if (cue_point == NULL)
-    return;
-  const uint64 old_cue_point_size = cue_point->Size();
-  const uint64 cluster_pos = cue_point->cluster_pos() + diff;
-  cue_point->set_cluster_pos(cluster_pos);  // update the new cluster position
-  // New size of the cue is computed as follows
-  //    Let a = current sum of size of all CuePoints
-  //    Let b = Increase in Cue Point's size due to this iteration
-  //    Let c = Increase in size of Cues Element's length due to this iteration
-  //            (This is computed as CodedSize(a + b) - CodedSize(a))
-  //    Let d = b + c. Now d is the |diff| passed to the next recursive call.
-  //    Let e = a + b. Now e is the |cues_size| passed to the next recursive
-  //                   call.
-  const uint64 cue_point_size_diff = cue_point->Size() - old_cue_point_size;
-  const uint64 cue_size_diff =
-      GetCodedUIntSize(*cues_size + cue_point_size_diff) -
-      GetCodedUIntSize(*cues_size);
-  *cues_size += cue_point_size_diff;
-  diff = cue_size_diff + cue_point_size_diff;
-  if (diff > 0) {
-    for (int32 i = 0; i < cues_.cue_entries_size(); ++i) {
-      MoveCuesBeforeClustersHelper(diff, i, cues_size);
-    }
-  }
+  delete chunk_buffer_cluster_;
+  delete chunk_buffer_cues_;
+  delete chunk_buffer_header_;
 }
 
 void Segment::MoveCuesBeforeClusters() {
-  const uint64 current_cue_size = cues_.Size();
-  uint64 cue_size = 0;
-  for (int32 i = 0; i < cues_.cue_entries_size(); ++i)
-    cue_size += cues_.GetCueByIndex(i)->Size();
-  for (int32 i = 0; i < cues_.cue_entries_size(); ++i)
-    MoveCuesBeforeClustersHelper(current_cue_size, i, &cue_size);
+  // Moving the Cues in front of the Clusters shifts every Cluster by the size
+  // of the Cues element, which in turn depends on the Cluster positions it
+  // holds. Starting from the current size, shift all CuePoints by the growth
+  // of the Cues element until its size no longer changes. The size can only
+  // grow as positions increase, so this converges, usually within two or
+  // three passes over the CuePoints.
+  uint64 offset = 0;
+  uint64 cues_size = cues_.Size();
+  while (cues_size != offset) {
+    const uint64 diff = cues_size - offset;
+    if (!cues_.ShiftClusterPositions(diff))
+      return;
+    offset = cues_size;
+    cues_size = cues_.Size();
+  }
 
   // Adjust the Seek Entry to reflect the change in position
   // of Cluster and Cues
@@ -2120,8 +3479,20 @@ bool Segment::CopyAndMoveCuesBeforeClusters(mkvparser::IMkvReader* reader,
                                             IMkvWriter* writer) {
   if (!writer->Seekable() || chunking_)
     return false;
-  const int64 cluster_offset =
-      cluster_list_[0]->size_position() - GetUIntSize(kMkvCluster);
+
+  // The Cues were written in place in the reserved space.
+  if (cues_position_ == kBeforeClusters)
+    return ChunkedCopy(reader, writer, 0, cluster_end_offset_);
+
+  // The first Cluster has been released already, so take its position from
+  // the SeekHead.
+  int64 cluster_offset = -1;
+  for (int32 i = 0; i < SeekHead::kSeekEntryCount; ++i) {
+    if (seek_head_.GetId(i) == kMkvCluster)
+      cluster_offset = payload_pos_ + seek_head_.GetPosition(i);
+  }
+  if (cluster_offset < 0)
+    return false;
 
   // Copy the headers.
   if (!ChunkedCopy(reader, writer, 0, cluster_offset))
@@ -2153,59 +3524,122 @@ bool Segment::CopyAndMoveCuesBeforeClusters(mkvparser::IMkvReader* reader,
 }
 
 bool Segment::Finalize() {
+  uint64 phase_start_ns = collect_statistics_ ? GetMonotonicTimeNs() : 0;
+
+  if (frame_transform_error_ || !MuxTransformedFrames(true) ||
+      !MuxLookaheadFrames(0))
+    return false;
+
   if (WriteFramesAll() < 0)
     return false;
 
+  // In file mode the updates of data already written are collected and
+  // written in file order once the segment is complete, so that the writer
+  // seeks as little as possible.
+  PatchMkvWriter patch_writer(writer_header_);
+  const bool patching = mode_ == kFile && !chunking_ && writer_header_ &&
+                        writer_header_->Seekable();
+  IMkvWriter* const header_writer = patching ? &patch_writer : writer_header_;
+  IMkvWriter* const cues_writer = patching ? &patch_writer : writer_cues_;
+
+  if (cluster_list_size_ > 0) {
+    // Output the pending lace of the last cluster.
+    Cluster* const old_cluster = cluster_list_[cluster_list_size_ - 1];
+
+    if (!old_cluster || !old_cluster->FlushLace())
+      return false;
+  }
+
+  if (mode_ == kLive && buffer_clusters_ && cluster_list_size_ > 0) {
+    // Output the last cluster, which is still held in memory.
+    Cluster* const old_cluster = cluster_list_[cluster_list_size_ - 1];
+
+    if (!old_cluster || !old_cluster->Finalize())
+      return false;
+  }
+
+  if (mode_ == kLive && chunking_) {
+    if (!CompleteChunk(IMkvChunkSink::kCluster,
+                       last_timestamp_ + last_block_duration_))
+      return false;
+    chunk_count_++;
+  }
+
   if (mode_ == kFile) {
     if (cluster_list_size_ > 0) {
       // Update last cluster's size
       Cluster* const old_cluster = cluster_list_[cluster_list_size_ - 1];
 
-      if (!old_cluster || !old_cluster->Finalize())
+      if (!old_cluster ||
+          !old_cluster->Finalize(patching ? &patch_writer : NULL))
         return false;
     }
 
-    if (chunking_ && chunk_writer_cluster_) {
-      chunk_writer_cluster_->Close();
+    if (chunking_) {
+      if (!CompleteChunk(IMkvChunkSink::kCluster,
+                         last_timestamp_ + last_block_duration_))
+        return false;
       chunk_count_++;
     }
+  }
 
+  if (collect_statistics_ && cluster_list_size_ > 0)
+    statistics_.AddClosedCluster(cluster_list_[cluster_list_size_ - 1]->Size());
+  EndFinalizePhase(MuxerStatistics::kFinalizeClusters, &phase_start_ns);
+
+  if (mode_ == kFile) {
     const double duration =
         (static_cast<double>(last_timestamp_) + last_block_duration_) /
         segment_info_.timecode_scale();
     segment_info_.set_duration(duration);
-    if (!segment_info_.Finalize(writer_header_))
+    if (!segment_info_.Finalize(header_writer))
       return false;
+    EndFinalizePhase(MuxerStatistics::kFinalizeInfo, &phase_start_ns);
 
-    if (output_cues_)
+    const bool cues_in_reserved_space = output_cues_ && CuesFitReservedSpace();
+
+    if (cues_in_reserved_space) {
+      if (!seek_head_.AddSeekEntry(kMkvCues,
+                                   cues_reserved_pos_ - payload_pos_))
+        return false;
+    } else if (output_cues_) {
       if (!seek_head_.AddSeekEntry(kMkvCues, MaxOffset()))
         return false;
+    }
 
-    if (chunking_) {
-      if (!chunk_writer_cues_)
+    if (chunking_ && !StartChunk(IMkvChunkSink::kCues))
+      return false;
+
+    cluster_end_offset_ = writer_cluster_->Position();
+
+    // Write the seek headers and cues
+    if (cues_in_reserved_space) {
+      const int64 pos = cues_writer->Position();
+      if (cues_writer->Position(cues_reserved_pos_))
         return false;
 
-      char* name = NULL;
-      if (!UpdateChunkName("cues", &name))
+      if (!cues_.Write(cues_writer))
         return false;
 
-      const bool cues_open = chunk_writer_cues_->Open(name);
-      delete[] name;
-      if (!cues_open)
+      const uint64 slack = cues_reserved_size_ - cues_.Size();
+      if (slack > 0 && !WriteVoidElement(cues_writer, slack))
         return false;
-    }
 
-    cluster_end_offset_ = writer_cluster_->Position();
+      if (cues_writer->Position(pos))
+        return false;
 
-    // Write the seek headers and cues
-    if (output_cues_)
-      if (!cues_.Write(writer_cues_))
+      cues_position_ = kBeforeClusters;
+    } else if (output_cues_) {
+      if (!cues_.Write(cues_writer))
         return false;
+    }
+    EndFinalizePhase(MuxerStatistics::kFinalizeCues, &phase_start_ns);
 
-    if (!seek_head_.Finalize(writer_header_))
+    if (!seek_head_.Finalize(header_writer))
       return false;
+    EndFinalizePhase(MuxerStatistics::kFinalizeSeekHead, &phase_start_ns);
 
-    if (writer_header_->Seekable()) {
+    if (header_writer->Seekable()) {
       if (size_position_ == -1)
         return false;
 
@@ -2213,39 +3647,41 @@ bool Segment::Finalize() {
       if (segment_size < 1)
         return false;
 
-      const int64 pos = writer_header_->Position();
+      const int64 pos = header_writer->Position();
       UpdateDocTypeVersion();
       if (doc_type_version_ != doc_type_version_written_) {
-        if (writer_header_->Position(0))
+        if (header_writer->Position(0))
           return false;
 
-        if (!WriteEbmlHeader(writer_header_, doc_type_version_))
+        if (!WriteEbmlHeader(header_writer, doc_type_version_))
           return false;
-        if (writer_header_->Position() != ebml_header_size_)
+        if (header_writer->Position() != ebml_header_size_)
           return false;
 
         doc_type_version_written_ = doc_type_version_;
       }
 
-      if (writer_header_->Position(size_position_))
+      if (header_writer->Position(size_position_))
         return false;
 
-      if (WriteUIntSize(writer_header_, segment_size, 8))
+      if (WriteUIntSize(header_writer, segment_size, 8))
         return false;
 
-      if (writer_header_->Position(pos))
+      if (header_writer->Position(pos))
         return false;
     }
 
+    if (patching && !patch_writer.Flush())
+      return false;
+
     if (chunking_) {
       // Do not close any writers until the segment size has been written,
       // otherwise the size may be off.
-      if (!chunk_writer_cues_ || !chunk_writer_header_)
+      if (!CompleteChunk(IMkvChunkSink::kCues, 0) ||
+          !CompleteChunk(IMkvChunkSink::kHeader, 0))
         return false;
-
-      chunk_writer_cues_->Close();
-      chunk_writer_header_->Close();
     }
+    EndFinalizePhase(MuxerStatistics::kFinalizeSegmentSize, &phase_start_ns);
   }
 
   return true;
@@ -2291,18 +3727,28 @@ bool Segment::AddCuePoint(uint64 timestamp, uint64 track) {
   if (!cluster)
     return false;
 
+  const uint64 time = timestamp / segment_info_.timecode_scale();
+  const int32 last_index = cues_.cue_entries_size() - 1;
+  const CuePoint* const last_cue = cues_.GetCueByIndex(last_index);
+  if (last_cue && last_cue->time() == time && !last_cue->HasTrack(track)) {
+    return cues_.AddTrackPosition(last_index, track,
+                                  cluster->position_for_cues(),
+                                  cluster->blocks_added());
+  }
+
   CuePoint* const cue = new (std::nothrow) CuePoint();  // NOLINT
   if (!cue)
     return false;
 
-  cue->set_time(timestamp / segment_info_.timecode_scale());
+  cue->set_time(time);
   cue->set_block_number(cluster->blocks_added());
   cue->set_cluster_pos(cluster->position_for_cues());
   cue->set_track(track);
-  if (!cues_.AddCue(cue))
+  if (!cues_.AddCue(cue)) {
+    delete cue;
     return false;
+  }
 
-  new_cuepoint_ = false;
   return true;
 }
 
@@ -2326,6 +3772,8 @@ bool Segment::AddFrame(const uint8* frame, uint64 length, uint64 track_number,
   if (!frame)
     return false;
 
+  const uint64 ingest_time = IngestTime();
+
   if (!CheckHeaderInfo())
     return false;
 
@@ -2334,24 +3782,14 @@ bool Segment::AddFrame(const uint8* frame, uint64 length, uint64 track_number,
     return false;
 
   // Check if the track number is valid.
-  if (!tracks_.GetTrackByNumber(track_number))
+  const Track* const track = tracks_.GetTrackByNumber(track_number);
+  if (!track)
     return false;
 
-  // If the segment has a video track hold onto audio frames to make sure the
-  // audio that is associated with the start time of a video key-frame is
-  // muxed into the same cluster.
-  if (has_video_ && tracks_.TrackIsAudio(track_number) && !force_new_cluster_) {
-    Frame* const new_frame = new (std::nothrow) Frame();
-    if (new_frame == NULL || !new_frame->Init(frame, length))
-      return false;
-    new_frame->set_track_number(track_number);
-    new_frame->set_timestamp(timestamp);
-    new_frame->set_is_key(is_key);
-
-    if (!QueueFrame(new_frame))
-      return false;
-
-    return true;
+  if (DefersFrames(track)) {
+    Frame* const new_frame =
+        NewFrame(frame, length, track_number, timestamp, is_key, ingest_time);
+    return new_frame != NULL && DeferFrame(new_frame, track);
   }
 
   if (!DoNewClusterProcessing(track_number, timestamp, is_key))
@@ -2367,18 +3805,23 @@ bool Segment::AddFrame(const uint8* frame, uint64 length, uint64 track_number,
   const uint64 timecode_scale = segment_info_.timecode_scale();
   const uint64 abs_timecode = timestamp / timecode_scale;
 
-  if (!cluster->AddFrame(frame, length, track_number, abs_timecode, is_key))
+  const uint64 lace_frame_duration = LaceFrameDuration(track_number);
+  const bool added =
+      lace_frame_duration > 0
+          ? cluster->AddLacedFrame(frame, length, track_number, abs_timecode,
+                                   lace_frame_duration, is_key)
+          : cluster->AddFrame(frame, length, track_number, abs_timecode,
+                              is_key);
+  if (!added)
     return false;
 
-  if (new_cuepoint_ && cues_track_ == track_number) {
-    if (!AddCuePoint(timestamp, cues_track_))
-      return false;
-  }
+  if (!CheckCuePoint(timestamp, track_number))
+    return false;
 
   if (timestamp > last_timestamp_)
     last_timestamp_ = timestamp;
 
-  return true;
+  return OnBlockWritten(timestamp, ingest_time);
 }
 
 bool Segment::AddFrameWithAdditional(const uint8* frame, uint64 length,
@@ -2389,6 +3832,8 @@ bool Segment::AddFrameWithAdditional(const uint8* frame, uint64 length,
   if (frame == NULL || additional == NULL)
     return false;
 
+  const uint64 ingest_time = IngestTime();
+
   if (!CheckHeaderInfo())
     return false;
 
@@ -2397,24 +3842,19 @@ bool Segment::AddFrameWithAdditional(const uint8* frame, uint64 length,
     return false;
 
   // Check if the track number is valid.
-  if (!tracks_.GetTrackByNumber(track_number))
+  const Track* const track = tracks_.GetTrackByNumber(track_number);
+  if (!track)
     return false;
 
-  // If the segment has a video track hold onto audio frames to make sure the
-  // audio that is associated with the start time of a video key-frame is
-  // muxed into the same cluster.
-  if (has_video_ && tracks_.TrackIsAudio(track_number) && !force_new_cluster_) {
-    Frame* const new_frame = new (std::nothrow) Frame();
-    if (new_frame == NULL || !new_frame->Init(frame, length))
-      return false;
-    new_frame->set_track_number(track_number);
-    new_frame->set_timestamp(timestamp);
-    new_frame->set_is_key(is_key);
-
-    if (!QueueFrame(new_frame))
+  if (DefersFrames(track)) {
+    Frame* const new_frame =
+        NewFrame(frame, length, track_number, timestamp, is_key, ingest_time);
+    if (new_frame == NULL ||
+        !new_frame->AddAdditionalData(additional, additional_length, add_id)) {
+      delete new_frame;
       return false;
-
-    return true;
+    }
+    return DeferFrame(new_frame, track);
   }
 
   if (!DoNewClusterProcessing(track_number, timestamp, is_key))
@@ -2435,15 +3875,13 @@ bool Segment::AddFrameWithAdditional(const uint8* frame, uint64 length,
                                        abs_timecode, is_key))
     return false;
 
-  if (new_cuepoint_ && cues_track_ == track_number) {
-    if (!AddCuePoint(timestamp, cues_track_))
-      return false;
-  }
+  if (!CheckCuePoint(timestamp, track_number))
+    return false;
 
   if (timestamp > last_timestamp_)
     last_timestamp_ = timestamp;
 
-  return true;
+  return OnBlockWritten(timestamp, ingest_time);
 }
 
 bool Segment::AddFrameWithDiscardPadding(const uint8* frame, uint64 length,
@@ -2453,6 +3891,8 @@ bool Segment::AddFrameWithDiscardPadding(const uint8* frame, uint64 length,
   if (frame == NULL)
     return false;
 
+  const uint64 ingest_time = IngestTime();
+
   if (!CheckHeaderInfo())
     return false;
 
@@ -2461,28 +3901,20 @@ bool Segment::AddFrameWithDiscardPadding(const uint8* frame, uint64 length,
     return false;
 
   // Check if the track_number is valid.
-  if (!tracks_.GetTrackByNumber(track_number))
+  const Track* const track = tracks_.GetTrackByNumber(track_number);
+  if (!track)
     return false;
 
   if (discard_padding != 0)
     doc_type_version_ = 4;
 
-  // If the segment has a video track hold onto audio frames to make sure the
-  // audio that is associated with the start time of a video key-frame is
-  // muxed into the same cluster.
-  if (has_video_ && tracks_.TrackIsAudio(track_number) && !force_new_cluster_) {
-    Frame* const new_frame = new (std::nothrow) Frame();
-    if (new_frame == NULL || !new_frame->Init(frame, length))
+  if (DefersFrames(track)) {
+    Frame* const new_frame =
+        NewFrame(frame, length, track_number, timestamp, is_key, ingest_time);
+    if (new_frame == NULL)
       return false;
-    new_frame->set_track_number(track_number);
-    new_frame->set_timestamp(timestamp);
-    new_frame->set_is_key(is_key);
     new_frame->set_discard_padding(discard_padding);
-
-    if (!QueueFrame(new_frame))
-      return false;
-
-    return true;
+    return DeferFrame(new_frame, track);
   }
 
   if (!DoNewClusterProcessing(track_number, timestamp, is_key))
@@ -2503,15 +3935,13 @@ bool Segment::AddFrameWithDiscardPadding(const uint8* frame, uint64 length,
     return false;
   }
 
-  if (new_cuepoint_ && cues_track_ == track_number) {
-    if (!AddCuePoint(timestamp, cues_track_))
-      return false;
-  }
+  if (!CheckCuePoint(timestamp, track_number))
+    return false;
 
   if (timestamp > last_timestamp_)
     last_timestamp_ = timestamp;
 
-  return true;
+  return OnBlockWritten(timestamp, ingest_time);
 }
 
 bool Segment::AddMetadata(const uint8* frame, uint64 length,
@@ -2520,6 +3950,8 @@ bool Segment::AddMetadata(const uint8* frame, uint64 length,
   if (!frame)
     return false;
 
+  const uint64 ingest_time = IngestTime();
+
   if (!CheckHeaderInfo())
     return false;
 
@@ -2528,9 +3960,19 @@ bool Segment::AddMetadata(const uint8* frame, uint64 length,
     return false;
 
   // Check if the track number is valid.
-  if (!tracks_.GetTrackByNumber(track_number))
+  const Track* const track = tracks_.GetTrackByNumber(track_number);
+  if (!track)
     return false;
 
+  if (UseFrameTransformQueue(track)) {
+    Frame* const new_frame =
+        NewFrame(frame, length, track_number, timestamp_ns, true, ingest_time);
+    if (new_frame == NULL)
+      return false;
+    new_frame->set_duration(duration_ns);
+    return SubmitFrame(new_frame, track);
+  }
+
   if (!DoNewClusterProcessing(track_number, timestamp_ns, true))
     return false;
 
@@ -2550,10 +3992,13 @@ bool Segment::AddMetadata(const uint8* frame, uint64 length,
                             duration_timecode))
     return false;
 
+  if (!CheckCuePoint(timestamp_ns, track_number))
+    return false;
+
   if (timestamp_ns > last_timestamp_)
     last_timestamp_ = timestamp_ns;
 
-  return true;
+  return OnBlockWritten(timestamp_ns, ingest_time);
 }
 
 bool Segment::AddGenericFrame(const Frame* frame) {
@@ -2580,10 +4025,175 @@ bool Segment::AddGenericFrame(const Frame* frame) {
   }
 }
 
+bool Segment::AddFrames(const Frame* const* frames, int32 count) {
+  if (!frames || count < 0)
+    return false;
+
+  const uint64 ingest_time = IngestTime();
+
+  if (!CheckHeaderInfo())
+    return false;
+
+  // Validate the whole batch first. Consecutive frames mostly belong to a
+  // few tracks, so remember the last track looked up.
+  const Track* track = NULL;
+  uint64 timestamp = MinNextTimestamp();
+  for (int32 i = 0; i < count; ++i) {
+    const Frame* const frame = frames[i];
+    if (!frame || !frame->frame() || frame->timestamp() < timestamp)
+      return false;
+    timestamp = frame->timestamp();
+
+    if (!track || track->number() != frame->track_number()) {
+      track = tracks_.GetTrackByNumber(frame->track_number());
+      if (!track)
+        return false;
+    }
+  }
+
+  track = NULL;
+  for (int32 i = 0; i < count; ++i) {
+    const Frame* const frame = frames[i];
+    if (!track || track->number() != frame->track_number())
+      track = tracks_.GetTrackByNumber(frame->track_number());
+
+    if (UseFrameTransformQueue(track) || UseLookahead()) {
+      Frame* const new_frame = CopyFrame(*frame, ingest_time);
+      if (new_frame == NULL || !DeferFrame(new_frame, track))
+        return false;
+      continue;
+    }
+
+    if (!AddValidatedFrame(frame, track, ingest_time))
+      return false;
+  }
+
+  return true;
+}
+
+bool Segment::AddBlockPassthrough(mkvparser::IMkvReader* reader,
+                                  const mkvparser::Block& block,
+                                  uint64 track_number, uint64 timestamp) {
+  if (!reader || block.m_start < 0 || block.m_size <= 0)
+    return false;
+
+  const bool is_key = block.IsKey();
+
+  const uint64 ingest_time = IngestTime();
+
+  if (!CheckHeaderInfo())
+    return false;
+
+  // Check for non-monotonically increasing timestamps, including the frames
+  // that are still held back.
+  if (timestamp < MinNextTimestamp())
+    return false;
+
+  // Check if the track number is valid. The payload is copied as is, so it
+  // can not be transformed.
+  const Track* const track = tracks_.GetTrackByNumber(track_number);
+  if (!track || track->frame_transform())
+    return false;
+
+  // Blocks that can not be written right away are held back as frames that
+  // refer to the payload in |reader|.
+  if (DefersFrames(track)) {
+    Frame* const new_frame = new (std::nothrow) Frame();  // NOLINT
+    if (new_frame == NULL ||
+        !new_frame->InitPassthrough(reader, block.m_start, block.m_size)) {
+      delete new_frame;
+      return false;
+    }
+    new_frame->set_track_number(track_number);
+    new_frame->set_timestamp(timestamp);
+    new_frame->set_is_key(is_key);
+    new_frame->set_ingest_time(ingest_time);
+    return DeferFrame(new_frame, track);
+  }
+
+  if (!DoNewClusterProcessing(track_number, timestamp, is_key))
+    return false;
+
+  if (cluster_list_size_ < 1)
+    return false;
+
+  Cluster* const cluster = cluster_list_[cluster_list_size_ - 1];
+  if (!cluster)
+    return false;
+
+  const uint64 abs_timecode = timestamp / segment_info_.timecode_scale();
+
+  if (!cluster->AddBlockPassthrough(reader, block.m_start, block.m_size,
+                                    track_number, abs_timecode, is_key))
+    return false;
+
+  if (!CheckCuePoint(timestamp, track_number))
+    return false;
+
+  if (timestamp > last_timestamp_)
+    last_timestamp_ = timestamp;
+
+  return OnBlockWritten(timestamp, ingest_time);
+}
+
 void Segment::OutputCues(bool output_cues) { output_cues_ = output_cues; }
 
+void Segment::set_output_crc32(bool output_crc32) {
+  output_crc32_ = output_crc32;
+  seek_head_.set_output_crc32(output_crc32);
+  segment_info_.set_output_crc32(output_crc32);
+  tracks_.set_output_crc32(output_crc32);
+  chapters_.set_output_crc32(output_crc32);
+  cues_.set_output_crc32(output_crc32);
+}
+
+bool Segment::SetClusterPolicy(const ClusterPolicy& policy) {
+  if (!policy.IsValid())
+    return false;
+
+  cluster_policy_ = policy;
+  has_cluster_policy_ = true;
+  return true;
+}
+
+const ClusterPolicy* Segment::cluster_policy() const {
+  return has_cluster_policy_ ? &cluster_policy_ : NULL;
+}
+
+bool Segment::SetFrameTransform(uint64 track_number,
+                                const IMkvFrameTransform* transform) {
+  Track* const track = tracks_.GetTrackByNumber(track_number);
+  if (!track)
+    return false;
+
+  track->set_frame_transform(transform);
+  return true;
+}
+
+bool Segment::SetFrameTransformThreads(int32 num_threads) {
+  if (num_threads < 0 || frame_transform_queue_)
+    return false;
+
+  frame_transform_threads_ = num_threads;
+  return true;
+}
+
+bool Segment::SetFlushCallback(IMkvFlushCallback* callback, int32 max_blocks,
+                               uint64 max_interval_ns) {
+  if (max_blocks < 0)
+    return false;
+
+  flush_callback_ = callback;
+  flush_max_blocks_ = max_blocks;
+  flush_max_interval_ = max_interval_ns;
+  flush_block_count_ = 0;
+  flush_timestamp_ = last_timestamp_;
+
+  return true;
+}
+
 bool Segment::SetChunking(bool chunking, const char* filename) {
-  if (chunk_count_ > 0)
+  if (chunk_count_ > 0 || chunk_sink_)
     return false;
 
   if (chunking) {
@@ -2638,11 +4248,9 @@ bool Segment::SetChunking(bool chunking, const char* filename) {
       return false;
 
 #ifdef _MSC_VER
-    strcpy_s(header, header_length - strlen(".hdr"), chunking_base_name_);
-    strcat_s(header, header_length, ".hdr");
+    sprintf_s(header, header_length, "%s.hdr", chunking_base_name_);
 #else
-    strcpy(header, chunking_base_name_);
-    strcat(header, ".hdr");
+    snprintf(header, header_length, "%s.hdr", chunking_base_name_);
 #endif
     if (!chunk_writer_header_->Open(header)) {
       delete[] header;
@@ -2661,22 +4269,106 @@ bool Segment::SetChunking(bool chunking, const char* filename) {
   return true;
 }
 
+bool Segment::SetChunkSink(IMkvChunkSink* sink) {
+  if (!sink || chunking_ || header_written_)
+    return false;
+
+  if (!chunk_buffer_cluster_) {
+    chunk_buffer_cluster_ = new (std::nothrow) MemoryMkvWriter();  // NOLINT
+    if (!chunk_buffer_cluster_)
+      return false;
+  }
+
+  if (!chunk_buffer_cues_) {
+    chunk_buffer_cues_ = new (std::nothrow) MemoryMkvWriter();  // NOLINT
+    if (!chunk_buffer_cues_)
+      return false;
+  }
+
+  if (!chunk_buffer_header_) {
+    chunk_buffer_header_ = new (std::nothrow) MemoryMkvWriter();  // NOLINT
+    if (!chunk_buffer_header_)
+      return false;
+  }
+
+  chunk_sink_ = sink;
+  writer_cluster_ = chunk_buffer_cluster_;
+  writer_cues_ = chunk_buffer_cues_;
+  writer_header_ = chunk_buffer_header_;
+  chunking_ = true;
+
+  return true;
+}
+
 bool Segment::CuesTrack(uint64 track_number) {
   const Track* const track = GetTrackByNumber(track_number);
   if (!track)
     return false;
 
-  cues_track_ = track_number;
+  cue_tracks_size_ = 0;
+  return AddCuesTrack(track_number, 0);
+}
+
+bool Segment::AddCuesTrack(uint64 track_number, uint64 min_interval_ns) {
+  const Track* const track = GetTrackByNumber(track_number);
+  if (!track)
+    return false;
+
+  CueTrack* cue_track = GetCueTrack(track_number);
+  if (!cue_track) {
+    if (cue_tracks_size_ + 1 > cue_tracks_capacity_) {
+      const int32 new_capacity =
+          (!cue_tracks_capacity_) ? 2 : cue_tracks_capacity_ * 2;
+
+      CueTrack* const cue_tracks =
+          new (std::nothrow) CueTrack[new_capacity];  // NOLINT
+      if (!cue_tracks)
+        return false;
+
+      for (int32 i = 0; i < cue_tracks_size_; ++i)
+        cue_tracks[i] = cue_tracks_[i];
+
+      delete[] cue_tracks_;
+      cue_tracks_ = cue_tracks;
+      cue_tracks_capacity_ = new_capacity;
+    }
+
+    cue_track = &cue_tracks_[cue_tracks_size_++];
+    cue_track->track_number = track_number;
+    cue_track->last_cue_time = 0;
+    cue_track->has_cue = false;
+    cue_track->new_cuepoint = false;
+  }
+
+  cue_track->min_interval = min_interval_ns;
+  return true;
+}
+
+bool Segment::ReserveCuesSpace(uint64 duration_ns, uint64 cue_interval_ns) {
+  if (header_written_ || duration_ns == 0 || cue_interval_ns == 0)
+    return false;
+
+  cues_reserve_duration_ = duration_ns;
+  cues_reserve_interval_ = cue_interval_ns;
   return true;
 }
 
-void Segment::ForceNewClusterOnNextFrame() { force_new_cluster_ = true; }
+void Segment::ForceNewClusterOnNextFrame() {
+  // The new cluster starts with the next frame added, so the frames that are
+  // still being transformed go to the current one.
+  if (!MuxTransformedFrames(true) || !MuxLookaheadFrames(0))
+    frame_transform_error_ = true;
+  force_new_cluster_ = true;
+}
 
 Track* Segment::GetTrackByNumber(uint64 track_number) const {
   return tracks_.GetTrackByNumber(track_number);
 }
 
 bool Segment::WriteSegmentHeader() {
+  if (collect_statistics_ && !WrapStatisticsWriters())
+    return false;
+
   UpdateDocTypeVersion();
 
   // TODO(fgalligan): Support more than one segment.
@@ -2728,11 +4420,19 @@ bool Segment::WriteSegmentHeader() {
       return false;
   }
 
-  if (chunking_ && (mode_ == kLive || !writer_header_->Seekable())) {
-    if (!chunk_writer_header_)
+  if (cues_reserve_duration_ > 0 && output_cues_ && mode_ == kFile &&
+      !chunking_ && writer_header_->Seekable()) {
+    const uint64 cues_size = EstimateCuesSize();
+
+    cues_reserved_pos_ = writer_header_->Position();
+    if (!WriteVoidElement(writer_header_, cues_size))
       return false;
+    cues_reserved_size_ = cues_size;
+  }
 
-    chunk_writer_header_->Close();
+  if (chunking_ && (mode_ == kLive || !writer_header_->Seekable())) {
+    if (!CompleteChunk(IMkvChunkSink::kHeader, 0))
+      return false;
   }
 
   header_written_ = true;
@@ -2740,21 +4440,66 @@ bool Segment::WriteSegmentHeader() {
   return true;
 }
 
+uint64 Segment::EstimateCuesSize() const {
+  const uint64 timecode_scale = segment_info_.timecode_scale();
+
+  // Size each CuePoint for the largest values expected in the segment. Cluster
+  // positions are assumed to stay below 1 TB.
+  CuePoint cue;
+  cue.set_time(cues_reserve_duration_ / timecode_scale);
+  cue.set_track(0x3FFF);
+  cue.set_cluster_pos(0xFFFFFFFFFFULL);
+  cue.set_block_number(0x3FFF);
+  cue.set_output_block_number(cues_.output_block_number());
+
+  // Each cues track is assumed to have its own CuePoints, no closer together
+  // than its interval. The cues track chosen by default has no interval.
+  uint64 cue_count = 0;
+  for (int32 i = 0; i < cue_tracks_size_; ++i) {
+    const uint64 interval = cue_tracks_[i].min_interval > cues_reserve_interval_
+                                ? cue_tracks_[i].min_interval
+                                : cues_reserve_interval_;
+    cue_count += cues_reserve_duration_ / interval + 1;
+  }
+  if (cue_tracks_size_ == 0)
+    cue_count = cues_reserve_duration_ / cues_reserve_interval_ + 1;
+
+  uint64 payload_size = cue_count * cue.Size();
+  if (cues_.output_crc32())
+    payload_size += kCrc32ElementSize;
+  return EbmlMasterElementSize(kMkvCues, payload_size) + payload_size;
+}
+
+bool Segment::CuesFitReservedSpace() {
+  if (cues_reserved_size_ == 0 || cues_.cue_entries_size() < 1)
+    return false;
+
+  // Any space left over must be large enough to hold a Void element.
+  const uint64 cues_size = cues_.Size();
+  return cues_size == cues_reserved_size_ ||
+         cues_size + 2 <= cues_reserved_size_;
+}
+
 // Here we are testing whether to create a new cluster, given a frame
 // having time frame_timestamp_ns.
 //
 int Segment::TestFrame(uint64 track_number, uint64 frame_timestamp_ns,
-                       bool is_key) const {
-  if (force_new_cluster_)
+                       bool is_key,
+                       MuxerStatistics::ClusterReason* reason) const {
+  if (force_new_cluster_) {
+    *reason = MuxerStatistics::kForcedCluster;
     return 1;
+  }
 
   // If no clusters have been created yet, then create a new cluster
   // and write this frame immediately, in the new cluster.  This path
   // should only be followed once, the first time we attempt to write
   // a frame.
 
-  if (cluster_list_size_ <= 0)
+  if (cluster_list_size_ <= 0) {
+    *reason = MuxerStatistics::kFirstCluster;
     return 1;
+  }
 
   // There exists at least one cluster. We must compare the frame to
   // the last cluster, in order to determine whether the frame is
@@ -2782,15 +4527,27 @@ int Segment::TestFrame(uint64 track_number, uint64 frame_timestamp_ns,
 
   const int64 delta_timecode = frame_timecode - last_cluster_timecode;
 
-  if (delta_timecode > kMaxBlockTimecode)
+  if (delta_timecode > kMaxBlockTimecode) {
+    *reason = MuxerStatistics::kTimecodeOverflowCluster;
     return 2;
+  }
+
+  // Frames of a pending lace are part of the cluster already.
+  const uint64 cluster_size =
+      last_cluster->payload_size() + last_cluster->pending_size();
+
+  if (has_cluster_policy_)
+    return TestClusterPolicy(track_number, delta_timecode * timecode_scale,
+                             cluster_size, is_key, reason);
 
   // We decide to create a new cluster when we have a video keyframe.
   // This will flush queued (audio) frames, and write the keyframe
   // immediately, in the newly-created cluster.
 
-  if (is_key && tracks_.TrackIsVideo(track_number))
+  if (is_key && tracks_.TrackIsVideo(track_number)) {
+    *reason = MuxerStatistics::kKeyFrameCluster;
     return 1;
+  }
 
   // Create a new cluster if we have accumulated too many frames
   // already, where "too many" is defined as "the total time of frames
@@ -2798,21 +4555,51 @@ int Segment::TestFrame(uint64 track_number, uint64 frame_timestamp_ns,
 
   const uint64 delta_ns = delta_timecode * timecode_scale;
 
-  if (max_cluster_duration_ > 0 && delta_ns >= max_cluster_duration_)
+  if (max_cluster_duration_ > 0 && delta_ns >= max_cluster_duration_) {
+    *reason = MuxerStatistics::kDurationCluster;
     return 1;
+  }
 
   // This is similar to the case above, with the difference that a new
   // cluster is created when the size of the current cluster exceeds a
   // threshold.
 
-  const uint64 cluster_size = last_cluster->payload_size();
-
-  if (max_cluster_size_ > 0 && cluster_size >= max_cluster_size_)
+  if (max_cluster_size_ > 0 && cluster_size >= max_cluster_size_) {
+    *reason = MuxerStatistics::kSizeCluster;
     return 1;
+  }
+
+  // There's no need to create a new cluster, so emit this frame now.
+
+  return 0;
+}
+
+int Segment::TestClusterPolicy(uint64 track_number, uint64 cluster_duration,
+                               uint64 cluster_size, bool is_key,
+                               MuxerStatistics::ClusterReason* reason) const {
+  const bool reached_max =
+      cluster_policy_.ReachedMax(cluster_duration, cluster_size);
+
+  // Video key frames start a cluster once it is long or big enough.
+  if (is_key && tracks_.TrackIsVideo(track_number)) {
+    if (reached_max || cluster_policy_.ReachedMin(cluster_duration,
+                                                  cluster_size)) {
+      *reason = MuxerStatistics::kKeyFrameCluster;
+      return 1;
+    }
+    return 0;
+  }
 
-  // There's no need to create a new cluster, so emit this frame now.
+  // Past the maximum, wait for a video key frame coming up shortly, and
+  // split the cluster at the current frame otherwise.
+  if (!reached_max || lookahead_key_frames_ > 0)
+    return 0;
 
-  return 0;
+  const uint64 max_duration = cluster_policy_.max_cluster_duration();
+  *reason = (max_duration > 0 && cluster_duration >= max_duration)
+                ? MuxerStatistics::kDurationCluster
+                : MuxerStatistics::kSizeCluster;
+  return 1;
 }
 
 bool Segment::MakeNewCluster(uint64 frame_timestamp_ns) {
@@ -2840,29 +4627,27 @@ bool Segment::MakeNewCluster(uint64 frame_timestamp_ns) {
   if (!WriteFramesLessThan(frame_timestamp_ns))
     return false;
 
-  if (mode_ == kFile) {
-    if (cluster_list_size_ > 0) {
-      // Update old cluster's size
-      Cluster* const old_cluster = cluster_list_[cluster_list_size_ - 1];
-
-      if (!old_cluster || !old_cluster->Finalize())
-        return false;
-    }
+  if (cluster_list_size_ > 0) {
+    // Output the pending lace of the old cluster.
+    Cluster* const old_cluster = cluster_list_[cluster_list_size_ - 1];
 
-    if (output_cues_)
-      new_cuepoint_ = true;
+    if (!old_cluster || !old_cluster->FlushLace())
+      return false;
   }
 
-  if (chunking_ && cluster_list_size_ > 0) {
-    chunk_writer_cluster_->Close();
-    chunk_count_++;
+  if ((mode_ == kFile || buffer_clusters_) && cluster_list_size_ > 0) {
+    // Update old cluster's size
+    Cluster* const old_cluster = cluster_list_[cluster_list_size_ - 1];
 
-    if (!UpdateChunkName("chk", &chunk_name_))
-      return false;
-    if (!chunk_writer_cluster_->Open(chunk_name_))
+    if (!old_cluster || !old_cluster->Finalize())
       return false;
   }
 
+  if (mode_ == kFile && output_cues_) {
+    for (int32 i = 0; i < cue_tracks_size_; ++i)
+      cue_tracks_[i].new_cuepoint = true;
+  }
+
   const uint64 timecode_scale = segment_info_.timecode_scale();
   const uint64 frame_timecode = frame_timestamp_ns / timecode_scale;
 
@@ -2877,6 +4662,16 @@ bool Segment::MakeNewCluster(uint64 frame_timestamp_ns) {
       cluster_timecode = tc;
   }
 
+  if (chunking_ && cluster_list_size_ > 0) {
+    if (!CompleteChunk(IMkvChunkSink::kCluster,
+                       cluster_timecode * timecode_scale))
+      return false;
+    chunk_count_++;
+
+    if (!StartChunk(IMkvChunkSink::kCluster))
+      return false;
+  }
+
   Cluster*& cluster = cluster_list_[cluster_list_size_];
   const int64 offset = MaxOffset();
   cluster = new (std::nothrow) Cluster(cluster_timecode, offset);  // NOLINT
@@ -2886,7 +4681,37 @@ bool Segment::MakeNewCluster(uint64 frame_timestamp_ns) {
   if (!cluster->Init(writer_cluster_))
     return false;
 
-  cluster_list_size_ = new_size;
+  if (buffer_clusters_ && !cluster->EnableBuffering(max_cluster_buffer_size_))
+    return false;
+
+  if (max_lace_duration_ > 0 &&
+      !cluster->EnableLacing(max_lace_duration_ / timecode_scale))
+    return false;
+
+  if (output_crc32_ && !cluster->EnableCrc32())
+    return false;
+
+  if (collect_statistics_)
+    cluster->set_statistics(&statistics_);
+
+  // The previous cluster is complete; keep its size for MaxOffset().
+  if (cluster_list_size_ > 0) {
+    const uint64 old_cluster_size =
+        cluster_list_[cluster_list_size_ - 1]->Size();
+    closed_clusters_size_ += old_cluster_size;
+    if (collect_statistics_)
+      statistics_.AddClosedCluster(old_cluster_size);
+  }
+
+  // Only the current cluster is needed from here on, in every mode. Cue
+  // points hold their own copy of the cluster positions, MaxOffset() uses
+  // |closed_clusters_size_| and CopyAndMoveCuesBeforeClusters() takes the
+  // position of the first cluster from the SeekHead.
+  if (cluster_list_size_ > 0)
+    delete cluster_list_[cluster_list_size_ - 1];
+  cluster_list_[0] = cluster;
+  cluster_list_size_ = 1;
+
   return true;
 }
 
@@ -2895,7 +4720,9 @@ bool Segment::DoNewClusterProcessing(uint64 track_number,
   for (;;) {
     // Based on the characteristics of the current frame and current
     // cluster, decide whether to create a new cluster.
-    const int result = TestFrame(track_number, frame_timestamp_ns, is_key);
+    MuxerStatistics::ClusterReason reason = MuxerStatistics::kFirstCluster;
+    const int result =
+        TestFrame(track_number, frame_timestamp_ns, is_key, &reason);
     if (result < 0)  // error
       return false;
 
@@ -2903,8 +4730,12 @@ bool Segment::DoNewClusterProcessing(uint64 track_number,
     force_new_cluster_ = false;
 
     // A non-zero result means create a new cluster.
-    if (result > 0 && !MakeNewCluster(frame_timestamp_ns))
-      return false;
+    if (result > 0) {
+      if (!MakeNewCluster(frame_timestamp_ns))
+        return false;
+      if (collect_statistics_)
+        statistics_.AddCluster(reason);
+    }
 
     // Write queued (audio) frames.
     const int frame_count = WriteFramesAll();
@@ -2930,7 +4761,7 @@ bool Segment::CheckHeaderInfo() {
     if (!seek_head_.AddSeekEntry(kMkvCluster, MaxOffset()))
       return false;
 
-    if (output_cues_ && cues_track_ == 0) {
+    if (output_cues_ && cue_tracks_size_ == 0) {
       // Check for a video track
       for (uint32 i = 0; i < tracks_.track_entries_size(); ++i) {
         const Track* const track = tracks_.GetTrackByIndex(i);
@@ -2938,18 +4769,17 @@ bool Segment::CheckHeaderInfo() {
           return false;
 
         if (tracks_.TrackIsVideo(track->number())) {
-          cues_track_ = track->number();
+          if (!CuesTrack(track->number()))
+            return false;
           break;
         }
       }
 
       // Set first track found
-      if (cues_track_ == 0) {
+      if (cue_tracks_size_ == 0) {
         const Track* const track = tracks_.GetTrackByIndex(0);
-        if (!track)
+        if (!track || !CuesTrack(track->number()))
           return false;
-
-        cues_track_ = track->number();
       }
     }
   }
@@ -2985,11 +4815,9 @@ bool Segment::UpdateChunkName(const char* ext, char** name) const {
     return false;
 
 #ifdef _MSC_VER
-  strcpy_s(str, length - strlen(ext_chk), chunking_base_name_);
-  strcat_s(str, length, ext_chk);
+  sprintf_s(str, length, "%s%s", chunking_base_name_, ext_chk);
 #else
-  strcpy(str, chunking_base_name_);
-  strcat(str, ext_chk);
+  snprintf(str, length, "%s%s", chunking_base_name_, ext_chk);
 #endif
 
   delete[] * name;
@@ -2998,6 +4826,69 @@ bool Segment::UpdateChunkName(const char* ext, char** name) const {
   return true;
 }
 
+bool Segment::CompleteChunk(IMkvChunkSink::ChunkType type,
+                            uint64 end_timestamp_ns) {
+  if (chunk_sink_) {
+    MemoryMkvWriter* buffer = chunk_buffer_cluster_;
+    if (type == IMkvChunkSink::kCues)
+      buffer = chunk_buffer_cues_;
+    else if (type == IMkvChunkSink::kHeader)
+      buffer = chunk_buffer_header_;
+    if (!buffer)
+      return false;
+
+    uint64 start_ns = 0;
+    uint64 duration_ns = 0;
+    if (type == IMkvChunkSink::kCluster && cluster_list_size_ > 0) {
+      const Cluster* const cluster = cluster_list_[cluster_list_size_ - 1];
+      start_ns = cluster->timecode() * segment_info_.timecode_scale();
+      if (end_timestamp_ns > start_ns)
+        duration_ns = end_timestamp_ns - start_ns;
+    }
+
+    const int32 index = (type == IMkvChunkSink::kHeader) ? 0 : chunk_count_;
+    const bool ok = buffer->size() == 0 ||
+                    chunk_sink_->OnChunk(type, index, buffer->data(),
+                                         buffer->size(), start_ns, duration_ns);
+    buffer->Reset();
+    return ok;
+  }
+
+  MkvWriter* writer = chunk_writer_cluster_;
+  if (type == IMkvChunkSink::kCues)
+    writer = chunk_writer_cues_;
+  else if (type == IMkvChunkSink::kHeader)
+    writer = chunk_writer_header_;
+  if (!writer)
+    return false;
+
+  writer->Close();
+  return true;
+}
+
+bool Segment::StartChunk(IMkvChunkSink::ChunkType type) {
+  // The chunk buffers are reused for the next chunk.
+  if (chunk_sink_)
+    return true;
+
+  if (type == IMkvChunkSink::kCluster) {
+    if (!chunk_writer_cluster_ || !UpdateChunkName("chk", &chunk_name_))
+      return false;
+    return chunk_writer_cluster_->Open(chunk_name_);
+  }
+
+  if (type != IMkvChunkSink::kCues || !chunk_writer_cues_)
+    return false;
+
+  char* name = NULL;
+  if (!UpdateChunkName("cues", &name))
+    return false;
+
+  const bool cues_open = chunk_writer_cues_->Open(name);
+  delete[] name;
+  return cues_open;
+}
+
 int64 Segment::MaxOffset() {
   if (!writer_header_)
     return -1;
@@ -3005,10 +4896,9 @@ int64 Segment::MaxOffset() {
   int64 offset = writer_header_->Position() - payload_pos_;
 
   if (chunking_) {
-    for (int32 i = 0; i < cluster_list_size_; ++i) {
-      Cluster* const cluster = cluster_list_[i];
-      offset += cluster->Size();
-    }
+    offset += closed_clusters_size_;
+    if (cluster_list_size_ > 0)
+      offset += cluster_list_[cluster_list_size_ - 1]->Size();
 
     if (writer_cues_)
       offset += writer_cues_->Position();
@@ -3041,6 +4931,8 @@ bool Segment::QueueFrame(Frame* frame) {
   }
 
   frames_[frames_size_++] = frame;
+  if (collect_statistics_)
+    statistics_.UpdateAudioQueueDepth(frames_size_);
 
   return true;
 }
@@ -3052,51 +4944,420 @@ int Segment::WriteFramesAll() {
   if (cluster_list_size_ < 1)
     return -1;
 
-  Cluster* const cluster = cluster_list_[cluster_list_size_ - 1];
+  for (int32 i = 0; i < frames_size_; ++i) {
+    Frame*& frame = frames_[i];
+    if (!WriteFrame(frame, false, frame->ingest_time()))
+      return -1;
+
+    delete frame;
+    frame = NULL;
+  }
+
+  const int result = frames_size_;
+  frames_size_ = 0;
+
+  return result;
+}
 
+bool Segment::WriteFrame(const Frame* frame, bool is_metadata,
+                         uint64 ingest_time) {
+  if (!frame || cluster_list_size_ < 1)
+    return false;
+
+  Cluster* const cluster = cluster_list_[cluster_list_size_ - 1];
   if (!cluster)
-    return -1;
+    return false;
 
+  const uint64 frame_timestamp = frame->timestamp();  // ns
   const uint64 timecode_scale = segment_info_.timecode_scale();
+  const uint64 frame_timecode = frame_timestamp / timecode_scale;
 
-  for (int32 i = 0; i < frames_size_; ++i) {
-    Frame*& frame = frames_[i];
-    const uint64 frame_timestamp = frame->timestamp();  // ns
-    const uint64 frame_timecode = frame_timestamp / timecode_scale;
+  if (frame->passthrough_reader()) {
+    if (!cluster->AddBlockPassthrough(
+            frame->passthrough_reader(), frame->passthrough_position(),
+            frame->length(), frame->track_number(), frame_timecode,
+            frame->is_key())) {
+      return false;
+    }
+  } else if (is_metadata) {
+    if (!cluster->AddMetadata(frame->frame(), frame->length(),
+                              frame->track_number(), frame_timecode,
+                              frame->duration() / timecode_scale)) {
+      return false;
+    }
+  } else if (frame->additional() && frame->additional_length() > 0) {
+    if (!cluster->AddFrameWithAdditional(
+            frame->frame(), frame->length(), frame->additional(),
+            frame->additional_length(), frame->add_id(),
+            frame->track_number(), frame_timecode, frame->is_key())) {
+      return false;
+    }
+  } else if (frame->discard_padding() != 0) {
+    // TODO(jzern): using the Segment:: variants here would limit the places
+    // where doc_type_version_ needs to be updated.
+    doc_type_version_ = 4;
+    if (!cluster->AddFrameWithDiscardPadding(
+            frame->frame(), frame->length(), frame->discard_padding(),
+            frame->track_number(), frame_timecode, frame->is_key())) {
+      return false;
+    }
+  } else if (LaceFrameDuration(frame->track_number()) > 0) {
+    if (!cluster->AddLacedFrame(frame->frame(), frame->length(),
+                                frame->track_number(), frame_timecode,
+                                LaceFrameDuration(frame->track_number()),
+                                frame->is_key())) {
+      return false;
+    }
+  } else {
+    if (!cluster->AddFrame(frame->frame(), frame->length(),
+                           frame->track_number(), frame_timecode,
+                           frame->is_key())) {
+      return false;
+    }
+  }
 
-    if (frame->discard_padding() != 0) {
-      // TODO(jzern): using the Segment:: variants here would limit the places
-      // where doc_type_version_ needs to be updated.
-      doc_type_version_ = 4;
-      if (!cluster->AddFrameWithDiscardPadding(
-              frame->frame(), frame->length(), frame->discard_padding(),
-              frame->track_number(), frame_timecode, frame->is_key())) {
-        return -1;
-      }
-    } else {
-      if (!cluster->AddFrame(frame->frame(), frame->length(),
-                             frame->track_number(), frame_timecode,
-                             frame->is_key())) {
-        return -1;
-      }
+  if (!CheckCuePoint(frame_timestamp, frame->track_number()))
+    return false;
+
+  if (frame_timestamp > last_timestamp_)
+    last_timestamp_ = frame_timestamp;
+
+  return OnBlockWritten(frame_timestamp, ingest_time);
+}
+
+bool Segment::AddValidatedFrame(const Frame* frame, const Track* track,
+                                uint64 ingest_time) {
+  const uint64 timestamp = frame->timestamp();
+  last_block_duration_ = frame->duration();
+
+  if (frame->discard_padding() != 0)
+    doc_type_version_ = 4;
+
+  if (HoldsAudioFrames(track)) {
+    Frame* const new_frame = CopyFrame(*frame, ingest_time);
+    return new_frame != NULL && QueueAudioFrame(new_frame);
+  }
+
+  const bool is_metadata = track->type() != Tracks::kAudio &&
+                           track->type() != Tracks::kVideo &&
+                           frame->duration() > 0;
+  if (!DoNewClusterProcessing(frame->track_number(), timestamp,
+                              is_metadata || frame->is_key()))
+    return false;
+
+  return WriteFrame(frame, is_metadata, ingest_time);
+}
+
+bool Segment::UseFrameTransformQueue(const Track* track) const {
+  return track->frame_transform() ||
+         (frame_transform_queue_ && !frame_transform_queue_->empty());
+}
+
+bool Segment::UseLookahead() const {
+  return (has_cluster_policy_ && cluster_policy_.lookahead_frames() > 0) ||
+         lookahead_size_ > 0;
+}
+
+bool Segment::HoldsAudioFrames(const Track* track) const {
+  return has_video_ && track->type() == Tracks::kAudio && !force_new_cluster_;
+}
+
+bool Segment::DefersFrames(const Track* track) const {
+  return UseFrameTransformQueue(track) || UseLookahead() ||
+         HoldsAudioFrames(track);
+}
+
+bool Segment::DeferFrame(Frame* frame, const Track* track) {
+  if (UseFrameTransformQueue(track))
+    return SubmitFrame(frame, track);
+  if (UseLookahead())
+    return AddLookaheadFrame(frame);
+  return QueueAudioFrame(frame);
+}
+
+bool Segment::SubmitFrame(Frame* frame, const Track* track) {
+  if (frame_transform_error_ ||
+      frame->timestamp() < frame_transform_timestamp_ ||
+      frame->timestamp() < LookaheadTimestamp()) {
+    delete frame;
+    return false;
+  }
+
+  if (!frame_transform_queue_) {
+    frame_transform_queue_ = new (std::nothrow) FrameTransformQueue(  // NOLINT
+        frame_transform_threads_, FrameTransformQueue::kDefaultQueueLength);
+    if (!frame_transform_queue_ || !frame_transform_queue_->Init()) {
+      delete frame_transform_queue_;
+      frame_transform_queue_ = NULL;
+      delete frame;
+      return false;
     }
+  }
+
+  // Make room for the frame by muxing the oldest one.
+  bool ok = true;
+  if (frame_transform_queue_->full()) {
+    Frame* oldest = NULL;
+    ok = frame_transform_queue_->Pop(true, &oldest) &&
+         MuxTransformedFrame(oldest);
+  }
+
+  const IMkvFrameTransform* const transform = track->frame_transform();
+  frame_transform_timestamp_ = frame->timestamp();
+  if (!frame_transform_queue_->Push(frame, transform,
+                                    transform ? frame_transform_sequence_++
+                                              : 0))
+    return false;
+
+  return MuxTransformedFrames(false) && ok;
+}
+
+bool Segment::MuxTransformedFrames(bool wait) {
+  if (!frame_transform_queue_)
+    return true;
 
-    if (new_cuepoint_ && cues_track_ == frame->track_number()) {
-      if (!AddCuePoint(frame_timestamp, cues_track_))
-        return -1;
+  bool ok = true;
+  for (;;) {
+    Frame* frame = NULL;
+    if (!frame_transform_queue_->Pop(wait, &frame)) {
+      // The frame is dropped; keep muxing the ones after it.
+      ok = false;
+      continue;
     }
+    if (!frame)
+      break;
+    if (!MuxTransformedFrame(frame))
+      ok = false;
+  }
+  return ok;
+}
+
+bool Segment::MuxTransformedFrame(Frame* frame) {
+  if (!frame)
+    return true;
 
-    if (frame_timestamp > last_timestamp_)
-      last_timestamp_ = frame_timestamp;
+  if (UseLookahead())
+    return AddLookaheadFrame(frame);
+
+  const Track* const track = tracks_.GetTrackByNumber(frame->track_number());
+  const bool ok =
+      track && AddValidatedFrame(frame, track, frame->ingest_time());
+  delete frame;
+  return ok;
+}
 
+bool Segment::AddLookaheadFrame(Frame* frame) {
+  if (frame->timestamp() < LookaheadTimestamp()) {
     delete frame;
-    frame = NULL;
+    return false;
   }
 
-  const int result = frames_size_;
-  frames_size_ = 0;
+  if (!lookahead_frames_) {
+    lookahead_frames_ =
+        new (std::nothrow) Frame*[kLookaheadRingSize];  // NOLINT
+    if (!lookahead_frames_) {
+      delete frame;
+      return false;
+    }
+  }
 
-  return result;
+  lookahead_frames_[(lookahead_head_ + lookahead_size_) % kLookaheadRingSize] =
+      frame;
+  ++lookahead_size_;
+  if (frame->is_key() && tracks_.TrackIsVideo(frame->track_number()))
+    ++lookahead_key_frames_;
+
+  return MuxLookaheadFrames(
+      has_cluster_policy_ ? cluster_policy_.lookahead_frames() : 0);
+}
+
+bool Segment::MuxLookaheadFrames(int32 frames_left) {
+  bool ok = true;
+  while (lookahead_size_ > frames_left) {
+    Frame* const frame = lookahead_frames_[lookahead_head_];
+    lookahead_head_ = (lookahead_head_ + 1) % kLookaheadRingSize;
+    --lookahead_size_;
+    if (frame->is_key() && tracks_.TrackIsVideo(frame->track_number()))
+      --lookahead_key_frames_;
+
+    const Track* const track =
+        tracks_.GetTrackByNumber(frame->track_number());
+    if (!track || !AddValidatedFrame(frame, track, frame->ingest_time()))
+      ok = false;
+    delete frame;
+  }
+  return ok;
+}
+
+uint64 Segment::MinNextTimestamp() const {
+  uint64 timestamp = last_timestamp_;
+  if (frame_transform_queue_ && !frame_transform_queue_->empty() &&
+      frame_transform_timestamp_ > timestamp)
+    timestamp = frame_transform_timestamp_;
+  if (LookaheadTimestamp() > timestamp)
+    timestamp = LookaheadTimestamp();
+  return timestamp;
+}
+
+uint64 Segment::LookaheadTimestamp() const {
+  if (lookahead_size_ < 1)
+    return 0;
+
+  const int32 newest =
+      (lookahead_head_ + lookahead_size_ - 1) % kLookaheadRingSize;
+  return lookahead_frames_[newest]->timestamp();
+}
+
+uint64 Segment::LaceFrameDuration(uint64 track_number) const {
+  if (max_lace_duration_ == 0 || tracks_.TrackIsVideo(track_number))
+    return 0;
+
+  const CueTrack* const cue_track = GetCueTrack(track_number);
+  if (cue_track && cue_track->new_cuepoint)
+    return 0;
+
+  // A reader recovers the timestamps of laced frames from the track's
+  // DefaultDuration, so it has to be set and be a whole number of timecode
+  // units.
+  const Track* const track = tracks_.GetTrackByNumber(track_number);
+  const uint64 timecode_scale = segment_info_.timecode_scale();
+  if (!track || track->default_duration() == 0 ||
+      track->default_duration() % timecode_scale != 0)
+    return 0;
+
+  return track->default_duration() / timecode_scale;
+}
+
+Segment::CueTrack* Segment::GetCueTrack(uint64 track_number) const {
+  for (int32 i = 0; i < cue_tracks_size_; ++i) {
+    if (cue_tracks_[i].track_number == track_number)
+      return &cue_tracks_[i];
+  }
+  return NULL;
+}
+
+bool Segment::CheckCuePoint(uint64 timestamp, uint64 track_number) {
+  CueTrack* const cue_track = GetCueTrack(track_number);
+  if (!cue_track || !cue_track->new_cuepoint)
+    return true;
+
+  cue_track->new_cuepoint = false;
+  if (cue_track->has_cue && timestamp >= cue_track->last_cue_time &&
+      timestamp - cue_track->last_cue_time < cue_track->min_interval)
+    return true;
+
+  if (!AddCuePoint(timestamp, track_number))
+    return false;
+
+  cue_track->last_cue_time = timestamp;
+  cue_track->has_cue = true;
+  return true;
+}
+
+bool Segment::QueueAudioFrame(Frame* frame) {
+  if (!QueueFrame(frame)) {
+    delete frame;
+    return false;
+  }
+
+  return CheckAudioHold();
+}
+
+bool Segment::CheckAudioHold() {
+  if (max_audio_hold_ == 0 || frames_size_ < 1)
+    return true;
+
+  const Frame* const oldest = frames_[0];
+  const Frame* const newest = frames_[frames_size_ - 1];
+  if (newest->timestamp() - oldest->timestamp() < max_audio_hold_)
+    return true;
+
+  // Write out the queued frames as if the oldest one had just been added.
+  return DoNewClusterProcessing(oldest->track_number(), oldest->timestamp(),
+                                oldest->is_key());
+}
+
+bool Segment::OnBlockWritten(uint64 timestamp_ns, uint64 ingest_time) {
+  if (record_latency_ && ingest_time > 0) {
+    const uint64 now = GetMonotonicTimeNs();
+    latency_histogram_.Add((now > ingest_time) ? now - ingest_time : 0);
+  }
+
+  if (!flush_callback_)
+    return true;
+
+  ++flush_block_count_;
+  const bool block_limit =
+      flush_max_blocks_ > 0 && flush_block_count_ >= flush_max_blocks_;
+  const bool interval_limit =
+      flush_max_interval_ > 0 &&
+      timestamp_ns >= flush_timestamp_ + flush_max_interval_;
+  if (!block_limit && !interval_limit)
+    return true;
+
+  // A laced frame is only buffered in the cluster. Write out the pending lace
+  // so that the reported position covers the block.
+  if (cluster_list_size_ > 0) {
+    Cluster* const cluster = cluster_list_[cluster_list_size_ - 1];
+    if (!cluster || !cluster->FlushLace())
+      return false;
+  }
+
+  flush_block_count_ = 0;
+  flush_timestamp_ = timestamp_ns;
+  return flush_callback_->OnFlush(writer_cluster_->Position(), timestamp_ns);
+}
+
+uint64 Segment::IngestTime() const {
+  return record_latency_ ? GetMonotonicTimeNs() : 0;
+}
+
+bool Segment::WrapStatisticsWriters() {
+  if (statistics_writer_header_)
+    return true;
+
+  statistics_writer_header_ =
+      new (std::nothrow) StatisticsMkvWriter(writer_header_,  // NOLINT
+                                             &statistics_);
+  if (!statistics_writer_header_)
+    return false;
+
+  if (writer_cluster_ == writer_header_) {
+    statistics_writer_cluster_ = statistics_writer_header_;
+  } else {
+    statistics_writer_cluster_ =
+        new (std::nothrow) StatisticsMkvWriter(writer_cluster_,  // NOLINT
+                                               &statistics_);
+    if (!statistics_writer_cluster_)
+      return false;
+  }
+
+  if (writer_cues_ == writer_header_) {
+    statistics_writer_cues_ = statistics_writer_header_;
+  } else if (writer_cues_ == writer_cluster_) {
+    statistics_writer_cues_ = statistics_writer_cluster_;
+  } else {
+    statistics_writer_cues_ =
+        new (std::nothrow) StatisticsMkvWriter(writer_cues_,  // NOLINT
+                                               &statistics_);
+    if (!statistics_writer_cues_)
+      return false;
+  }
+
+  writer_cluster_ = statistics_writer_cluster_;
+  writer_cues_ = statistics_writer_cues_;
+  writer_header_ = statistics_writer_header_;
+  return true;
+}
+
+void Segment::EndFinalizePhase(MuxerStatistics::FinalizePhase phase,
+                               uint64* start_ns) {
+  if (!collect_statistics_)
+    return;
+
+  const uint64 now = GetMonotonicTimeNs();
+  statistics_.AddFinalizeTime(phase, now - *start_ns);
+  *start_ns = now;
 }
 
 bool Segment::WriteFramesLessThan(uint64 timestamp) {
@@ -3107,11 +5368,6 @@ bool Segment::WriteFramesLessThan(uint64 timestamp) {
     if (!frames_)
       return false;
 
-    Cluster* const cluster = cluster_list_[cluster_list_size_ - 1];
-    if (!cluster)
-      return false;
-
-    const uint64 timecode_scale = segment_info_.timecode_scale();
     int32 shift_left = 0;
 
     // TODO(fgalligan): Change this to use the durations of frames instead of
@@ -3123,35 +5379,10 @@ bool Segment::WriteFramesLessThan(uint64 timestamp) {
         break;
 
       const Frame* const frame_prev = frames_[i - 1];
-      const uint64 frame_timestamp = frame_prev->timestamp();
-      const uint64 frame_timecode = frame_timestamp / timecode_scale;
-      const int64 discard_padding = frame_prev->discard_padding();
-
-      if (discard_padding != 0) {
-        doc_type_version_ = 4;
-        if (!cluster->AddFrameWithDiscardPadding(
-                frame_prev->frame(), frame_prev->length(), discard_padding,
-                frame_prev->track_number(), frame_timecode,
-                frame_prev->is_key())) {
-          return false;
-        }
-      } else {
-        if (!cluster->AddFrame(frame_prev->frame(), frame_prev->length(),
-                               frame_prev->track_number(), frame_timecode,
-                               frame_prev->is_key())) {
-          return false;
-        }
-      }
-
-      if (new_cuepoint_ && cues_track_ == frame_prev->track_number()) {
-        if (!AddCuePoint(frame_timestamp, cues_track_))
-          return false;
-      }
+      if (!WriteFrame(frame_prev, false, frame_prev->ingest_time()))
+        return false;
 
       ++shift_left;
-      if (frame_timestamp > last_timestamp_)
-        last_timestamp_ = frame_timestamp;
-
       delete frame_prev;
     }
 
@@ -15,13 +15,18 @@
 // http://www.webmproject.org/code/specs/container/.
 
 namespace mkvparser {
+class Block;
 class IMkvReader;
 }  // end namespace
 
 namespace mkvmuxer {
 
+class Crc32MkvWriter;
+class FrameTransformQueue;
+class MemoryMkvWriter;
 class MkvWriter;
 class Segment;
+class StatisticsMkvWriter;
 
 ///////////////////////////////////////////////////////////////
 // Interface used by the mkvmuxer to write out the Mkv data.
@@ -55,6 +60,83 @@ class IMkvWriter {
   LIBWEBM_DISALLOW_COPY_AND_ASSIGN(IMkvWriter);
 };
 
+///////////////////////////////////////////////////////////////
+// Interface used by the mkvmuxer to hand out completed chunks when chunking
+// to a sink instead of to files.
+class IMkvChunkSink {
+ public:
+  enum ChunkType {
+    // The EBML header and the Segment header elements.
+    kHeader,
+    // A single Cluster.
+    kCluster,
+    // The Cues element.
+    kCues
+  };
+
+  // Called whenever a chunk is complete. |index| is the number of the chunk,
+  // matching the number of the file that would have been written by
+  // Segment::SetChunking. |data| holds the |length| bytes of the chunk and is
+  // only valid during the call. For |kCluster| chunks |start_ns| is the
+  // timestamp of the cluster and |duration_ns| the time until the start of
+  // the next cluster, both in nanoseconds. They are 0 for the other chunk
+  // types. Returns true on success.
+  virtual bool OnChunk(ChunkType type, int32 index, const uint8* data,
+                       uint64 length, uint64 start_ns, uint64 duration_ns) = 0;
+
+ protected:
+  IMkvChunkSink();
+  virtual ~IMkvChunkSink();
+
+ private:
+  LIBWEBM_DISALLOW_COPY_AND_ASSIGN(IMkvChunkSink);
+};
+
+///////////////////////////////////////////////////////////////
+// Interface used by the mkvmuxer to signal flush points in low latency live
+// streams.
+class IMkvFlushCallback {
+ public:
+  // Called after a block has been written when a flush point is reached.
+  // |position| is the position of the cluster writer after the block, and
+  // |timestamp_ns| the timestamp of the block in nanoseconds. All data up to
+  // |position| may be sent out. Returns true on success.
+  virtual bool OnFlush(int64 position, uint64 timestamp_ns) = 0;
+
+ protected:
+  IMkvFlushCallback();
+  virtual ~IMkvFlushCallback();
+
+ private:
+  LIBWEBM_DISALLOW_COPY_AND_ASSIGN(IMkvFlushCallback);
+};
+
+///////////////////////////////////////////////////////////////
+// Interface used by the mkvmuxer to transform the data of frames, e.g. to
+// encrypt them, before they are written to blocks. Transform() may be called
+// from several threads at once and must not modify shared state.
+class IMkvFrameTransform {
+ public:
+  // Returns the largest size in bytes of the output of Transform() for a
+  // frame of |length| bytes.
+  virtual uint64 MaxTransformedSize(uint64 length) const = 0;
+
+  // Transforms the |length| bytes at |input| into |output|, which holds
+  // MaxTransformedSize(|length|) bytes, and stores the size of the result in
+  // |output_length|. |sequence| is unique for every frame transformed by a
+  // segment and increases in the order the frames were added. Returns true
+  // on success.
+  virtual bool Transform(const uint8* input, uint64 length, uint64 sequence,
+                         uint8* output, uint64* output_length) const = 0;
+
+ protected:
+  IMkvFrameTransform();
+  virtual ~IMkvFrameTransform();
+
+ private:
+  LIBWEBM_DISALLOW_COPY_AND_ASSIGN(IMkvFrameTransform);
+};
+
 // Writes out the EBML header for a WebM file. This function must be called
 // before any other libwebm writing functions are called.
 bool WriteEbmlHeader(IMkvWriter* writer, uint64 doc_type_version);
@@ -64,6 +146,8 @@ bool WriteEbmlHeader(IMkvWriter* writer, uint64 doc_type_version);
 bool WriteEbmlHeader(IMkvWriter* writer);
 
 // Copies in Chunk from source to destination between the given byte positions
+// On Linux the kernel copies the data when |source| is an MkvReader and |dst|
+// an MkvWriter.
 bool ChunkedCopy(mkvparser::IMkvReader* source, IMkvWriter* dst, int64 start,
                  int64 size);
 
@@ -80,6 +164,21 @@ class Frame {
   // Copies |additional| data into |additional_|. Returns true on success.
   bool AddAdditionalData(const uint8* additional, uint64 length, uint64 add_id);
 
+  // Makes the frame refer to the |size| bytes of a block payload at
+  // |position| in |reader| instead of holding data, so that a block passed
+  // to Segment::AddBlockPassthrough() can be held back like other frames.
+  // |reader| is not owned and must outlive the frame. Returns true on
+  // success.
+  bool InitPassthrough(mkvparser::IMkvReader* reader, int64 position,
+                       uint64 size);
+
+  // Copies the data and all properties of |frame|. Returns true on success.
+  bool CopyFrom(const Frame& frame);
+
+  // Replaces |frame_| with the output of |transform|, passing |sequence| to
+  // IMkvFrameTransform::Transform(). Returns true on success.
+  bool Transform(const IMkvFrameTransform* transform, uint64 sequence);
+
   uint64 add_id() const { return add_id_; }
   const uint8* additional() const { return additional_; }
   uint64 additional_length() const { return additional_length_; }
@@ -89,6 +188,10 @@ class Frame {
   void set_is_key(bool key) { is_key_ = key; }
   bool is_key() const { return is_key_; }
   uint64 length() const { return length_; }
+  mkvparser::IMkvReader* passthrough_reader() const {
+    return passthrough_reader_;
+  }
+  int64 passthrough_position() const { return passthrough_position_; }
   void set_track_number(uint64 track_number) { track_number_ = track_number; }
   uint64 track_number() const { return track_number_; }
   void set_timestamp(uint64 timestamp) { timestamp_ = timestamp; }
@@ -97,6 +200,8 @@ class Frame {
     discard_padding_ = discard_padding;
   }
   uint64 discard_padding() const { return discard_padding_; }
+  void set_ingest_time(uint64 ingest_time) { ingest_time_ = ingest_time; }
+  uint64 ingest_time() const { return ingest_time_; }
 
  private:
   // Id of the Additional data.
@@ -120,6 +225,13 @@ class Frame {
   // Length of the data.
   uint64 length_;
 
+  // Source of the block payload the frame refers to, or NULL when the frame
+  // holds its data in |frame_|. Not owned by this class.
+  mkvparser::IMkvReader* passthrough_reader_;
+
+  // Position of the block payload in |passthrough_reader_|.
+  int64 passthrough_position_;
+
   // Mkv track number the data is associated with.
   uint64 track_number_;
 
@@ -128,12 +240,207 @@ class Frame {
 
   // Discard padding for the frame.
   int64 discard_padding_;
+
+  // Monotonic time in nanoseconds at which the muxer received the frame.
+  // Only set when the muxer records latencies.
+  uint64 ingest_time_;
 };
 
 ///////////////////////////////////////////////////////////////
-// Class to hold one cue point in a Cues element.
+// Histogram of latencies with buckets of exponentially growing size.
+class LatencyHistogram {
+ public:
+  // Bucket 0 holds latencies below 1 microsecond, bucket i > 0 those in
+  // [2^(i-1), 2^i) microseconds. The last bucket holds all larger latencies.
+  static const int32 kNumBuckets = 32;
+
+  LatencyHistogram();
+
+  // Adds one sample of |latency_ns| nanoseconds.
+  void Add(uint64 latency_ns);
+
+  // Removes all samples.
+  void Reset();
+
+  // Returns the upper bound in nanoseconds of the bucket that holds the
+  // |percentile| [0, 100] of the samples. Returns 0 if there are no samples.
+  uint64 Percentile(double percentile) const;
+
+  // Returns the upper bound in nanoseconds of |bucket|.
+  static uint64 BucketLimit(int32 bucket);
+
+  uint64 bucket_count(int32 bucket) const { return buckets_[bucket]; }
+  uint64 count() const { return count_; }
+  uint64 max_ns() const { return max_ns_; }
+  uint64 total_ns() const { return total_ns_; }
+
+ private:
+  uint64 buckets_[kNumBuckets];
+  uint64 count_;
+  uint64 max_ns_;
+  uint64 total_ns_;
+};
+
+///////////////////////////////////////////////////////////////
+// Counters describing the output of a Segment, collected when
+// Segment::set_collect_statistics() is turned on.
+class MuxerStatistics {
+ public:
+  // Reasons for starting a new cluster.
+  enum ClusterReason {
+    kFirstCluster,
+    // Segment::ForceNewClusterOnNextFrame() was called.
+    kForcedCluster,
+    // The frame is a video key frame.
+    kKeyFrameCluster,
+    // The cluster reached Segment::max_cluster_duration().
+    kDurationCluster,
+    // The cluster reached Segment::max_cluster_size().
+    kSizeCluster,
+    // The frame's timecode does not fit the 16 bit block timecode.
+    kTimecodeOverflowCluster,
+    kNumClusterReasons
+  };
+
+  // Top level elements the bytes written are attributed to. Void elements
+  // inside a cluster count as cluster bytes.
+  enum Element {
+    kEbmlHeaderElement,
+    kSegmentElement,
+    kSeekHeadElement,
+    kInfoElement,
+    kTracksElement,
+    kChaptersElement,
+    kClusterElement,
+    kCuesElement,
+    kVoidElement,
+    // Bytes written before any of the above.
+    kOtherElement,
+    kNumElements
+  };
+
+  // Phases of Segment::Finalize().
+  enum FinalizePhase {
+    // Writing out pending frames and closing the last cluster.
+    kFinalizeClusters,
+    // Updating the Segment Information element with the duration.
+    kFinalizeInfo,
+    // Writing the Cues element.
+    kFinalizeCues,
+    // Writing the SeekHead element.
+    kFinalizeSeekHead,
+    // Updating the EBML header and the size of the Segment element.
+    kFinalizeSegmentSize,
+    kNumFinalizePhases
+  };
+
+  // Counts of one track.
+  struct TrackCounts {
+    uint64 track_number;
+    uint64 blocks;
+    uint64 frames;
+
+    // Size in bytes of the block elements.
+    uint64 bytes;
+  };
+
+  MuxerStatistics();
+  ~MuxerStatistics();
+
+  // Removes all counts.
+  void Reset();
+
+  // Records a new cluster created for |reason|.
+  void AddCluster(ClusterReason reason);
+
+  // Records a closed cluster of |size| bytes, including its header.
+  void AddClosedCluster(uint64 size);
+
+  // Records a block of |frames| frames and |size| bytes of |track_number|.
+  // Returns false if the track could not be added.
+  bool AddBlock(uint64 track_number, int32 frames, uint64 size);
+
+  // Records a call to IMkvWriter::Write() of |length| bytes for |element|.
+  // |rewritten| bytes of them overwrite data written before.
+  void AddWrite(Element element, uint64 length, uint64 rewritten);
+
+  // Records a call to IMkvWriter::Position(int64).
+  void AddSeek() { ++seeks_; }
+
+  // Records |depth| frames held back in the audio queue.
+  void UpdateAudioQueueDepth(int32 depth);
+
+  // Records |time_ns| nanoseconds spent in |phase|.
+  void AddFinalizeTime(FinalizePhase phase, uint64 time_ns);
+
+  // Returns the element that a top level element ID starts, or
+  // |kNumElements| if |element_id| is not a top level element.
+  static Element GetElement(uint64 element_id);
+
+  uint64 clusters() const { return clusters_; }
+  uint64 cluster_count(ClusterReason reason) const {
+    return cluster_counts_[reason];
+  }
+  uint64 largest_cluster_size() const { return largest_cluster_size_; }
+
+  // Tracks are listed in the order their first block was written.
+  int32 track_count() const { return track_count_; }
+  const TrackCounts& track(int32 index) const { return tracks_[index]; }
+
+  // Returns the counts of |track_number|, or NULL if no block of the track
+  // was written.
+  const TrackCounts* GetTrack(uint64 track_number) const;
+
+  uint64 element_bytes(Element element) const {
+    return element_bytes_[element];
+  }
+  uint64 bytes_written() const { return bytes_written_; }
+  uint64 bytes_rewritten() const { return bytes_rewritten_; }
+  uint64 writes() const { return writes_; }
+  uint64 seeks() const { return seeks_; }
+  int32 max_audio_queue_depth() const { return max_audio_queue_depth_; }
+  uint64 finalize_ns(FinalizePhase phase) const {
+    return finalize_ns_[phase];
+  }
+
+ private:
+  uint64 clusters_;
+  uint64 cluster_counts_[kNumClusterReasons];
+  uint64 largest_cluster_size_;
+
+  TrackCounts* tracks_;
+  int32 track_count_;
+  int32 tracks_capacity_;
+
+  uint64 element_bytes_[kNumElements];
+
+  // Total bytes passed to IMkvWriter::Write(), and how many of them
+  // overwrite data written before, e.g. sizes updated after seeking back.
+  uint64 bytes_written_;
+  uint64 bytes_rewritten_;
+
+  uint64 writes_;
+  uint64 seeks_;
+  int32 max_audio_queue_depth_;
+  uint64 finalize_ns_[kNumFinalizePhases];
+
+  LIBWEBM_DISALLOW_COPY_AND_ASSIGN(MuxerStatistics);
+};
+
+///////////////////////////////////////////////////////////////
+// Class to hold one cue point in a Cues element. A cue point holds one
+// CueTrackPositions element for each track that has a cue at its time. The
+// first one is set with set_track(), set_cluster_pos() and
+// set_block_number(); the others are added with AddTrackPosition().
 class CuePoint {
  public:
+  // Position of a cue point in one track.
+  struct TrackPosition {
+    uint64 track;
+    uint64 cluster_pos;
+    uint64 block_number;
+  };
+
   CuePoint();
   ~CuePoint();
 
@@ -143,16 +450,47 @@ class CuePoint {
   // Output the CuePoint element to the writer. Returns true on success.
   bool Write(IMkvWriter* writer) const;
 
-  void set_time(uint64 time) { time_ = time; }
+  // Adds a CueTrackPositions element for |track|, which must not already
+  // have one in this cue point. Returns true on success.
+  bool AddTrackPosition(uint64 track, uint64 cluster_pos, uint64 block_number);
+
+  // Returns true if the cue point has a CueTrackPositions element for
+  // |track|.
+  bool HasTrack(uint64 track) const;
+
+  // Adds |offset| to the cluster position of every CueTrackPositions element.
+  void ShiftClusterPositions(uint64 offset);
+
+  // Returns the number of CueTrackPositions elements, including the first.
+  int32 track_positions_size() const { return 1 + extra_positions_size_; }
+
+  // Returns the CueTrackPositions element at |index|, where 0 is the first.
+  // Returns NULL if |index| is out of range.
+  const TrackPosition* GetTrackPosition(int32 index) const;
+
+  void set_time(uint64 time) {
+    time_ = time;
+    size_ = 0;
+  }
   uint64 time() const { return time_; }
-  void set_track(uint64 track) { track_ = track; }
-  uint64 track() const { return track_; }
-  void set_cluster_pos(uint64 cluster_pos) { cluster_pos_ = cluster_pos; }
-  uint64 cluster_pos() const { return cluster_pos_; }
-  void set_block_number(uint64 block_number) { block_number_ = block_number; }
-  uint64 block_number() const { return block_number_; }
+  void set_track(uint64 track) {
+    position_.track = track;
+    size_ = 0;
+  }
+  uint64 track() const { return position_.track; }
+  void set_cluster_pos(uint64 cluster_pos) {
+    position_.cluster_pos = cluster_pos;
+    size_ = 0;
+  }
+  uint64 cluster_pos() const { return position_.cluster_pos; }
+  void set_block_number(uint64 block_number) {
+    position_.block_number = block_number;
+    size_ = 0;
+  }
+  uint64 block_number() const { return position_.block_number; }
   void set_output_block_number(bool output_block_number) {
     output_block_number_ = output_block_number;
+    size_ = 0;
   }
   bool output_block_number() const { return output_block_number_; }
 
@@ -160,22 +498,29 @@ class CuePoint {
   // Returns the size in bytes for the payload of the CuePoint element.
   uint64 PayloadSize() const;
 
+  // Returns the size in bytes for the payload of the CueTrackPositions
+  // element of |position|.
+  uint64 TrackPositionPayloadSize(const TrackPosition& position) const;
+
   // Absolute timecode according to the segment time base.
   uint64 time_;
 
-  // The Track element associated with the CuePoint.
-  uint64 track_;
-
-  // The position of the Cluster containing the Block.
-  uint64 cluster_pos_;
+  // The first CueTrackPositions element. Block numbers start from 1.
+  TrackPosition position_;
 
-  // Number of the Block within the Cluster, starting from 1.
-  uint64 block_number_;
+  // The other CueTrackPositions elements. Most cue points have a single
+  // track, so the array is only allocated for the others and grows by one
+  // element at a time.
+  TrackPosition* extra_positions_;
+  int32 extra_positions_size_;
 
   // If true the muxer will write out the block number for the cue if the
   // block number is different than the default of 1. Default is set to true.
   bool output_block_number_;
 
+  // Size in bytes of the CuePoint element, or 0 if it has to be computed.
+  mutable uint64 size_;
+
   LIBWEBM_DISALLOW_COPY_AND_ASSIGN(CuePoint);
 };
 
@@ -190,35 +535,89 @@ class Cues {
   bool AddCue(CuePoint* cue);
 
   // Returns the cue point by index. Returns NULL if there is no cue point
-  // match.
+  // match, or if the cue point has been spilled. Size() does not account for
+  // changes made to the returned cue point; use ShiftClusterPositions() to
+  // move the cue points.
   CuePoint* GetCueByIndex(int32 index) const;
 
+  // Adds a CueTrackPositions element for |track| to the cue point at |index|.
+  // Unlike changes made through GetCueByIndex(), Size() accounts for it.
+  // Returns true on success.
+  bool AddTrackPosition(int32 index, uint64 track, uint64 cluster_pos,
+                        uint64 block_number);
+
+  // Adds |offset| to the cluster position of every cue point. Returns true on
+  // success.
+  bool ShiftClusterPositions(uint64 offset);
+
   // Returns the total size of the Cues element
   uint64 Size();
 
   // Output the Cues element to the writer. Returns true on success.
   bool Write(IMkvWriter* writer) const;
 
-  int32 cue_entries_size() const { return cue_entries_size_; }
+  // Keeps at most |max_cue_points| cue points in memory. Older cue points
+  // are spilled to a temporary file as fixed-size records, and streamed back
+  // in order by Write(), so the memory used stays flat however many cue
+  // points are added. 0, the default, keeps every cue point in memory. Must
+  // be called before the first cue point is added. Returns true on success.
+  bool SetSpillThreshold(int32 max_cue_points);
+  int32 spill_threshold() const { return spill_threshold_; }
+
+  // Returns the number of cue points, including the spilled ones.
+  int32 cue_entries_size() const { return spilled_size_ + cue_entries_size_; }
   void set_output_block_number(bool output_block_number) {
     output_block_number_ = output_block_number;
   }
   bool output_block_number() const { return output_block_number_; }
 
+  // Toggles writing a CRC-32 element at the start of the Cues element.
+  void set_output_crc32(bool output_crc32) { output_crc32_ = output_crc32; }
+  bool output_crc32() const { return output_crc32_; }
+
  private:
+  // Temporary file of spilled cue points.
+  class SpillFile;
+
+  // Outputs the CuePoint elements to the writer. Returns true on success.
+  bool WriteCuePoints(IMkvWriter* writer) const;
+
+  // Moves every cue point in |cue_entries_| to |spill_file_|. Returns true
+  // on success.
+  bool SpillCuePoints();
+
   // Number of allocated elements in |cue_entries_|.
   int32 cue_entries_capacity_;
 
   // Number of CuePoints in |cue_entries_|.
   int32 cue_entries_size_;
 
-  // CuePoint list.
+  // CuePoint list of the cue points that have not been spilled.
   CuePoint** cue_entries_;
 
+  // Total size in bytes of the CuePoint elements, including the spilled
+  // ones.
+  uint64 payload_size_;
+
+  // Maximum number of cue points kept in memory, or 0 for no limit.
+  int32 spill_threshold_;
+
+  // Number of cue points in |spill_file_|, which is created by the first
+  // spill. They precede the cue points in |cue_entries_|.
+  int32 spilled_size_;
+  SpillFile* spill_file_;
+
+  // Sum of the offsets passed to ShiftClusterPositions(), which are applied
+  // to the spilled cue points as they are read back.
+  uint64 spilled_offset_;
+
   // If true the muxer will write out the block number for the cue if the
   // block number is different than the default of 1. Default is set to true.
   bool output_block_number_;
 
+  // Flag telling if a CRC-32 element is written.
+  bool output_crc32_;
+
   LIBWEBM_DISALLOW_COPY_AND_ASSIGN(Cues);
 };
 
@@ -338,33 +737,62 @@ class Track {
   const char* language() const { return language_; }
   void set_max_block_additional_id(uint64 max_block_additional_id) {
     max_block_additional_id_ = max_block_additional_id;
+    elements_size_ = 0;
   }
   uint64 max_block_additional_id() const { return max_block_additional_id_; }
   void set_name(const char* name);
   const char* name() const { return name_; }
-  void set_number(uint64 number) { number_ = number; }
+  void set_number(uint64 number) {
+    number_ = number;
+    elements_size_ = 0;
+  }
   uint64 number() const { return number_; }
-  void set_type(uint64 type) { type_ = type; }
+  void set_type(uint64 type) {
+    type_ = type;
+    elements_size_ = 0;
+  }
   uint64 type() const { return type_; }
-  void set_uid(uint64 uid) { uid_ = uid; }
+  void set_uid(uint64 uid) {
+    uid_ = uid;
+    elements_size_ = 0;
+  }
   uint64 uid() const { return uid_; }
-  void set_codec_delay(uint64 codec_delay) { codec_delay_ = codec_delay; }
+  void set_codec_delay(uint64 codec_delay) {
+    codec_delay_ = codec_delay;
+    elements_size_ = 0;
+  }
   uint64 codec_delay() const { return codec_delay_; }
   void set_seek_pre_roll(uint64 seek_pre_roll) {
     seek_pre_roll_ = seek_pre_roll;
+    elements_size_ = 0;
   }
   uint64 seek_pre_roll() const { return seek_pre_roll_; }
   void set_default_duration(uint64 default_duration) {
     default_duration_ = default_duration;
+    elements_size_ = 0;
   }
   uint64 default_duration() const { return default_duration_; }
 
+  // Sets the transform applied to the data of the frames of this track, or
+  // NULL for none. Not owned by this class. Use
+  // Segment::SetFrameTransform() to set it.
+  void set_frame_transform(const IMkvFrameTransform* frame_transform) {
+    frame_transform_ = frame_transform;
+  }
+  const IMkvFrameTransform* frame_transform() const {
+    return frame_transform_;
+  }
+
   uint64 codec_private_length() const { return codec_private_length_; }
   uint32 content_encoding_entries_size() const {
     return content_encoding_entries_size_;
   }
 
  private:
+  // Returns the size in bytes of the Track sub-elements other than
+  // ContentEncodings.
+  uint64 ElementsSize() const;
+
   // Track element names.
   char* codec_id_;
   uint8* codec_private_;
@@ -387,6 +815,13 @@ class Track {
   // Number of ContentEncoding elements added.
   uint32 content_encoding_entries_size_;
 
+  // Transform applied to the frame data. Not owned by this class.
+  const IMkvFrameTransform* frame_transform_;
+
+  // Size in bytes of the Track sub-elements other than ContentEncodings, or
+  // 0 if it has to be computed.
+  mutable uint64 elements_size_;
+
   LIBWEBM_DISALLOW_COPY_AND_ASSIGN(Track);
 };
 
@@ -422,27 +857,54 @@ class VideoTrack : public Track {
   // Sets the video's alpha mode. Returns true on success.
   bool SetAlphaMode(uint64 alpha_mode);
 
-  void set_display_height(uint64 height) { display_height_ = height; }
+  void set_display_height(uint64 height) {
+    display_height_ = height;
+    video_payload_size_ = 0;
+  }
   uint64 display_height() const { return display_height_; }
-  void set_display_width(uint64 width) { display_width_ = width; }
+  void set_display_width(uint64 width) {
+    display_width_ = width;
+    video_payload_size_ = 0;
+  }
   uint64 display_width() const { return display_width_; }
 
-  void set_crop_left(uint64 crop_left) { crop_left_ = crop_left; }
+  void set_crop_left(uint64 crop_left) {
+    crop_left_ = crop_left;
+    video_payload_size_ = 0;
+  }
   uint64 crop_left() const { return crop_left_; }
-  void set_crop_right(uint64 crop_right) { crop_right_ = crop_right; }
+  void set_crop_right(uint64 crop_right) {
+    crop_right_ = crop_right;
+    video_payload_size_ = 0;
+  }
   uint64 crop_right() const { return crop_right_; }
-  void set_crop_top(uint64 crop_top) { crop_top_ = crop_top; }
+  void set_crop_top(uint64 crop_top) {
+    crop_top_ = crop_top;
+    video_payload_size_ = 0;
+  }
   uint64 crop_top() const { return crop_top_; }
-  void set_crop_bottom(uint64 crop_bottom) { crop_bottom_ = crop_bottom; }
+  void set_crop_bottom(uint64 crop_bottom) {
+    crop_bottom_ = crop_bottom;
+    video_payload_size_ = 0;
+  }
   uint64 crop_bottom() const { return crop_bottom_; }
 
-  void set_frame_rate(double frame_rate) { frame_rate_ = frame_rate; }
+  void set_frame_rate(double frame_rate) {
+    frame_rate_ = frame_rate;
+    video_payload_size_ = 0;
+  }
   double frame_rate() const { return frame_rate_; }
-  void set_height(uint64 height) { height_ = height; }
+  void set_height(uint64 height) {
+    height_ = height;
+    video_payload_size_ = 0;
+  }
   uint64 height() const { return height_; }
   uint64 stereo_mode() { return stereo_mode_; }
   uint64 alpha_mode() { return alpha_mode_; }
-  void set_width(uint64 width) { width_ = width; }
+  void set_width(uint64 width) {
+    width_ = width;
+    video_payload_size_ = 0;
+  }
   uint64 width() const { return width_; }
 
  private:
@@ -462,6 +924,10 @@ class VideoTrack : public Track {
   uint64 alpha_mode_;
   uint64 width_;
 
+  // Size in bytes of the Video element's payload, or 0 if it has to be
+  // computed.
+  mutable uint64 video_payload_size_;
+
   LIBWEBM_DISALLOW_COPY_AND_ASSIGN(VideoTrack);
 };
 
@@ -535,13 +1001,33 @@ class Tracks {
 
   uint32 track_entries_size() const { return track_entries_size_; }
 
+  // Toggles writing a CRC-32 element at the start of the Tracks element.
+  void set_output_crc32(bool output_crc32) { output_crc32_ = output_crc32; }
+  bool output_crc32() const { return output_crc32_; }
+
  private:
+  // Outputs the Track elements to the writer. Returns true on success.
+  bool WriteTrackEntries(IMkvWriter* writer) const;
+
+  // Rebuilds |track_number_table_| from |track_entries_|. Returns true on
+  // success.
+  bool UpdateTrackNumberTable();
+
   // Track element list.
   Track** track_entries_;
 
   // Number of Track elements added.
   uint32 track_entries_size_;
 
+  // Tracks indexed by track number, for track numbers below
+  // |track_number_table_size_|. Tracks with larger numbers are looked up in
+  // |track_entries_|.
+  Track** track_number_table_;
+  uint32 track_number_table_size_;
+
+  // Flag telling if a CRC-32 element is written.
+  bool output_crc32_;
+
   LIBWEBM_DISALLOW_COPY_AND_ASSIGN(Tracks);
 };
 
@@ -688,6 +1174,10 @@ class Chapters {
   // Output the Chapters element to the writer. Returns true on success.
   bool Write(IMkvWriter* writer) const;
 
+  // Toggles writing a CRC-32 element at the start of the Chapters element.
+  void set_output_crc32(bool output_crc32) { output_crc32_ = output_crc32; }
+  bool output_crc32() const { return output_crc32_; }
+
  private:
   // Expands the chapters_ array if there is not enough space to contain
   // another chapter object.  Returns true on success.
@@ -707,6 +1197,9 @@ class Chapters {
   // Array for storage of chapter objects.
   Chapter* chapters_;
 
+  // Flag telling if a CRC-32 element is written.
+  bool output_crc32_;
+
   LIBWEBM_DISALLOW_COPY_AND_ASSIGN(Chapters);
 };
 
@@ -725,13 +1218,24 @@ class Cluster {
   // the cues element.
   bool Init(IMkvWriter* ptr_writer);
 
+  // Assembles the cluster in memory instead of writing each block straight
+  // to the writer passed to Init(). The whole cluster, including its final
+  // size, is then output with a single write in Finalize(), so the size can
+  // be recorded even when the writer is not seekable. If the cluster grows
+  // beyond |max_buffer_size| bytes, the buffered data is output and the rest
+  // of the cluster is written through directly, falling back to the
+  // unbuffered behavior. Must be called after Init() and before any frame is
+  // added. Returns true on success.
+  bool EnableBuffering(uint64 max_buffer_size);
+
   // Adds a frame to be output in the file. The frame is written out through
   // |writer_| if successful. Returns true on success.
   // Inputs:
   //   frame: Pointer to the data
   //   length: Length of the data
   //   track_number: Track to add the data to. Value returned by Add track
-  //                 functions.  The range of allowed values is [1, 126].
+  //                 functions.  The range of allowed values is
+  //                 [1, kMaxTrackNumber].
   //   timecode:     Absolute (not relative to cluster) timestamp of the
   //                 frame, expressed in timecode units.
   //   is_key:       Flag telling whether or not this frame is a key frame.
@@ -748,7 +1252,8 @@ class Cluster {
   //   additional_length: Length of the additional data
   //   add_id: Value of BlockAddID element
   //   track_number: Track to add the data to. Value returned by Add track
-  //                 functions.  The range of allowed values is [1, 126].
+  //                 functions.  The range of allowed values is
+  //                 [1, kMaxTrackNumber].
   //   abs_timecode: Absolute (not relative to cluster) timestamp of the
   //                 frame, expressed in timecode units.
   //   is_key:       Flag telling whether or not this frame is a key frame.
@@ -764,7 +1269,8 @@ class Cluster {
   //   length: Length of the data.
   //   discard_padding: DiscardPadding element value.
   //   track_number: Track to add the data to. Value returned by Add track
-  //                 functions.  The range of allowed values is [1, 126].
+  //                 functions.  The range of allowed values is
+  //                 [1, kMaxTrackNumber].
   //   abs_timecode: Absolute (not relative to cluster) timestamp of the
   //                 frame, expressed in timecode units.
   //   is_key:       Flag telling whether or not this frame is a key frame.
@@ -772,13 +1278,49 @@ class Cluster {
                                   int64 discard_padding, uint64 track_number,
                                   uint64 abs_timecode, bool is_key);
 
+  // Adds a block whose payload is copied from |reader|, see
+  // Segment::AddBlockPassthrough(). |abs_timecode| is the absolute timecode
+  // of the block, expressed in timecode units. Returns true on success.
+  bool AddBlockPassthrough(mkvparser::IMkvReader* reader, int64 position,
+                           uint64 size, uint64 track_number,
+                           uint64 abs_timecode, bool is_key);
+
+  // Packs consecutive frames passed to AddLacedFrame() into laced
+  // SimpleBlocks. A lace holds frames of a single track whose timecodes are
+  // no more than |max_lace_duration| timecode units past the first frame of
+  // the lace. Must be called after Init() and before any frame is added.
+  // Returns true on success.
+  bool EnableLacing(uint64 max_lace_duration);
+
+  // Adds a frame like AddFrame(), but holds it back so it can be laced with
+  // the frames that follow on the same track. The pending lace is written
+  // when a frame that does not fit it or any other block is added, or when
+  // FlushLace() or Finalize() is called. Only the first frame of a lace keeps
+  // its own timecode, so a frame joins the lace only if it starts
+  // |frame_duration| timecode units, the DefaultDuration of the track, after
+  // the previous one. Behaves like AddFrame() when lacing is not enabled or
+  // |frame_duration| is 0. Returns true on success.
+  bool AddLacedFrame(const uint8* frame, uint64 length, uint64 track_number,
+                     uint64 abs_timecode, uint64 frame_duration, bool is_key);
+
+  // Writes out the pending lace, if any. Returns true on success.
+  bool FlushLace();
+
+  // Writes a CRC-32 element as the first child of the cluster. The checksum
+  // is computed as the cluster is written and filled in by Finalize(). When
+  // the cluster can not be revisited, i.e. the writer is not seekable and the
+  // cluster is not buffered, the space stays a Void element. Must be called
+  // before any frame is added. Returns true on success.
+  bool EnableCrc32();
+
   // Writes a frame of metadata to the output medium; returns true on
   // success.
   // Inputs:
   //   frame: Pointer to the data
   //   length: Length of the data
   //   track_number: Track to add the data to. Value returned by Add track
-  //                 functions.  The range of allowed values is [1, 126].
+  //                 functions.  The range of allowed values is
+  //                 [1, kMaxTrackNumber].
   //   timecode:     Absolute (not relative to cluster) timestamp of the
   //                 metadata frame, expressed in timecode units.
   //   duration:     Duration of metadata frame, in timecode units.
@@ -793,19 +1335,42 @@ class Cluster {
   void AddPayloadSize(uint64 size);
 
   // Closes the cluster so no more data can be written to it. Will update the
-  // cluster's size if |writer_| is seekable. Returns true on success.
+  // cluster's size and CRC-32 if |writer_| is seekable. Returns true on
+  // success.
   bool Finalize();
 
+  // Closes the cluster like Finalize(), but writes the updates of the size
+  // and CRC-32 to |patch_writer| unless the cluster is still held in its
+  // buffer. |patch_writer| must write to the same output as |writer_|.
+  bool Finalize(IMkvWriter* patch_writer);
+
   // Returns the size in bytes for the entire Cluster element.
   uint64 Size() const;
 
   int64 size_position() const { return size_position_; }
   int32 blocks_added() const { return blocks_added_; }
   uint64 payload_size() const { return payload_size_; }
+
+  // Returns the number of bytes of frame data held back in the pending lace,
+  // which |payload_size()| does not include until the lace is written.
+  uint64 pending_size() const;
+
   int64 position_for_cues() const { return position_for_cues_; }
   uint64 timecode() const { return timecode_; }
 
+  // Records the blocks written to the cluster in |statistics|, which must
+  // outlive the cluster.
+  void set_statistics(MuxerStatistics* statistics) {
+    statistics_ = statistics;
+  }
+
  private:
+  // In-memory writer used to assemble the cluster when buffering is enabled.
+  class Buffer;
+
+  // Frames held back to be written as one laced block.
+  class Lace;
+
   //  Signature that matches either of WriteSimpleBlock or WriteMetadataBlock
   //  in the muxer utilities package.
   typedef uint64 (*WriteBlock)(IMkvWriter* writer, const uint8* data,
@@ -836,12 +1401,10 @@ class Cluster {
   bool PreWriteBlock(Type* write_function);
 
   // Utility method used by the |DoWriteBlock*| methods that handles the book
-  // keeping required after each block is written.
-  void PostWriteBlock(uint64 element_size);
+  // keeping required after each block of |track_number| is written.
+  void PostWriteBlock(uint64 track_number, uint64 element_size);
 
-  // To simplify things, we require that there be fewer than 127
-  // tracks -- this allows us to serialize the track number value for
-  // a stream using a single byte, per the Matroska encoding.
+  // Returns true if |track_number| is in the range [1, kMaxTrackNumber].
   bool IsValidTrackNumber(uint64 track_number) const;
 
   // Given |abs_timecode|, calculates timecode relative to most recent timecode.
@@ -893,9 +1456,35 @@ class Cluster {
   // The absolute timecode of the cluster.
   const uint64 timecode_;
 
-  // Pointer to the writer object. Not owned by this class.
+  // Pointer to the writer object. Not owned by this class. Points to
+  // |buffer_| when buffering is enabled.
   IMkvWriter* writer_;
 
+  // Memory buffer the cluster is assembled in, or NULL when the cluster is
+  // written directly to |writer_|.
+  Buffer* buffer_;
+
+  // Frames waiting to be laced, or NULL when lacing is not enabled.
+  Lace* lace_;
+
+  // Maximum timecode span of a lace, in timecode units.
+  uint64 max_lace_duration_;
+
+  // Flag telling if a CRC-32 element is written.
+  bool output_crc32_;
+
+  // Computes the checksum of the payload once the header is written, or NULL
+  // when no CRC-32 element is written. |writer_| points to it while the
+  // cluster is open.
+  Crc32MkvWriter* crc32_writer_;
+
+  // The file position of the CRC-32 element.
+  int64 crc32_position_;
+
+  // Counters the written blocks are recorded in, or NULL. Not owned by this
+  // class.
+  MuxerStatistics* statistics_;
+
   LIBWEBM_DISALLOW_COPY_AND_ASSIGN(Cluster);
 };
 
@@ -933,6 +1522,11 @@ class SeekHead {
   // a SeekHead element later. Returns true on success.
   bool Write(IMkvWriter* writer);
 
+  // Toggles writing a CRC-32 element at the start of the SeekHead element.
+  // Must be set before Write() reserves the space for the element.
+  void set_output_crc32(bool output_crc32) { output_crc32_ = output_crc32; }
+  bool output_crc32() const { return output_crc32_; }
+
   // We are going to put a cap on the number of Seek Entries.
   const static int32 kSeekEntryCount = 5;
 
@@ -940,6 +1534,13 @@ class SeekHead {
   // Returns the maximum size in bytes of one seek entry.
   uint64 MaxEntrySize() const;
 
+  // Returns the size in bytes of the payload reserved by Write().
+  uint64 ReservedPayloadSize() const;
+
+  // Outputs the Seek elements that are set to the writer. |entry_size| holds
+  // the payload size of each Seek element. Returns true on success.
+  bool WriteSeekEntries(IMkvWriter* writer, const uint64* entry_size) const;
+
   // Seek entry id element list.
   uint32 seek_entry_id_[kSeekEntryCount];
 
@@ -949,6 +1550,9 @@ class SeekHead {
   // The file position of SeekHead element.
   int64 start_pos_;
 
+  // Flag telling if a CRC-32 element is written.
+  bool output_crc32_;
+
   LIBWEBM_DISALLOW_COPY_AND_ASSIGN(SeekHead);
 };
 
@@ -959,7 +1563,8 @@ class SegmentInfo {
   SegmentInfo();
   ~SegmentInfo();
 
-  // Will update the duration if |duration_| is > 0.0. Returns true on success.
+  // Will update the duration if |duration_| is > 0.0, along with the CRC-32
+  // element when one was written. Returns true on success.
   bool Finalize(IMkvWriter* writer) const;
 
   // Sets |muxing_app_| and |writing_app_|.
@@ -980,7 +1585,20 @@ class SegmentInfo {
   void set_date_utc(int64 date_utc) { date_utc_ = date_utc; }
   int64 date_utc() const { return date_utc_; }
 
+  // Toggles writing a CRC-32 element at the start of the Segment Information
+  // element.
+  void set_output_crc32(bool output_crc32) { output_crc32_ = output_crc32; }
+  bool output_crc32() const { return output_crc32_; }
+
  private:
+  // Returns the size in bytes of the child elements, not counting the CRC-32
+  // element.
+  uint64 PayloadSize() const;
+
+  // Outputs the child elements, other than the CRC-32 element, to the
+  // writer. Returns true on success.
+  bool WritePayload(IMkvWriter* writer) const;
+
   // Segment Information element names.
   // Initially set to -1 to signify that a duration has not been set and should
   // not be written out.
@@ -996,9 +1614,68 @@ class SegmentInfo {
   // The file position of the duration element.
   int64 duration_pos_;
 
+  // Flag telling if a CRC-32 element is written.
+  bool output_crc32_;
+
+  // The file position of the CRC-32 element.
+  int64 crc32_pos_;
+
   LIBWEBM_DISALLOW_COPY_AND_ASSIGN(SegmentInfo);
 };
 
+///////////////////////////////////////////////////////////////
+// Rules for starting new clusters, set with Segment::SetClusterPolicy().
+// Durations are in nanoseconds and sizes in bytes of cluster payload; 0
+// means no limit.
+class ClusterPolicy {
+ public:
+  // Maximum number of frames the muxer can look ahead at.
+  static const int32 kMaxLookaheadFrames = 32;
+
+  ClusterPolicy();
+
+  // A video key frame starts a new cluster once the cluster has reached the
+  // minimum duration or the minimum size. With no minimum set, every video
+  // key frame starts a new cluster.
+  void set_min_cluster_duration(uint64 duration) {
+    min_cluster_duration_ = duration;
+  }
+  uint64 min_cluster_duration() const { return min_cluster_duration_; }
+  void set_min_cluster_size(uint64 size) { min_cluster_size_ = size; }
+  uint64 min_cluster_size() const { return min_cluster_size_; }
+
+  // Any frame starts a new cluster once the cluster has reached the maximum
+  // duration or the maximum size, unless a video key frame is among the
+  // frames looked ahead at; the cluster is then split at that key frame.
+  void set_max_cluster_duration(uint64 duration) {
+    max_cluster_duration_ = duration;
+  }
+  uint64 max_cluster_duration() const { return max_cluster_duration_; }
+  void set_max_cluster_size(uint64 size) { max_cluster_size_ = size; }
+  uint64 max_cluster_size() const { return max_cluster_size_; }
+
+  // Number of frames held back to look for the next video key frame, up to
+  // |kMaxLookaheadFrames|. Frames reach the cluster that many frames late.
+  void set_lookahead_frames(int32 frames) { lookahead_frames_ = frames; }
+  int32 lookahead_frames() const { return lookahead_frames_; }
+
+  // Returns true if the limits are consistent: each minimum is no larger
+  // than the matching maximum, and the lookahead is in range.
+  bool IsValid() const;
+
+  // Returns true if a cluster of |duration| nanoseconds and |size| bytes has
+  // reached the minimum, or the maximum.
+  bool ReachedMin(uint64 duration, uint64 size) const;
+  bool ReachedMax(uint64 duration, uint64 size) const;
+
+ private:
+  uint64 min_cluster_duration_;
+  uint64 min_cluster_size_;
+  uint64 max_cluster_duration_;
+  uint64 max_cluster_size_;
+  int32 lookahead_frames_;
+};
+
 ///////////////////////////////////////////////////////////////
 // This class represents the main segment in a WebM file. Currently only
 // supports one Segment element.
@@ -1016,6 +1693,7 @@ class Segment {
 
   const static uint32 kDefaultDocTypeVersion = 2;
   const static uint64 kDefaultMaxClusterDuration = 30000000000ULL;
+  const static uint64 kDefaultMaxClusterBufferSize = 32 * 1024 * 1024;
 
   Segment();
   ~Segment();
@@ -1045,7 +1723,8 @@ class Segment {
   // Adds a cue point to the Cues element. |timestamp| is the time in
   // nanoseconds of the cue's time. |track| is the Track of the Cue. This
   // function must be called after AddFrame to calculate the correct
-  // BlockNumber for the CuePoint. Returns true on success.
+  // BlockNumber for the CuePoint. If the last cue point has the same time,
+  // the track is added to it instead. Returns true on success.
   bool AddCuePoint(uint64 timestamp, uint64 track);
 
   // Adds a frame to be output in the file. Returns true on success.
@@ -1115,6 +1794,55 @@ class Segment {
   //   frame: frame object
   bool AddGenericFrame(const Frame* frame);
 
+  // Writes |count| frames to the output medium, as AddGenericFrame() would
+  // for each of them. The frames may belong to different tracks and must be
+  // in timestamp order. The whole batch is validated before any frame is
+  // muxed, so on a validation error nothing is written. Returns true on
+  // success.
+  // Inputs:
+  //   frames: array of frame objects
+  //   count:  number of frames in |frames|
+  bool AddFrames(const Frame* const* frames, int32 count);
+
+  // Adds a block that is copied from another WebM file without staging its
+  // frames in memory. The payload of the parsed |block| is read from |reader|
+  // and written out as a SimpleBlock; only the track number and timecode are
+  // rewritten. The key, lacing, invisible and discardable flags are kept.
+  // Only the Block itself is copied: the other children of a source
+  // BlockGroup, e.g. BlockDuration, BlockAdditions, ReferenceBlock and
+  // DiscardPadding, are dropped, so blocks of BlockGroups that have any
+  // should be added frame by frame instead. Audio blocks are held back to be muxed with video key frames like the
+  // frames passed to AddFrame(); only the position and size of the payload
+  // are kept, so |reader| must stay open until Finalize(). Returns true on
+  // success.
+  // Inputs:
+  //   reader:       reader of the file |block| was parsed from
+  //   block:        the source Block or SimpleBlock
+  //   track_number: track to add the block to
+  //   timestamp:    timestamp of the block in nanoseconds
+  bool AddBlockPassthrough(mkvparser::IMkvReader* reader,
+                           const mkvparser::Block& block, uint64 track_number,
+                           uint64 timestamp);
+
+  // Sets |transform| to be applied to the data of every frame of the track
+  // |track_number| before it is written, e.g. an AesCtrFrameTransform to
+  // encrypt the frames as described by the track's ContentEncoding element.
+  // NULL removes the transform. Frames added with AddBlockPassthrough() can
+  // not be transformed. |transform| is owned by the caller and must outlive
+  // the segment. Returns true on success.
+  bool SetFrameTransform(uint64 track_number,
+                         const IMkvFrameTransform* transform);
+
+  // Sets the number of worker threads that run the frame transforms. With 0
+  // threads, the default, frames are transformed on the thread adding them.
+  // Otherwise frames are transformed in parallel while more frames are
+  // added, and the frames of all tracks are muxed in the order they were
+  // added. A frame that fails to transform is dropped and the failure is
+  // reported by a later call that adds a frame, or by Finalize(). Must be
+  // set before the first frame is added. Returns true on success.
+  bool SetFrameTransformThreads(int32 num_threads);
+  int32 frame_transform_threads() const { return frame_transform_threads_; }
+
   // Adds a VP8 video track to the segment. Returns the number of the track on
   // success, 0 on error. |number| is the number to use for the video track.
   // |number| must be >= 0. If |number| == 0 then the muxer will decide on
@@ -1135,11 +1863,32 @@ class Segment {
   bool CopyAndMoveCuesBeforeClusters(mkvparser::IMkvReader* reader,
                                      IMkvWriter* writer);
 
-  // Sets which track to use for the Cues element. Must have added the track
-  // before calling this function. Returns true on success. |track_number| is
-  // returned by the Add track functions.
+  // Reserves space for the Cues element between the headers and the first
+  // Cluster, so Finalize() can write the Cues before the Clusters in place
+  // instead of requiring CopyAndMoveCuesBeforeClusters(). The space is
+  // estimated from |duration_ns|, the expected duration of the segment, and
+  // |cue_interval_ns|, the expected time between cue points. Any space left
+  // over is written as a Void element. If the Cues turn out larger than the
+  // reserved space, they are written after the Clusters as usual and
+  // cues_position() returns |kAfterClusters|; CopyAndMoveCuesBeforeClusters()
+  // can then be used as before. Only applies to |kFile| mode with a seekable
+  // writer and no chunking. Must be called before the first frame is added.
+  // Returns true on success.
+  bool ReserveCuesSpace(uint64 duration_ns, uint64 cue_interval_ns);
+
+  // Sets which track to use for the Cues element, replacing any tracks added
+  // before. Must have added the track before calling this function. Returns
+  // true on success. |track_number| is returned by the Add track functions.
   bool CuesTrack(uint64 track_number);
 
+  // Adds a track to output cue points on, in addition to the tracks set
+  // before, or changes its interval. A cue point is added on the first frame
+  // of the track in a new Cluster, once |min_interval_ns| nanoseconds have
+  // passed since the last cue point of the track. Cue points of different
+  // tracks with the same time share one CuePoint element. Returns true on
+  // success.
+  bool AddCuesTrack(uint64 track_number, uint64 min_interval_ns);
+
   // This will force the muxer to create a new Cluster when the next frame is
   // added.
   void ForceNewClusterOnNextFrame();
@@ -1174,8 +1923,20 @@ class Segment {
   // That will force the interface to be dependent on files.
   bool SetChunking(bool chunking, const char* filename);
 
+  // Turns on chunking with the chunks passed to |sink| instead of being
+  // written to files. The chunks are assembled in memory, and each one is
+  // passed to |sink| as soon as it is complete. The header chunk is passed
+  // once it is final, i.e. in Finalize() unless the mode is |kLive|.
+  // |sink| is owned by the caller and must outlive the segment. Must be
+  // called before the first frame is added. Returns true on success.
+  bool SetChunkSink(IMkvChunkSink* sink);
+
   bool chunking() const { return chunking_; }
-  uint64 cues_track() const { return cues_track_; }
+  // Returns the first track used for the Cues element, or 0 if none is set.
+  uint64 cues_track() const {
+    return cue_tracks_size_ > 0 ? cue_tracks_[0].track_number : 0;
+  }
+  int32 cue_tracks_size() const { return cue_tracks_size_; }
   void set_max_cluster_duration(uint64 max_cluster_duration) {
     max_cluster_duration_ = max_cluster_duration;
   }
@@ -1184,6 +1945,97 @@ class Segment {
     max_cluster_size_ = max_cluster_size;
   }
   uint64 max_cluster_size() const { return max_cluster_size_; }
+
+  // Sets the rules for starting new clusters to |policy|, which replace the
+  // video key frame rule, |max_cluster_duration()| and |max_cluster_size()|.
+  // Returns false if |policy| is not valid.
+  bool SetClusterPolicy(const ClusterPolicy& policy);
+
+  // Returns the rules set with SetClusterPolicy(), or NULL.
+  const ClusterPolicy* cluster_policy() const;
+
+  // Toggles whether clusters are assembled in memory and output with a known
+  // size in a single write when they are closed. This allows sized clusters
+  // on writers that cannot seek, e.g. in |kLive| mode. Note that the blocks
+  // of a cluster only reach the writer once the cluster is closed. Must be
+  // set before the first frame is added.
+  void set_buffer_clusters(bool buffer_clusters) {
+    buffer_clusters_ = buffer_clusters;
+  }
+  bool buffer_clusters() const { return buffer_clusters_; }
+
+  // Sets the maximum amount of memory in bytes a buffered cluster may use.
+  // Clusters that grow larger are written out with an unknown size when the
+  // writer is not seekable. Default is |kDefaultMaxClusterBufferSize|.
+  void set_max_cluster_buffer_size(uint64 max_cluster_buffer_size) {
+    max_cluster_buffer_size_ = max_cluster_buffer_size;
+  }
+  uint64 max_cluster_buffer_size() const { return max_cluster_buffer_size_; }
+
+  // Sets the maximum time in nanoseconds that audio frames are held back
+  // waiting for the video frames they are muxed with. Once the queued audio
+  // spans |max_audio_hold| of media time it is written out, even if this
+  // places it in the cluster before the video key frame it belongs to.
+  // Frames must be added in timestamp order across all tracks. Default is 0,
+  // which holds audio until the next video frame.
+  void set_max_audio_hold(uint64 max_audio_hold) {
+    max_audio_hold_ = max_audio_hold;
+  }
+  uint64 max_audio_hold() const { return max_audio_hold_; }
+
+  // Sets the maximum time in nanoseconds spanned by the frames packed into
+  // one laced SimpleBlock. When non-zero, consecutive frames of the same
+  // audio or metadata track that are added without additional data, discard
+  // padding or a duration are laced, using whichever of Xiph, EBML or
+  // fixed-size lacing results in the smallest block. Only the first frame of
+  // a lace keeps its own timestamp; the others are implied by the track's
+  // default duration. Frames are therefore only laced on tracks whose default
+  // duration is set to a whole number of timecode units, and only while they
+  // follow each other at exactly that spacing. Must be set before the first
+  // frame is added. Default is 0, which disables lacing.
+  void set_max_lace_duration(uint64 max_lace_duration) {
+    max_lace_duration_ = max_lace_duration;
+  }
+  uint64 max_lace_duration() const { return max_lace_duration_; }
+
+  // Toggles writing CRC-32 elements as the first child of the SeekHead,
+  // Segment Information, Tracks, Chapters, Cues and Cluster elements. The CRC-32 of a cluster
+  // is only filled in when the writer is seekable or clusters are buffered;
+  // otherwise the space is left as a Void element. Must be set before the
+  // first frame is added.
+  void set_output_crc32(bool output_crc32);
+  bool output_crc32() const { return output_crc32_; }
+
+  // Sets |callback| to be called at flush points. A flush point is reached
+  // after every |max_blocks| blocks or once |max_interval_ns| of media time
+  // has been written since the last flush point, whichever comes first. A
+  // value of 0 disables the respective limit. A pending lace is written out
+  // before the callback is called. Blocks of buffered clusters only reach the
+  // writer when the cluster is closed. Passing NULL removes the callback.
+  // |callback| is owned by the caller. Returns true on success.
+  bool SetFlushCallback(IMkvFlushCallback* callback, int32 max_blocks,
+                        uint64 max_interval_ns);
+
+  // Toggles recording the latency from the time a frame is passed to the
+  // muxer to the time its block is written to the cluster. The latencies are
+  // collected in |latency_histogram()|.
+  void set_record_latency(bool record_latency) {
+    record_latency_ = record_latency;
+  }
+  bool record_latency() const { return record_latency_; }
+  const LatencyHistogram& latency_histogram() const {
+    return latency_histogram_;
+  }
+
+  // Toggles collecting counts of the clusters, blocks and writer calls of
+  // the segment, and the time spent in Finalize(), in |statistics()|. Must
+  // be set before the first frame is added.
+  void set_collect_statistics(bool collect_statistics) {
+    collect_statistics_ = collect_statistics;
+  }
+  bool collect_statistics() const { return collect_statistics_; }
+  const MuxerStatistics& statistics() const { return statistics_; }
+
   void set_mode(Mode mode) { mode_ = mode; }
   Mode mode() const { return mode_; }
   CuesPosition cues_position() const { return cues_position_; }
@@ -1191,6 +2043,27 @@ class Segment {
   const SegmentInfo* segment_info() const { return &segment_info_; }
 
  private:
+  // Number of slots of |lookahead_frames_|, one more than the frames held
+  // back so that a frame can be added before the oldest one is muxed.
+  static const int32 kLookaheadRingSize =
+      ClusterPolicy::kMaxLookaheadFrames + 1;
+
+  // Cue point state of a track associated with the Cues element.
+  struct CueTrack {
+    uint64 track_number;
+
+    // Minimum time in nanoseconds between cue points of the track.
+    uint64 min_interval;
+
+    // Time in nanoseconds of the last cue point of the track, if |has_cue|.
+    uint64 last_cue_time;
+    bool has_cue;
+
+    // Set when a new Cluster starts, cleared by the first frame of the track
+    // in the Cluster.
+    bool new_cuepoint;
+  };
+
   // Checks if header information has been output and initialized. If not it
   // will output the Segment element and initialize the SeekHead elment and
   // Cues elements.
@@ -1204,9 +2077,19 @@ class Segment {
   // on success.
   bool UpdateChunkName(const char* ext, char** name) const;
 
+  // Completes the chunk of |type| being written. Closes the chunk file, or
+  // passes the chunk to |chunk_sink_| and empties its buffer.
+  // |end_timestamp_ns| is the end time of a |kCluster| chunk. Returns true on
+  // success.
+  bool CompleteChunk(IMkvChunkSink::ChunkType type, uint64 end_timestamp_ns);
+
+  // Starts a new |kCluster| or |kCues| chunk numbered after |chunk_count_|.
+  // Returns true on success.
+  bool StartChunk(IMkvChunkSink::ChunkType type);
+
   // Returns the maximum offset within the segment's payload. When chunking
   // this function is needed to determine offsets of elements within the
-  // chunked files. Returns -1 on error.
+  // chunked files. Runs in constant time. Returns -1 on error.
   int64 MaxOffset();
 
   // Adds the frame to our frame array.
@@ -1216,6 +2099,112 @@ class Segment {
   // it returns the number of frames written.
   int WriteFramesAll();
 
+  // Writes |frame| to the current cluster, as a metadata block if
+  // |is_metadata| is true. |ingest_time| is the time the frame was received.
+  // Returns true on success.
+  bool WriteFrame(const Frame* frame, bool is_metadata, uint64 ingest_time);
+
+  // Adds |frame| of |track| without validating it. |ingest_time| is the time
+  // the frame was received. Used to implement AddFrames.
+  bool AddValidatedFrame(const Frame* frame, const Track* track,
+                         uint64 ingest_time);
+
+  // Returns true if frames of |track| have to go through
+  // |frame_transform_queue_|, because the track has a frame transform or
+  // frames added before are still being transformed.
+  bool UseFrameTransformQueue(const Track* track) const;
+
+  // Returns true if frames have to go through |lookahead_frames_|, because
+  // the cluster policy looks ahead or frames are still held back.
+  bool UseLookahead() const;
+
+  // Returns true if audio frames of |track| are held back until the video
+  // frame that goes with them is added, so that the audio at the start of a
+  // video key frame is muxed into the same cluster.
+  bool HoldsAudioFrames(const Track* track) const;
+
+  // Returns true if the AddFrame() variants do not mux frames of |track|
+  // right away, but pass a copy to DeferFrame().
+  bool DefersFrames(const Track* track) const;
+
+  // Passes |frame| of |track| on to SubmitFrame(), AddLookaheadFrame() or
+  // QueueAudioFrame(). Takes ownership of |frame|. Returns true on success.
+  bool DeferFrame(Frame* frame, const Track* track);
+
+  // Pushes |frame| of |track| to |frame_transform_queue_| and muxes the
+  // frames that are done. Takes ownership of |frame|. Returns true on
+  // success.
+  bool SubmitFrame(Frame* frame, const Track* track);
+
+  // Muxes the frames at the front of |frame_transform_queue_| whose
+  // transform is done. If |wait| is true, waits until all frames are muxed.
+  // Returns true on success.
+  bool MuxTransformedFrames(bool wait);
+
+  // Muxes |frame| taken out of |frame_transform_queue_|, or holds it back in
+  // |lookahead_frames_|. Takes ownership of |frame|. Returns true on success.
+  bool MuxTransformedFrame(Frame* frame);
+
+  // Holds |frame| back in |lookahead_frames_| and muxes the frames the
+  // cluster policy no longer looks ahead at. Takes ownership of |frame|.
+  // Returns true on success.
+  bool AddLookaheadFrame(Frame* frame);
+
+  // Muxes the oldest frames of |lookahead_frames_| until |frames_left| are
+  // left. Returns true on success.
+  bool MuxLookaheadFrames(int32 frames_left);
+
+  // Returns the timestamp in nanoseconds of the newest frame in
+  // |lookahead_frames_|, or 0 if there is none.
+  uint64 LookaheadTimestamp() const;
+
+  // Returns the smallest timestamp in nanoseconds the next frame may have:
+  // that of the last frame muxed, or of the newest frame still held back in
+  // |frame_transform_queue_| or |lookahead_frames_|.
+  uint64 MinNextTimestamp() const;
+
+  // Returns the DefaultDuration of |track_number| in timecode units if its
+  // frames may be laced, or 0. Frames of a cues track that may start a cue
+  // point, and frames of tracks without a DefaultDuration that is a whole
+  // number of timecode units, are never laced.
+  uint64 LaceFrameDuration(uint64 track_number) const;
+
+  // Returns the cue point state of |track_number|, or NULL if the track is
+  // not associated with the Cues element.
+  CueTrack* GetCueTrack(uint64 track_number) const;
+
+  // Adds a cue point for the frame of |track_number| at |timestamp| just
+  // added, if it is the first frame of a cues track in a new Cluster and the
+  // interval of the track has passed. Returns true on success.
+  bool CheckCuePoint(uint64 timestamp, uint64 track_number);
+
+  // Queues the audio |frame| until the video frame that goes with it is
+  // added, then calls CheckAudioHold(). Takes ownership of |frame|, which is
+  // deleted on failure. Returns true on success.
+  bool QueueAudioFrame(Frame* frame);
+
+  // Writes out the queued frames if they span |max_audio_hold_| or more.
+  // Returns true on success.
+  bool CheckAudioHold();
+
+  // Updates the latency statistics and flush points after the block of the
+  // frame received at |ingest_time| has been written. Returns true on
+  // success.
+  bool OnBlockWritten(uint64 timestamp_ns, uint64 ingest_time);
+
+  // Returns the current monotonic time if latencies are recorded, 0
+  // otherwise.
+  uint64 IngestTime() const;
+
+  // Wraps the writers in StatisticsMkvWriter objects that record into
+  // |statistics_|. Returns true on success.
+  bool WrapStatisticsWriters();
+
+  // Records the time since |*start_ns| as spent in |phase| if statistics are
+  // collected, and sets |*start_ns| to the current time.
+  void EndFinalizePhase(MuxerStatistics::FinalizePhase phase,
+                        uint64* start_ns);
+
   // Output all frames that are queued that have an end time that is less
   // then |timestamp|. Returns true on success and if there are no frames
   // queued.
@@ -1225,6 +2214,14 @@ class Segment {
   // and Tracks element to |writer_|.
   bool WriteSegmentHeader();
 
+  // Returns the size in bytes to reserve for the Cues element, based on the
+  // values passed to ReserveCuesSpace().
+  uint64 EstimateCuesSize() const;
+
+  // Returns true if the Cues element can be written to the reserved space,
+  // leaving room for a Void element if any space is left over.
+  bool CuesFitReservedSpace();
+
   // Given a frame with the specified timestamp (nanosecond units) and
   // keyframe status, determine whether a new cluster should be
   // created, before writing enqueued frames and the frame itself. The
@@ -1233,7 +2230,17 @@ class Segment {
   //  0 = do not create a new cluster, and write frame to the existing cluster
   //  1 = create a new cluster, and write frame to that new cluster
   //  2 = create a new cluster, and re-run test
-  int TestFrame(uint64 track_num, uint64 timestamp_ns, bool key) const;
+  // When a new cluster is created, |reason| is set to the reason why.
+  int TestFrame(uint64 track_num, uint64 timestamp_ns, bool key,
+                MuxerStatistics::ClusterReason* reason) const;
+
+  // Implements TestFrame() for frames that fit the last cluster when a
+  // cluster policy is set. |cluster_duration| is the time in nanoseconds
+  // from the start of the cluster to the frame and |cluster_size| is the
+  // size of the cluster's payload. Returns 0 or 1 like TestFrame().
+  int TestClusterPolicy(uint64 track_number, uint64 cluster_duration,
+                        uint64 cluster_size, bool key,
+                        MuxerStatistics::ClusterReason* reason) const;
 
   // Create a new cluster, using the earlier of the first enqueued
   // frame, or the indicated time. Returns true on success.
@@ -1248,16 +2255,6 @@ class Segment {
   // reflect the correct offsets.
   void MoveCuesBeforeClusters();
 
-  // This function recursively computes the correct cluster offsets (this is
-  // done to move the Cues before Clusters). It recursively updates the change
-  // in size (which indicates a change in cluster offset) until no sizes change.
-  // Parameters:
-  // diff - indicates the difference in size of the Cues element that needs to
-  //        accounted for.
-  // index - index in the list of Cues which is currently being adjusted.
-  // cue_size - sum of size of all the CuePoint elements.
-  void MoveCuesBeforeClustersHelper(uint64 diff, int index, uint64* cue_size);
-
   // Seeds the random number generator used to make UIDs.
   unsigned int seed_;
 
@@ -1286,6 +2283,13 @@ class Segment {
   // Matroska header out to a file.
   MkvWriter* chunk_writer_header_;
 
+  // Receives the chunks when set. The chunks are then assembled in the
+  // |chunk_buffer_*| writers instead of the |chunk_writer_*| files.
+  IMkvChunkSink* chunk_sink_;
+  MemoryMkvWriter* chunk_buffer_cluster_;
+  MemoryMkvWriter* chunk_buffer_cues_;
+  MemoryMkvWriter* chunk_buffer_header_;
+
   // Flag telling whether or not the muxer is chunking output to multiple
   // files.
   bool chunking_;
@@ -1296,24 +2300,121 @@ class Segment {
   // File position offset where the Clusters end.
   int64 cluster_end_offset_;
 
-  // List of clusters.
+  // List of clusters. Only the current cluster is kept; earlier ones are
+  // released once they are complete, so memory does not grow with the
+  // length of the segment.
   Cluster** cluster_list_;
 
   // Number of cluster pointers allocated in the cluster list.
   int32 cluster_list_capacity_;
 
-  // Number of clusters in the cluster list.
+  // Number of clusters in the cluster list, 0 before the first cluster and 1
+  // after.
   int32 cluster_list_size_;
 
+  // Sum of the sizes in bytes of all clusters before the current one.
+  uint64 closed_clusters_size_;
+
   // Indicates whether Cues should be written before or after Clusters
   CuesPosition cues_position_;
 
-  // Track number that is associated with the cues element for this segment.
-  uint64 cues_track_;
+  // Expected segment duration and time between cue points in nanoseconds,
+  // used to size the space reserved for the Cues element.
+  uint64 cues_reserve_duration_;
+  uint64 cues_reserve_interval_;
+
+  // Size in bytes and file position of the space reserved for the Cues
+  // element. |cues_reserved_size_| is 0 when no space is reserved.
+  uint64 cues_reserved_size_;
+  int64 cues_reserved_pos_;
+
+  // Tracks that are associated with the cues element for this segment, in
+  // the order they were added. |cue_tracks_capacity_| is the number of
+  // allocated elements.
+  CueTrack* cue_tracks_;
+  int32 cue_tracks_size_;
+  int32 cue_tracks_capacity_;
 
   // Tells the muxer to force a new cluster on the next Block.
   bool force_new_cluster_;
 
+  // Flag telling whether clusters are assembled in memory before being
+  // output.
+  bool buffer_clusters_;
+
+  // Maximum size in bytes of a cluster assembled in memory.
+  uint64 max_cluster_buffer_size_;
+
+  // Maximum span of media time in nanoseconds of queued audio frames.
+  uint64 max_audio_hold_;
+
+  // Maximum span of media time in nanoseconds of a laced block.
+  uint64 max_lace_duration_;
+
+  // Flag telling if CRC-32 elements are written.
+  bool output_crc32_;
+
+  // Runs the frame transforms. Created when the first frame that needs it is
+  // added.
+  FrameTransformQueue* frame_transform_queue_;
+
+  // Number of threads running frame transforms.
+  int32 frame_transform_threads_;
+
+  // Sequence number passed with the next frame to its transform.
+  uint64 frame_transform_sequence_;
+
+  // Timestamp in nanoseconds of the last frame pushed to
+  // |frame_transform_queue_|.
+  uint64 frame_transform_timestamp_;
+
+  // Flag telling if muxing a transformed frame failed where the failure could
+  // not be returned.
+  bool frame_transform_error_;
+
+  // Rules for starting new clusters, if |has_cluster_policy_| is set.
+  bool has_cluster_policy_;
+  ClusterPolicy cluster_policy_;
+
+  // Frames held back for the cluster policy to look ahead at, oldest first.
+  // A ring of |kLookaheadRingSize| slots, of which |lookahead_size_| starting
+  // at |lookahead_head_| are in use. Allocated when the first frame is held
+  // back.
+  Frame** lookahead_frames_;
+  int32 lookahead_head_;
+  int32 lookahead_size_;
+
+  // Number of video key frames in |lookahead_frames_|, i.e. ahead of the
+  // frame being muxed.
+  int32 lookahead_key_frames_;
+
+  // Called at flush points. Not owned by this class.
+  IMkvFlushCallback* flush_callback_;
+
+  // Number of blocks and media time in nanoseconds between flush points.
+  int32 flush_max_blocks_;
+  uint64 flush_max_interval_;
+
+  // Number of blocks written and timestamp of the last block written at the
+  // last flush point.
+  int32 flush_block_count_;
+  uint64 flush_timestamp_;
+
+  // Flag telling whether latencies are recorded in |latency_histogram_|.
+  bool record_latency_;
+  LatencyHistogram latency_histogram_;
+
+  // Flag telling whether counts are collected in |statistics_|.
+  bool collect_statistics_;
+  MuxerStatistics statistics_;
+
+  // Writers recording into |statistics_| that |writer_cluster_|,
+  // |writer_cues_| and |writer_header_| point to when statistics are
+  // collected. Writers that are shared are wrapped once.
+  StatisticsMkvWriter* statistics_writer_cluster_;
+  StatisticsMkvWriter* statistics_writer_cues_;
+  StatisticsMkvWriter* statistics_writer_header_;
+
   // List of stored audio frames. These variables are used to store frames so
   // the muxer can follow the guideline "Audio blocks that contain the video
   // key frame's timecode should be in the same cluster as the video key frame
@@ -1352,9 +2453,6 @@ class Segment {
   // seek backwards.
   Mode mode_;
 
-  // Flag telling the muxer that a new cue point should be added.
-  bool new_cuepoint_;
-
   // TODO(fgalligan): Should we add support for more than one Cues element?
   // Flag whether or not the muxer should output a Cues element.
   bool output_cues_;
@@ -12,6 +12,12 @@
 #include <fcntl.h>
 #endif
 
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
 #include <cassert>
 #include <cmath>
 #include <cstdio>
@@ -20,6 +26,7 @@
 #include <ctime>
 #include <new>
 
+#include "mkvparser.hpp"
 #include "mkvwriter.hpp"
 #include "webmids.hpp"
 
@@ -35,6 +42,124 @@ namespace {
 // Date elements are always 8 octets in size.
 const int kDateElementSize = 8;
 
+// Returns the size in bytes of the header of a Block or SimpleBlock of
+// |track_number|: the coded track number, a 2 byte timecode and 1 byte of
+// flags. Track numbers below 127 keep the header at 4 bytes.
+uint64 BlockHeaderSize(uint64 track_number) {
+  return GetCodedUIntSize(track_number) + 3;
+}
+
+// Largest SimpleBlock header: a 1 byte ID, an 8 byte size, an 8 byte track
+// number, the timecode and the flags.
+const int32 kMaxSimpleBlockHeaderSize = 1 + 8 + 8 + 2 + 1;
+
+// Largest header of a BlockGroup holding a Block: the BlockGroup and Block
+// IDs and sizes followed by the block header.
+const int32 kMaxBlockGroupHeaderSize = 1 + 8 + 1 + 8 + 8 + 2 + 1;
+
+// Stores the block header of a Block or SimpleBlock in |buffer|: the coded
+// |track_number|, the 2 byte |timecode| and |flags|. Returns the number of
+// bytes stored.
+int32 PutBlockHeader(uint8* buffer, uint64 track_number, int64 timecode,
+                     uint8 flags) {
+  int32 pos = PutUInt(buffer, track_number);
+  pos += PutInt(buffer + pos, timecode, 2);
+  buffer[pos++] = flags;
+  return pos;
+}
+
+// Outputs the BlockGroup and Block element headers followed by the block
+// header with a single write. Returns 0 on success.
+int32 WriteBlockGroupHeader(IMkvWriter* writer, uint64 block_group_size,
+                            uint64 block_size, uint64 track_number,
+                            int64 timecode, uint8 flags) {
+  uint8 header[kMaxBlockGroupHeaderSize];
+  int32 pos = PutEbmlMasterElement<kMkvBlockGroup>(header, block_group_size);
+  const int32 block_pos = pos;
+  pos += PutEbmlMasterElement<kMkvBlock>(header + pos, block_size);
+  pos += PutBlockHeader(header + pos, track_number, timecode, flags);
+
+  const int64 position = writer->Position();
+  writer->ElementStartNotify(kMkvBlockGroup, position);
+  writer->ElementStartNotify(kMkvBlock, position + block_pos);
+  return writer->Write(header, pos);
+}
+
+// Size of the chunks in which the payload of a passed through block is
+// copied.
+const int32 kPassthroughCopySize = 16384;
+
+// Lacing bits of the Block flags.
+const uint8 kXiphLacing = 0x02;
+const uint8 kFixedLacing = 0x04;
+const uint8 kEbmlLacing = 0x06;
+
+// Largest lace header that is ever written: the frame count followed by an
+// 8 byte EBML coded size for every frame but the last. Xiph lacing is only
+// used when it is smaller than EBML lacing.
+const int32 kMaxLaceHeaderSize = 1 + 8 * (kMaxLaceFrames - 1);
+
+// Returns the size in bytes of |value| coded as a signed EBML lace size
+// difference.
+int32 GetCodedSIntSize(int64 value) {
+  for (int32 size = 1; size < 8; ++size) {
+    const int64 limit = (1LL << (size * 7 - 1)) - 1;
+    if (value >= -limit && value <= limit)
+      return size;
+  }
+  return 8;
+}
+
+// Writes the lace header for the frames of |frame_sizes| to |header|, using
+// the lacing scheme that needs the fewest bytes. Returns the size of the
+// header and sets |lacing| to the lacing bits of the Block flags.
+int32 MakeLaceHeader(const uint64* frame_sizes, int32 frame_count,
+                     uint8* header, uint8* lacing) {
+  const int32 last = frame_count - 1;
+  header[0] = static_cast<uint8>(last);
+
+  bool fixed = true;
+  uint64 xiph_size = 1;
+  uint64 ebml_size = 1 + GetCodedUIntSize(frame_sizes[0]);
+  for (int32 i = 0; i < last; ++i) {
+    if (frame_sizes[i] != frame_sizes[last])
+      fixed = false;
+    xiph_size += frame_sizes[i] / 255 + 1;
+    if (i > 0) {
+      ebml_size += GetCodedSIntSize(static_cast<int64>(frame_sizes[i]) -
+                                    static_cast<int64>(frame_sizes[i - 1]));
+    }
+  }
+
+  if (fixed) {
+    *lacing = kFixedLacing;
+    return 1;
+  }
+
+  int32 pos = 1;
+  if (xiph_size <= ebml_size) {
+    *lacing = kXiphLacing;
+    for (int32 i = 0; i < last; ++i) {
+      uint64 size = frame_sizes[i];
+      for (; size >= 255; size -= 255)
+        header[pos++] = 255;
+      header[pos++] = static_cast<uint8>(size);
+    }
+    return pos;
+  }
+
+  *lacing = kEbmlLacing;
+  pos += PutUInt(header + pos, frame_sizes[0]);
+  for (int32 i = 1; i < last; ++i) {
+    const int64 diff = static_cast<int64>(frame_sizes[i]) -
+                       static_cast<int64>(frame_sizes[i - 1]);
+    const int32 size = GetCodedSIntSize(diff);
+    const int64 bias = (1LL << (size * 7 - 1)) - 1;
+    pos += PutUIntSize(header + pos, static_cast<uint64>(diff + bias), size);
+  }
+  return pos;
+}
+
 }  // namespace
 
 int32 GetCodedUIntSize(uint64 value) {
@@ -178,20 +303,31 @@ int32 SerializeInt(IMkvWriter* writer, int64 value, int32 size) {
   if (!writer || size < 1 || size > 8)
     return -1;
 
-  for (int32 i = 1; i <= size; ++i) {
-    const int32 byte_count = size - i;
-    const int32 bit_count = byte_count * 8;
+  uint8 buffer[8];
+  PutInt(buffer, value, size);
 
-    const int64 bb = value >> bit_count;
-    const uint8 b = static_cast<uint8>(bb);
+  const int32 status = writer->Write(buffer, size);
+  if (status < 0)
+    return status;
 
-    const int32 status = writer->Write(&b, 1);
+  return 0;
+}
 
-    if (status < 0)
-      return status;
+int32 PutInt(uint8* buffer, int64 value, int32 size) {
+  for (int32 i = 1; i <= size; ++i) {
+    const int32 bit_count = (size - i) * 8;
+    buffer[i - 1] = static_cast<uint8>(value >> bit_count);
   }
+  return size;
+}
 
-  return 0;
+int32 PutUIntSize(uint8* buffer, uint64 value, int32 size) {
+  value |= 1ULL << (size * 7);
+  return PutInt(buffer, static_cast<int64>(value), size);
+}
+
+int32 PutUInt(uint8* buffer, uint64 value) {
+  return PutUIntSize(buffer, value, GetCodedUIntSize(value));
 }
 
 int32 SerializeFloat(IMkvWriter* writer, float f) {
@@ -380,11 +516,7 @@ uint64 WriteSimpleBlock(IMkvWriter* writer, const uint8* data, uint64 length,
   if (!data || length < 1)
     return false;
 
-  //  Here we only permit track number values to be no greater than
-  //  126, which the largest value we can store having a Matroska
-  //  integer representation of only 1 byte.
-
-  if (track_number < 1 || track_number > 126)
+  if (track_number < 1 || track_number > kMaxTrackNumber)
     return false;
 
   //  Technically the timestamp for a block can be less than the
@@ -395,35 +527,150 @@ uint64 WriteSimpleBlock(IMkvWriter* writer, const uint8* data, uint64 length,
   if (timecode < 0 || timecode > kMaxBlockTimecode)
     return false;
 
-  if (WriteID(writer, kMkvSimpleBlock))
+  const uint64 size = BlockHeaderSize(track_number) + length;
+
+  uint8 header[kMaxSimpleBlockHeaderSize];
+  int32 pos = PutEbmlMasterElement<kMkvSimpleBlock>(header, size);
+  pos += PutBlockHeader(header + pos, track_number, timecode,
+                        is_key ? 0x80 : 0);
+
+  writer->ElementStartNotify(kMkvSimpleBlock, writer->Position());
+  if (writer->Write(header, pos))
     return 0;
 
-  const int32 size = static_cast<int32>(length) + 4;
-  if (WriteUInt(writer, size))
+  if (writer->Write(data, static_cast<uint32>(length)))
     return 0;
 
-  if (WriteUInt(writer, static_cast<uint64>(track_number)))
+  const uint64 element_size =
+      GetUIntSize(kMkvSimpleBlock) + GetCodedUIntSize(size) + size;
+
+  return element_size;
+}
+
+uint64 WriteLacedSimpleBlock(IMkvWriter* writer, const uint8* data,
+                             const uint64* frame_sizes, int32 frame_count,
+                             uint64 track_number, int64 timecode,
+                             uint64 is_key) {
+  if (!writer || !data || !frame_sizes)
     return 0;
 
-  if (SerializeInt(writer, timecode, 2))
+  if (frame_count < 1 || frame_count > kMaxLaceFrames)
     return 0;
 
-  uint64 flags = 0;
-  if (is_key)
-    flags |= 0x80;
+  if (frame_count == 1) {
+    return WriteSimpleBlock(writer, data, frame_sizes[0], track_number,
+                            timecode, is_key);
+  }
+
+  if (track_number < 1 || track_number > kMaxTrackNumber)
+    return 0;
+
+  if (timecode < 0 || timecode > kMaxBlockTimecode)
+    return 0;
+
+  uint64 length = 0;
+  for (int32 i = 0; i < frame_count; ++i) {
+    if (frame_sizes[i] < 1)
+      return 0;
+    length += frame_sizes[i];
+  }
 
-  if (SerializeInt(writer, flags, 1))
+  uint8 lace_header[kMaxLaceHeaderSize];
+  uint8 lacing = 0;
+  const int32 lace_header_size =
+      MakeLaceHeader(frame_sizes, frame_count, lace_header, &lacing);
+
+  const uint64 size =
+      BlockHeaderSize(track_number) + lace_header_size + length;
+
+  uint8 header[kMaxSimpleBlockHeaderSize + kMaxLaceHeaderSize];
+  int32 pos = PutEbmlMasterElement<kMkvSimpleBlock>(header, size);
+  pos += PutBlockHeader(header + pos, track_number, timecode,
+                        lacing | (is_key ? 0x80 : 0));
+  memcpy(header + pos, lace_header, lace_header_size);
+  pos += lace_header_size;
+
+  writer->ElementStartNotify(kMkvSimpleBlock, writer->Position());
+  if (writer->Write(header, pos))
     return 0;
 
   if (writer->Write(data, static_cast<uint32>(length)))
     return 0;
 
   const uint64 element_size =
-      GetUIntSize(kMkvSimpleBlock) + GetCodedUIntSize(size) + 4 + length;
+      GetUIntSize(kMkvSimpleBlock) + GetCodedUIntSize(size) + size;
 
   return element_size;
 }
 
+uint64 WriteSimpleBlockPassthrough(IMkvWriter* writer,
+                                   mkvparser::IMkvReader* reader,
+                                   int64 position, uint64 size,
+                                   uint64 track_number, int64 timecode,
+                                   uint64 is_key) {
+  if (!writer || !reader || position < 0)
+    return 0;
+
+  if (track_number < 1 || track_number > kMaxTrackNumber)
+    return 0;
+
+  if (timecode < 0 || timecode > kMaxBlockTimecode)
+    return 0;
+
+  // Read the source block header: the coded track number, the timecode and
+  // the flags.
+  uint8 source_header[8 + 2 + 1];
+  const int32 source_read_size = (size < sizeof(source_header))
+                                     ? static_cast<int32>(size)
+                                     : static_cast<int32>(sizeof(source_header));
+  if (source_read_size < 4 ||
+      reader->Read(position, source_read_size, source_header))
+    return 0;
+
+  int32 track_number_size = 1;
+  while (track_number_size <= 8 &&
+         !(source_header[0] & (0x80 >> (track_number_size - 1))))
+    ++track_number_size;
+  const int32 source_header_size = track_number_size + 3;
+  if (track_number_size > 8 || source_header_size > source_read_size)
+    return 0;
+
+  // Keep the invisible, lacing and discardable bits.
+  uint8 flags = source_header[source_header_size - 1] & 0x0F;
+  if (is_key)
+    flags |= 0x80;
+
+  const uint64 payload_size = size - source_header_size;
+  const uint64 block_size = BlockHeaderSize(track_number) + payload_size;
+
+  uint8 header[kMaxSimpleBlockHeaderSize];
+  int32 pos = PutEbmlMasterElement<kMkvSimpleBlock>(header, block_size);
+  pos += PutBlockHeader(header + pos, track_number, timecode, flags);
+
+  writer->ElementStartNotify(kMkvSimpleBlock, writer->Position());
+  if (writer->Write(header, pos))
+    return 0;
+
+  // Copy the lace header, if any, and the frames.
+  uint8 buffer[kPassthroughCopySize];
+  int64 read_position = position + source_header_size;
+  uint64 remaining = payload_size;
+  while (remaining > 0) {
+    const int32 length = (remaining < sizeof(buffer))
+                             ? static_cast<int32>(remaining)
+                             : static_cast<int32>(sizeof(buffer));
+    if (reader->Read(read_position, length, buffer))
+      return 0;
+    if (writer->Write(buffer, length))
+      return 0;
+    read_position += length;
+    remaining -= length;
+  }
+
+  return GetUIntSize(kMkvSimpleBlock) + GetCodedUIntSize(block_size) +
+         block_size;
+}
+
 // We must write the metadata (key)frame as a BlockGroup element,
 // because we need to specify a duration for the frame.  The
 // BlockGroup element comprises the frame itself and its duration,
@@ -445,12 +692,9 @@ uint64 WriteMetadataBlock(IMkvWriter* writer, const uint8* data, uint64 length,
   // pre-compute the BlockGroup size, by summing the sizes of each
   // sub-element (the block and the duration).
 
-  // We use a single byte for the track number of the block, which
-  // means the block header is exactly 4 bytes.
-
   // TODO(matthewjheaney): use EbmlMasterElementSize and WriteEbmlMasterElement
 
-  const uint64 block_payload_size = 4 + length;
+  const uint64 block_payload_size = BlockHeaderSize(track_number) + length;
   const int32 block_size = GetCodedUIntSize(block_payload_size);
   const uint64 block_elem_size = 1 + block_size + block_payload_size;
 
@@ -462,35 +706,10 @@ uint64 WriteMetadataBlock(IMkvWriter* writer, const uint8* data, uint64 length,
   const int32 blockg_size = GetCodedUIntSize(blockg_payload_size);
   const uint64 blockg_elem_size = 1 + blockg_size + blockg_payload_size;
 
-  if (WriteID(writer, kMkvBlockGroup))  // 1-byte ID size
-    return 0;
-
-  if (WriteUInt(writer, blockg_payload_size))
-    return 0;
-
-  //  Write Block element
-
-  if (WriteID(writer, kMkvBlock))  // 1-byte ID size
-    return 0;
-
-  if (WriteUInt(writer, block_payload_size))
-    return 0;
-
-  // Byte 1 of 4
-
-  if (WriteUInt(writer, track_number))
-    return 0;
-
-  // Bytes 2 & 3 of 4
-
-  if (SerializeInt(writer, timecode, 2))
-    return 0;
-
-  // Byte 4 of 4
+  // Write the BlockGroup and Block headers, with no flags set.
 
-  const uint64 flags = 0;
-
-  if (SerializeInt(writer, flags, 1))
+  if (WriteBlockGroupHeader(writer, blockg_payload_size, block_payload_size,
+                            track_number, timecode, 0))
     return 0;
 
   // Now write the actual frame (of metadata)
@@ -500,13 +719,12 @@ uint64 WriteMetadataBlock(IMkvWriter* writer, const uint8* data, uint64 length,
 
   // Write Duration element
 
-  if (WriteID(writer, kMkvBlockDuration))  // 1-byte ID size
-    return 0;
+  uint8 duration_elem[kMaxUIntElementSize];
+  const int32 duration_elem_length =
+      PutEbmlElement<kMkvBlockDuration>(duration_elem, duration);
 
-  if (WriteUInt(writer, duration_payload_size))
-    return 0;
-
-  if (SerializeInt(writer, duration, duration_payload_size))
+  writer->ElementStartNotify(kMkvBlockDuration, writer->Position());
+  if (writer->Write(duration_elem, duration_elem_length))
     return 0;
 
   // Note that we don't write a reference time as part of the block
@@ -539,7 +757,7 @@ uint64 WriteBlockWithAdditional(IMkvWriter* writer, const uint8* data,
   if (!data || !additional || length < 1 || additional_length < 1)
     return 0;
 
-  const uint64 block_payload_size = 4 + length;
+  const uint64 block_payload_size = BlockHeaderSize(track_number) + length;
   const uint64 block_elem_size =
       EbmlMasterElementSize(kMkvBlock, block_payload_size) + block_payload_size;
   const uint64 block_additional_elem_size =
@@ -561,39 +779,38 @@ uint64 WriteBlockWithAdditional(IMkvWriter* writer, const uint8* data,
       EbmlMasterElementSize(kMkvBlockGroup, block_group_payload_size) +
       block_group_payload_size;
 
-  if (!WriteEbmlMasterElement(writer, kMkvBlockGroup, block_group_payload_size))
-    return 0;
-
-  if (!WriteEbmlMasterElement(writer, kMkvBlock, block_payload_size))
-    return 0;
-
-  if (WriteUInt(writer, track_number))
-    return 0;
-
-  if (SerializeInt(writer, timecode, 2))
-    return 0;
-
-  uint64 flags = 0;
-  if (is_key)
-    flags |= 0x80;
-  if (SerializeInt(writer, flags, 1))
+  if (WriteBlockGroupHeader(writer, block_group_payload_size,
+                            block_payload_size, track_number, timecode,
+                            is_key ? 0x80 : 0))
     return 0;
 
   if (writer->Write(data, static_cast<uint32>(length)))
     return 0;
 
-  if (!WriteEbmlMasterElement(writer, kMkvBlockAdditions,
-                              block_additions_payload_size))
-    return 0;
-
-  if (!WriteEbmlMasterElement(writer, kMkvBlockMore, block_more_payload_size))
-    return 0;
+  // The BlockAdditions, BlockMore, BlockAddID and BlockAdditional headers
+  // are output with a single write.
+  uint8 header[3 * kMaxMasterElementHeaderSize + kMaxUIntElementSize];
+  int32 pos = PutEbmlMasterElement<kMkvBlockAdditions>(
+      header, block_additions_payload_size);
+  const int32 block_more_pos = pos;
+  pos += PutEbmlMasterElement<kMkvBlockMore>(header + pos,
+                                             block_more_payload_size);
+  const int32 block_addid_pos = pos;
+  pos += PutEbmlElement<kMkvBlockAddID>(header + pos, add_id);
+  const int32 block_additional_pos = pos;
+  pos += PutEbmlMasterElement<kMkvBlockAdditional>(header + pos,
+                                                   additional_length);
 
-  if (!WriteEbmlElement(writer, kMkvBlockAddID, add_id))
+  const int64 position = writer->Position();
+  writer->ElementStartNotify(kMkvBlockAdditions, position);
+  writer->ElementStartNotify(kMkvBlockMore, position + block_more_pos);
+  writer->ElementStartNotify(kMkvBlockAddID, position + block_addid_pos);
+  writer->ElementStartNotify(kMkvBlockAdditional,
+                             position + block_additional_pos);
+  if (writer->Write(header, pos))
     return 0;
 
-  if (!WriteEbmlElement(writer, kMkvBlockAdditional, additional,
-                        additional_length))
+  if (writer->Write(additional, static_cast<uint32>(additional_length)))
     return 0;
 
   return block_group_elem_size;
@@ -612,7 +829,7 @@ uint64 WriteBlockWithDiscardPadding(IMkvWriter* writer, const uint8* data,
   if (!data || length < 1)
     return 0;
 
-  const uint64 block_payload_size = 4 + length;
+  const uint64 block_payload_size = BlockHeaderSize(track_number) + length;
   const uint64 block_elem_size =
       EbmlMasterElementSize(kMkvBlock, block_payload_size) + block_payload_size;
   const uint64 discard_padding_elem_size =
@@ -623,51 +840,45 @@ uint64 WriteBlockWithDiscardPadding(IMkvWriter* writer, const uint8* data,
       EbmlMasterElementSize(kMkvBlockGroup, block_group_payload_size) +
       block_group_payload_size;
 
-  if (!WriteEbmlMasterElement(writer, kMkvBlockGroup, block_group_payload_size))
-    return 0;
-
-  if (!WriteEbmlMasterElement(writer, kMkvBlock, block_payload_size))
-    return 0;
-
-  if (WriteUInt(writer, track_number))
-    return 0;
-
-  if (SerializeInt(writer, timecode, 2))
-    return 0;
-
-  uint64 flags = 0;
-  if (is_key)
-    flags |= 0x80;
-  if (SerializeInt(writer, flags, 1))
+  if (WriteBlockGroupHeader(writer, block_group_payload_size,
+                            block_payload_size, track_number, timecode,
+                            is_key ? 0x80 : 0))
     return 0;
 
   if (writer->Write(data, static_cast<uint32>(length)))
     return 0;
 
-  if (WriteID(writer, kMkvDiscardPadding))
-    return 0;
+  const int32 size = GetIntSize(discard_padding);
 
-  const uint64 size = GetIntSize(discard_padding);
-  if (WriteUInt(writer, size))
-    return false;
+  uint8 discard_padding_elem[kMaxUIntElementSize];
+  int32 pos = PutID<kMkvDiscardPadding>(discard_padding_elem);
+  pos += PutUIntSize(discard_padding_elem + pos, size, 1);
+  pos += PutInt(discard_padding_elem + pos, discard_padding, size);
 
-  if (SerializeInt(writer, discard_padding, static_cast<int32>(size)))
-    return false;
+  writer->ElementStartNotify(kMkvDiscardPadding, writer->Position());
+  if (writer->Write(discard_padding_elem, pos))
+    return 0;
 
   return block_group_elem_size;
 }
 
 uint64 WriteVoidElement(IMkvWriter* writer, uint64 size) {
-  if (!writer)
-    return false;
+  if (!writer || size < 2)
+    return 0;
 
   // Subtract one for the void ID and the coded size.
   uint64 void_entry_size = size - 1 - GetCodedUIntSize(size - 1);
+  int32 coded_size_length = GetCodedUIntSize(void_entry_size);
   uint64 void_size =
       EbmlMasterElementSize(kMkvVoid, void_entry_size) + void_entry_size;
 
-  if (void_size != size)
-    return 0;
+  if (void_size != size) {
+    // |size| falls just past a coded size boundary. Code the payload size
+    // with 8 bytes so the element still covers exactly |size| bytes.
+    coded_size_length = 8;
+    void_entry_size = size - 1 - coded_size_length;
+    void_size = size;
+  }
 
   const int64 payload_position = writer->Position();
   if (payload_position < 0)
@@ -676,13 +887,18 @@ uint64 WriteVoidElement(IMkvWriter* writer, uint64 size) {
   if (WriteID(writer, kMkvVoid))
     return 0;
 
-  if (WriteUInt(writer, void_entry_size))
+  if (WriteUIntSize(writer, void_entry_size, coded_size_length))
     return 0;
 
-  const uint8 value = 0;
-  for (int32 i = 0; i < static_cast<int32>(void_entry_size); ++i) {
-    if (writer->Write(&value, 1))
+  const uint8 zeros[1024] = {0};
+  uint64 remaining = void_entry_size;
+  while (remaining > 0) {
+    const uint32 length = (remaining > sizeof(zeros))
+                              ? static_cast<uint32>(sizeof(zeros))
+                              : static_cast<uint32>(remaining);
+    if (writer->Write(zeros, length))
       return 0;
+    remaining -= length;
   }
 
   const int64 stop_position = writer->Position();
@@ -693,6 +909,22 @@ uint64 WriteVoidElement(IMkvWriter* writer, uint64 size) {
   return void_size;
 }
 
+bool WriteCrc32Element(IMkvWriter* writer, uint32 crc) {
+  if (!writer)
+    return false;
+
+  uint8 buffer[kCrc32ElementSize];
+  int32 pos = PutID<kMkvCRC32>(buffer);
+  pos += PutUIntSize(buffer + pos, 4, 1);
+
+  // Unlike other EBML integers, the CRC is stored little-endian.
+  for (int32 i = 0; i < 4; ++i)
+    buffer[pos++] = static_cast<uint8>(crc >> (i * 8));
+
+  writer->ElementStartNotify(kMkvCRC32, writer->Position());
+  return writer->Write(buffer, pos) == 0;
+}
+
 void GetVersion(int32* major, int32* minor, int32* build, int32* revision) {
   *major = 0;
   *minor = 2;
@@ -736,3 +968,24 @@ mkvmuxer::uint64 mkvmuxer::MakeUID(unsigned int* seed) {
 
   return uid;
 }
+
+mkvmuxer::uint64 mkvmuxer::GetMonotonicTimeNs() {
+#ifdef _WIN32
+  LARGE_INTEGER frequency;
+  LARGE_INTEGER counter;
+  if (!QueryPerformanceFrequency(&frequency) ||
+      !QueryPerformanceCounter(&counter) || frequency.QuadPart <= 0)
+    return 0;
+
+  const uint64 ticks = counter.QuadPart;
+  const uint64 rate = frequency.QuadPart;
+  return (ticks / rate) * 1000000000ULL +
+         (ticks % rate) * 1000000000ULL / rate;
+#else
+  timespec now;
+  if (clock_gettime(CLOCK_MONOTONIC, &now))
+    return 0;
+
+  return static_cast<uint64>(now.tv_sec) * 1000000000ULL + now.tv_nsec;
+#endif
+}
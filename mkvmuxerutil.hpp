@@ -11,6 +11,10 @@
 
 #include "mkvmuxertypes.hpp"
 
+namespace mkvparser {
+class IMkvReader;
+}  // end namespace
+
 namespace mkvmuxer {
 
 class IMkvWriter;
@@ -18,6 +22,15 @@ class IMkvWriter;
 const uint64 kEbmlUnknownValue = 0x01FFFFFFFFFFFFFFULL;
 const int64 kMaxBlockTimecode = 0x07FFFLL;
 
+// Largest track number that fits the 8 byte EBML coding of a block header.
+const uint64 kMaxTrackNumber = 0x00FFFFFFFFFFFFFEULL;
+
+// Largest number of frames that can be laced into a single block.
+const int32 kMaxLaceFrames = 256;
+
+// Size in bytes of a CRC-32 element.
+const uint64 kCrc32ElementSize = 6;
+
 // Writes out |value| in Big Endian order. Returns 0 on success.
 int32 SerializeInt(IMkvWriter* writer, int64 value, int32 size);
 
@@ -32,6 +45,63 @@ uint64 EbmlElementSize(uint64 type, const char* value);
 uint64 EbmlElementSize(uint64 type, const uint8* value, uint64 size);
 uint64 EbmlDateElementSize(uint64 type, int64 value);
 
+// Size in bytes of the EBML ID |id|, known at compile time.
+template <uint32 id>
+struct EbmlIdSize {
+  enum {
+    kValue = (id < 0x100U) ? 1 :
+             (id < 0x10000U) ? 2 :
+             (id < 0x1000000U) ? 3 : 4
+  };
+};
+
+// The Put* functions store elements in |buffer| instead of writing them out,
+// so that small elements can be assembled on the stack and output with a
+// single IMkvWriter::Write() call. They do not call
+// IMkvWriter::ElementStartNotify(). Each returns the number of bytes stored.
+
+// Largest number of bytes stored by PutEbmlMasterElement() and
+// PutEbmlElement().
+const int32 kMaxMasterElementHeaderSize = 4 + 8;
+const int32 kMaxUIntElementSize = 4 + 1 + 8;
+
+// Stores |value| in Big Endian order in |size| bytes.
+int32 PutInt(uint8* buffer, int64 value, int32 size);
+
+// Stores |value| as an EBML coded number of |size| bytes. |value| must fit.
+int32 PutUIntSize(uint8* buffer, uint64 value, int32 size);
+
+// Stores |value| as an EBML coded number of the smallest size possible.
+int32 PutUInt(uint8* buffer, uint64 value);
+
+// Stores the EBML ID |id|. The size of the ID is a compile time constant, so
+// this compiles to straight-line stores.
+template <uint32 id>
+int32 PutID(uint8* buffer) {
+  const int32 size = EbmlIdSize<id>::kValue;
+  for (int32 i = 0; i < size; ++i)
+    buffer[i] = static_cast<uint8>(id >> ((size - 1 - i) * 8));
+  return size;
+}
+
+// Stores the ID and size of the master element |id| with a payload of
+// |size| bytes.
+template <uint32 id>
+int32 PutEbmlMasterElement(uint8* buffer, uint64 size) {
+  const int32 id_size = PutID<id>(buffer);
+  return id_size + PutUInt(buffer + id_size, size);
+}
+
+// Stores the unsigned integer element |id| holding |value|.
+template <uint32 id>
+int32 PutEbmlElement(uint8* buffer, uint64 value) {
+  const int32 size = GetUIntSize(value);
+  int32 pos = PutID<id>(buffer);
+  pos += PutUIntSize(buffer + pos, size, 1);
+  pos += PutInt(buffer + pos, value, size);
+  return pos;
+}
+
 // Creates an EBML coded number from |value| and writes it out. The size of
 // the coded number is determined by the value of |value|. |value| must not
 // be in a coded form. Returns 0 on success.
@@ -62,21 +132,60 @@ bool WriteEbmlDateElement(IMkvWriter* writer, uint64 type, int64 value);
 //   data:         Pointer to the data.
 //   length:       Length of the data.
 //   track_number: Track to add the data to. Value returned by Add track
-//                  functions.  Only values in the range [1, 126] are
-//                  permitted.
+//                  functions.  Only values in the range
+//                  [1, kMaxTrackNumber] are permitted.
 //   timecode:     Relative timecode of the Block.  Only values in the
 //                  range [0, 2^15) are permitted.
 //   is_key:       Non-zero value specifies that frame is a key frame.
 uint64 WriteSimpleBlock(IMkvWriter* writer, const uint8* data, uint64 length,
                         uint64 track_number, int64 timecode, uint64 is_key);
 
+// Output an Mkv Simple Block holding several frames using lacing. Xiph, EBML
+// or fixed-size lacing is selected, whichever results in the smallest block.
+// A single frame is written as a plain Simple Block.
+// Inputs:
+//   data:         Pointer to the frames, stored back to back.
+//   frame_sizes:  Length of each of the frames.
+//   frame_count:  Number of frames. Only values in the range
+//                  [1, kMaxLaceFrames] are permitted.
+//   track_number: Track to add the data to. Value returned by Add track
+//                  functions.  Only values in the range
+//                  [1, kMaxTrackNumber] are permitted.
+//   timecode:     Relative timecode of the Block.  Only values in the
+//                  range [0, 2^15) are permitted.
+//   is_key:       Non-zero value specifies that the frames are key frames.
+uint64 WriteLacedSimpleBlock(IMkvWriter* writer, const uint8* data,
+                             const uint64* frame_sizes, int32 frame_count,
+                             uint64 track_number, int64 timecode,
+                             uint64 is_key);
+
+// Output an Mkv Simple Block whose payload is copied from the payload of a
+// Block or SimpleBlock element of another file. The track number and
+// timecode of the source block are replaced; the lacing, invisible and
+// discardable flags are kept.
+// Inputs:
+//   reader:       Source of the block payload.
+//   position:     Position of the source block payload in |reader|.
+//   size:         Size of the source block payload.
+//   track_number: Track to add the data to. Value returned by Add track
+//                  functions.  Only values in the range
+//                  [1, kMaxTrackNumber] are permitted.
+//   timecode:     Relative timecode of the Block.  Only values in the
+//                  range [0, 2^15) are permitted.
+//   is_key:       Non-zero value specifies that the block holds key frames.
+uint64 WriteSimpleBlockPassthrough(IMkvWriter* writer,
+                                   mkvparser::IMkvReader* reader,
+                                   int64 position, uint64 size,
+                                   uint64 track_number, int64 timecode,
+                                   uint64 is_key);
+
 // Output a metadata keyframe, using a Block Group element.
 // Inputs:
 //   data:         Pointer to the (meta)data.
 //   length:       Length of the (meta)data.
 //   track_number: Track to add the data to. Value returned by Add track
-//                  functions.  Only values in the range [1, 126] are
-//                  permitted.
+//                  functions.  Only values in the range
+//                  [1, kMaxTrackNumber] are permitted.
 //   timecode      Timecode of frame, relative to cluster timecode.  Only
 //                  values in the range [0, 2^15) are permitted.
 //   duration_timecode  Duration of frame, using timecode units.
@@ -92,8 +201,8 @@ uint64 WriteMetadataBlock(IMkvWriter* writer, const uint8* data, uint64 length,
 //   additional_length: Length of the additional data.
 //   add_id: Value of BlockAddID element.
 //   track_number: Track to add the data to. Value returned by Add track
-//                  functions.  Only values in the range [1, 126] are
-//                  permitted.
+//                  functions.  Only values in the range
+//                  [1, kMaxTrackNumber] are permitted.
 //   timecode:     Relative timecode of the Block.  Only values in the
 //                  range [0, 2^15) are permitted.
 //   is_key:       Non-zero value specifies that frame is a key frame.
@@ -109,8 +218,8 @@ uint64 WriteBlockWithAdditional(IMkvWriter* writer, const uint8* data,
 //   length:          Length of the data.
 //   discard_padding: DiscardPadding value.
 //   track_number:    Track to add the data to. Value returned by Add track
-//                    functions. Only values in the range [1, 126] are
-//                    permitted.
+//                    functions. Only values in the range
+//                    [1, kMaxTrackNumber] are permitted.
 //   timecode:        Relative timecode of the Block.  Only values in the
 //                    range [0, 2^15) are permitted.
 //   is_key:          Non-zero value specifies that frame is a key frame.
@@ -120,10 +229,14 @@ uint64 WriteBlockWithDiscardPadding(IMkvWriter* writer, const uint8* data,
                                     uint64 is_key);
 
 // Output a void element. |size| must be the entire size in bytes that will be
-// void. The function will calculate the size of the void header and subtract
-// it from |size|.
+// void, and at least 2. The function will calculate the size of the void
+// header and subtract it from |size|.
 uint64 WriteVoidElement(IMkvWriter* writer, uint64 size);
 
+// Output a CRC-32 element holding |crc|. Returns true if the element was
+// written.
+bool WriteCrc32Element(IMkvWriter* writer, uint32 crc);
+
 // Returns the version number of the muxer in |major|, |minor|, |build|,
 // and |revision|.
 void GetVersion(int32* major, int32* minor, int32* build, int32* revision);
@@ -132,6 +245,10 @@ void GetVersion(int32* major, int32* minor, int32* build, int32* revision);
 // the random-number generator (see POSIX rand_r() for semantics).
 uint64 MakeUID(unsigned int* seed);
 
+// Returns the time in nanoseconds of a monotonic clock with an unspecified
+// starting point.
+uint64 GetMonotonicTimeNs();
+
 }  // end namespace mkvmuxer
 
 #endif  // MKVMUXERUTIL_HPP
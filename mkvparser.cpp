@@ -12,6 +12,8 @@
 #include <new>
 #include <climits>
 
+#include "webmcrc32.hpp"
+
 #ifdef _MSC_VER
 // Disable MSVC warnings that suggest making code non-portable.
 #pragma warning(disable : 4996)
@@ -287,6 +289,56 @@ long mkvparser::UnserializeString(IMkvReader* pReader, long long pos,
   return 0;  // success
 }
 
+long mkvparser::VerifyCrc32(IMkvReader* pReader, long long pos,
+                            long long stop) {
+  const long crc_size = 4;
+
+  if ((pos < 0) || (stop < pos + crc_size))
+    return E_FILE_FORMAT_INVALID;
+
+  unsigned char crc_buf[crc_size];
+
+  long status = pReader->Read(pos, crc_size, crc_buf);
+
+  if (status)
+    return status;
+
+  // The checksum is stored in little-endian order.
+  unsigned int expected = 0;
+
+  for (long i = crc_size - 1; i >= 0; --i)
+    expected = (expected << 8) | crc_buf[i];
+
+  pos += crc_size;
+
+  const long buf_size = 65536;
+  unsigned char* const buf = new (std::nothrow) unsigned char[buf_size];
+
+  if (buf == NULL)
+    return -1;
+
+  unsigned int crc = 0;
+
+  while (pos < stop) {
+    const long len =
+        (stop - pos > buf_size) ? buf_size : static_cast<long>(stop - pos);
+
+    status = pReader->Read(pos, len, buf);
+
+    if (status) {
+      delete[] buf;
+      return status;
+    }
+
+    crc = libwebm::Crc32(crc, buf, len);
+    pos += len;
+  }
+
+  delete[] buf;
+
+  return (crc == expected) ? 0 : E_CRC32_MISMATCH;
+}
+
 long mkvparser::ParseElementHeader(IMkvReader* pReader, long long& pos,
                                    long long stop, long long& id,
                                    long long& size) {
@@ -610,7 +662,8 @@ Segment::Segment(IMkvReader* pReader, long long elem_start,
       m_clusters(NULL),
       m_clusterCount(0),
       m_clusterPreloadCount(0),
-      m_clusterSize(0) {}
+      m_clusterSize(0),
+      m_verify_crc32(false) {}
 
 Segment::~Segment() {
   const long count = m_clusterCount + m_clusterPreloadCount;
@@ -4859,7 +4912,9 @@ Tracks::Tracks(Segment* pSegment, long long start, long long size_,
       m_element_start(element_start),
       m_element_size(element_size),
       m_trackEntries(NULL),
-      m_trackEntriesEnd(NULL) {}
+      m_trackEntriesEnd(NULL),
+      m_trackNumberTable(NULL),
+      m_trackNumberTableSize(0) {}
 
 long Tracks::Parse() {
   assert(m_trackEntries == NULL);
@@ -4942,9 +4997,49 @@ long Tracks::Parse() {
 
   assert(pos == stop);
 
+  InitTrackNumberTable();
+
   return 0;  // success
 }
 
+void Tracks::InitTrackNumberTable() {
+  // Track numbers are usually small and dense, so a table indexed by the
+  // track number makes the lookup per block constant time. Larger numbers
+  // are searched for in m_trackEntries.
+  const long kMaxTableSize = 1024;
+
+  long max_number = -1;
+
+  for (Track** i = m_trackEntries; i != m_trackEntriesEnd; ++i) {
+    const long number = (*i)->GetNumber();
+
+    if (number >= 0 && number < kMaxTableSize && number > max_number)
+      max_number = number;
+  }
+
+  if (max_number < 0)
+    return;
+
+  m_trackNumberTable = new (std::nothrow) Track* [max_number + 1];
+
+  if (m_trackNumberTable == NULL)
+    return;  // fall back to searching m_trackEntries
+
+  m_trackNumberTableSize = max_number + 1;
+
+  for (long n = 0; n < m_trackNumberTableSize; ++n)
+    m_trackNumberTable[n] = NULL;
+
+  for (Track** i = m_trackEntries; i != m_trackEntriesEnd; ++i) {
+    Track* const pTrack = *i;
+    const long number = pTrack->GetNumber();
+
+    if (number >= 0 && number < m_trackNumberTableSize &&
+        m_trackNumberTable[number] == NULL)
+      m_trackNumberTable[number] = pTrack;
+  }
+}
+
 unsigned long Tracks::GetTracksCount() const {
   const ptrdiff_t result = m_trackEntriesEnd - m_trackEntries;
   assert(result >= 0);
@@ -5031,7 +5126,11 @@ long Tracks::ParseTrackEntry(long long track_start, long long track_size,
     } else if (id == 0x57) {  // Track Number
       const long long num = UnserializeUInt(pReader, pos, size);
 
-      if ((num <= 0) || (num > 127))
+      // Blocks code the track number as a varint of at most 8 bytes, and the
+      // number must fit in |info.number|, which is only 32 bits on LLP64.
+      const long long max_num = 0x00FFFFFFFFFFFFFELL;
+
+      if ((num <= 0) || (num > max_num) || (static_cast<long>(num) != num))
         return E_FILE_FORMAT_INVALID;
 
       info.number = static_cast<long>(num);
@@ -5208,12 +5307,16 @@ Tracks::~Tracks() {
   }
 
   delete[] m_trackEntries;
+  delete[] m_trackNumberTable;
 }
 
 const Track* Tracks::GetTrackByNumber(long tn) const {
   if (tn < 0)
     return NULL;
 
+  if (tn < m_trackNumberTableSize)
+    return m_trackNumberTable[tn];
+
   Track** i = m_trackEntries;
   Track** const j = m_trackEntriesEnd;
 
@@ -5338,11 +5441,14 @@ long Cluster::Load(long long& pos, long& len) const {
   bool bBlock = false;
 
   long long cluster_stop = (cluster_size < 0) ? -1 : pos + cluster_size;
+  const long long payload_start = pos;
 
   for (;;) {
     if ((cluster_stop >= 0) && (pos >= cluster_stop))
       break;
 
+    const long long element_start = pos;
+
     // Parse ID
 
     if ((pos + 1) > avail) {
@@ -5428,6 +5534,19 @@ long Cluster::Load(long long& pos, long& len) const {
     if ((cluster_stop >= 0) && ((pos + size) > cluster_stop))
       return E_FILE_FORMAT_INVALID;
 
+    if ((id == 0x3F) && (element_start == payload_start) &&  // CRC-32 ID
+        (cluster_stop >= 0) && m_pSegment->GetVerifyCrc32()) {
+      if (cluster_stop > avail) {
+        len = static_cast<long>(cluster_stop - pos);
+        return E_BUFFER_NOT_FULL;
+      }
+
+      const long status = VerifyCrc32(pReader, pos, cluster_stop);
+
+      if (status < 0)  // error or mismatch
+        return status;
+    }
+
     if (id == 0x67) {  // TimeCode ID
       len = static_cast<long>(size);
 
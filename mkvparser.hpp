@@ -17,6 +17,7 @@ namespace mkvparser {
 
 const int E_FILE_FORMAT_INVALID = -2;
 const int E_BUFFER_NOT_FULL = -3;
+const int E_CRC32_MISMATCH = -4;
 
 class IMkvReader {
  public:
@@ -36,6 +37,11 @@ long UnserializeInt(IMkvReader*, long long pos, long len, long long& result);
 
 long UnserializeString(IMkvReader*, long long pos, long long size, char*& str);
 
+// Checks the checksum of the CRC-32 element whose payload starts at |pos|
+// against the data that follows it, up to |stop|. Returns 0 if they match,
+// E_CRC32_MISMATCH if they do not, or another negative value on error.
+long VerifyCrc32(IMkvReader*, long long pos, long long stop);
+
 long ParseElementHeader(IMkvReader* pReader,
                         long long& pos,  // consume id and size fields
                         long long stop,  // if you know size of element's parent
@@ -463,6 +469,13 @@ class Tracks {
   Track** m_trackEntries;
   Track** m_trackEntriesEnd;
 
+  // Tracks indexed by track number, for track numbers below
+  // m_trackNumberTableSize.
+  Track** m_trackNumberTable;
+  long m_trackNumberTableSize;
+
+  void InitTrackNumberTable();
+
   long ParseTrackEntry(long long payload_start, long long payload_size,
                        long long element_start, long long element_size,
                        Track*&) const;
@@ -897,6 +910,13 @@ class Segment {
   long ParseCues(long long cues_off,  // offset relative to start of segment
                  long long& parse_pos, long& parse_len);
 
+  // Toggles checking the CRC-32 element at the start of a cluster, if it has
+  // one, when the cluster is loaded. A cluster that does not match its
+  // checksum fails to load with E_CRC32_MISMATCH. Clusters of unknown size
+  // are not checked. Disabled by default.
+  void SetVerifyCrc32(bool verify) { m_verify_crc32 = verify; }
+  bool GetVerifyCrc32() const { return m_verify_crc32; }
+
  private:
   long long m_pos;  // absolute file posn; what has been consumed so far
   Cluster* m_pUnknownSize;
@@ -910,6 +930,7 @@ class Segment {
   long m_clusterCount;  // number of entries for which m_index >= 0
   long m_clusterPreloadCount;  // number of entries for which m_index < 0
   long m_clusterSize;  // array size
+  bool m_verify_crc32;
 
   long DoLoadCluster(long long&, long&);
   long DoLoadClusterUnknownSize(long long&, long&);
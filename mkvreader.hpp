@@ -26,6 +26,9 @@ class MkvReader : public IMkvReader {
   virtual int Read(long long position, long length, unsigned char* buffer);
   virtual int Length(long long* total, long long* available);
 
+  // Returns the file handle of the input file, or NULL if no file is open.
+  FILE* file() const { return m_file; }
+
  private:
   MkvReader(const MkvReader&);
   MkvReader& operator=(const MkvReader&);
@@ -12,13 +12,37 @@
 #include <share.h>  // for _SH_DENYWR
 #endif
 
+#if defined(__linux__) && !defined(__ANDROID__)
+#define MKVWRITER_FILE_HINTS
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <cstring>
 #include <new>
 
+#include "webmcrc32.hpp"
+
 namespace mkvmuxer {
 
-MkvWriter::MkvWriter() : file_(NULL), writer_owns_file_(true) {}
+MkvWriter::MkvWriter()
+    : file_(NULL),
+      writer_owns_file_(true),
+      preallocated_(false),
+      writeback_interval_(0),
+      writeback_pending_(0),
+      writeback_started_(0),
+      writeback_done_(0) {}
 
-MkvWriter::MkvWriter(FILE* fp) : file_(fp), writer_owns_file_(false) {}
+MkvWriter::MkvWriter(FILE* fp)
+    : file_(fp),
+      writer_owns_file_(false),
+      preallocated_(false),
+      writeback_interval_(0),
+      writeback_pending_(0),
+      writeback_started_(0),
+      writeback_done_(0) {}
 
 MkvWriter::~MkvWriter() { Close(); }
 
@@ -33,8 +57,24 @@ int32 MkvWriter::Write(const void* buffer, uint32 length) {
     return -1;
 
   const size_t bytes_written = fwrite(buffer, 1, length, file_);
+  if (bytes_written != length)
+    return -1;
+
+  if (!AddWrittenBytes(length))
+    return -1;
 
-  return (bytes_written == length) ? 0 : -1;
+  return 0;
+}
+
+bool MkvWriter::AddWrittenBytes(int64 length) {
+  if (writeback_interval_ <= 0)
+    return true;
+
+  writeback_pending_ += length;
+  if (writeback_pending_ >= writeback_interval_ && !WriteBack())
+    return false;
+
+  return true;
 }
 
 bool MkvWriter::Open(const char* filename) {
@@ -55,10 +95,75 @@ bool MkvWriter::Open(const char* filename) {
 }
 
 void MkvWriter::Close() {
+  if (file_ && preallocated_)
+    ReleasePreallocatedSpace();
   if (file_ && writer_owns_file_) {
     fclose(file_);
   }
   file_ = NULL;
+  preallocated_ = false;
+  writeback_pending_ = 0;
+  writeback_started_ = 0;
+  writeback_done_ = 0;
+}
+
+bool MkvWriter::Preallocate(int64 size) {
+  if (!file_ || size <= 0)
+    return false;
+
+#ifdef MKVWRITER_FILE_HINTS
+  if (fallocate(fileno(file_), FALLOC_FL_KEEP_SIZE, 0, size))
+    return false;
+
+  preallocated_ = true;
+  return true;
+#else
+  return false;
+#endif
+}
+
+bool MkvWriter::ReleasePreallocatedSpace() {
+#ifdef MKVWRITER_FILE_HINTS
+  if (fflush(file_))
+    return false;
+
+  // Truncating to the current size frees the blocks past the end.
+  const int fd = fileno(file_);
+  struct stat file_stat;
+  return fstat(fd, &file_stat) == 0 && ftruncate(fd, file_stat.st_size) == 0;
+#else
+  return true;
+#endif
+}
+
+bool MkvWriter::WriteBack() {
+  writeback_pending_ = 0;
+
+#ifdef MKVWRITER_FILE_HINTS
+  if (fflush(file_))
+    return false;
+
+  const int64 end = Position();
+  if (end <= writeback_started_)
+    return true;
+
+  // The hints only affect performance, so their errors are ignored.
+  const int fd = fileno(file_);
+  if (writeback_started_ > writeback_done_) {
+    // The write back started an interval ago should have completed by now.
+    const int64 length = writeback_started_ - writeback_done_;
+    sync_file_range(fd, writeback_done_, length,
+                    SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                        SYNC_FILE_RANGE_WAIT_AFTER);
+    posix_fadvise(fd, writeback_done_, length, POSIX_FADV_DONTNEED);
+    writeback_done_ = writeback_started_;
+  }
+
+  sync_file_range(fd, writeback_started_, end - writeback_started_,
+                  SYNC_FILE_RANGE_WRITE);
+  writeback_started_ = end;
+#endif
+  return true;
 }
 
 int64 MkvWriter::Position() const {
@@ -87,4 +192,440 @@ bool MkvWriter::Seekable() const { return true; }
 
 void MkvWriter::ElementStartNotify(uint64, int64) {}
 
+MemoryMkvWriter::MemoryMkvWriter()
+    : data_(NULL), capacity_(0), size_(0), position_(0) {}
+
+MemoryMkvWriter::~MemoryMkvWriter() { delete[] data_; }
+
+int32 MemoryMkvWriter::Write(const void* buffer, uint32 length) {
+  if (length == 0)
+    return 0;
+
+  if (buffer == NULL)
+    return -1;
+
+  const uint64 end = position_ + length;
+  if (end > capacity_) {
+    uint64 new_capacity = (capacity_ == 0) ? 4096 : capacity_ * 2;
+    while (new_capacity < end)
+      new_capacity *= 2;
+
+    uint8* const data = new (std::nothrow) uint8[new_capacity];  // NOLINT
+    if (!data)
+      return -1;
+
+    if (size_ > 0)
+      memcpy(data, data_, static_cast<size_t>(size_));
+    delete[] data_;
+    data_ = data;
+    capacity_ = new_capacity;
+  }
+
+  memcpy(data_ + position_, buffer, length);
+  position_ = end;
+  if (position_ > size_)
+    size_ = position_;
+
+  return 0;
+}
+
+int64 MemoryMkvWriter::Position() const { return position_; }
+
+int32 MemoryMkvWriter::Position(int64 position) {
+  if (position < 0 || static_cast<uint64>(position) > size_)
+    return -1;
+
+  position_ = position;
+  return 0;
+}
+
+bool MemoryMkvWriter::Seekable() const { return true; }
+
+void MemoryMkvWriter::ElementStartNotify(uint64, int64) {}
+
+void MemoryMkvWriter::Reset() {
+  size_ = 0;
+  position_ = 0;
+}
+
+Crc32MkvWriter::Crc32MkvWriter(IMkvWriter* writer)
+    : writer_(writer), crc_(0), size_(0) {}
+
+Crc32MkvWriter::~Crc32MkvWriter() {}
+
+int32 Crc32MkvWriter::Write(const void* buffer, uint32 length) {
+  if (buffer == NULL && length > 0)
+    return -1;
+
+  if (writer_ && writer_->Write(buffer, length))
+    return -1;
+
+  crc_ = libwebm::Crc32(crc_, static_cast<const uint8*>(buffer), length);
+  size_ += length;
+  return 0;
+}
+
+int64 Crc32MkvWriter::Position() const {
+  return writer_ ? writer_->Position() : size_;
+}
+
+int32 Crc32MkvWriter::Position(int64) { return -1; }
+
+bool Crc32MkvWriter::Seekable() const { return false; }
+
+void Crc32MkvWriter::ElementStartNotify(uint64 element_id, int64 position) {
+  if (writer_)
+    writer_->ElementStartNotify(element_id, position);
+}
+
+StatisticsMkvWriter::StatisticsMkvWriter(IMkvWriter* writer,
+                                         MuxerStatistics* statistics)
+    : writer_(writer),
+      statistics_(statistics),
+      starts_(NULL),
+      starts_size_(0),
+      starts_capacity_(0),
+      element_(MuxerStatistics::kOtherElement),
+      position_(writer->Position()),
+      end_position_(position_) {}
+
+StatisticsMkvWriter::~StatisticsMkvWriter() { delete[] starts_; }
+
+int32 StatisticsMkvWriter::Write(const void* buffer, uint32 length) {
+  const int32 status = writer_->Write(buffer, length);
+  if (status)
+    return status;
+
+  uint64 rewritten = 0;
+  if (position_ < end_position_) {
+    rewritten = static_cast<uint64>(end_position_ - position_);
+    if (rewritten > length)
+      rewritten = length;
+  }
+
+  statistics_->AddWrite(element_, length, rewritten);
+  position_ += length;
+  if (position_ > end_position_)
+    end_position_ = position_;
+  return 0;
+}
+
+int64 StatisticsMkvWriter::Position() const { return writer_->Position(); }
+
+int32 StatisticsMkvWriter::Position(int64 position) {
+  statistics_->AddSeek();
+
+  const int32 status = writer_->Position(position);
+  if (status)
+    return status;
+
+  position_ = position;
+  element_ = FindElement(position);
+  return 0;
+}
+
+bool StatisticsMkvWriter::Seekable() const { return writer_->Seekable(); }
+
+void StatisticsMkvWriter::ElementStartNotify(uint64 element_id,
+                                             int64 position) {
+  writer_->ElementStartNotify(element_id, position);
+
+  // The output went back without a seek, so it was switched to a new file,
+  // e.g. by chunking. Positions start over.
+  if (position < position_) {
+    starts_size_ = 0;
+    position_ = position;
+    end_position_ = position;
+  }
+
+  const MuxerStatistics::Element element =
+      MuxerStatistics::GetElement(element_id);
+  if (element == MuxerStatistics::kNumElements)
+    return;
+
+  // Void elements written inside a cluster stand in for its children.
+  if (element == MuxerStatistics::kVoidElement &&
+      element_ == MuxerStatistics::kClusterElement)
+    return;
+
+  element_ = element;
+
+  if (starts_size_ > 0 && position <= starts_[starts_size_ - 1].position)
+    return;
+
+  if (starts_size_ + 1 > starts_capacity_) {
+    const int32 new_capacity =
+        (starts_capacity_ <= 0) ? 16 : starts_capacity_ * 2;
+    ElementStart* const starts =
+        new (std::nothrow) ElementStart[new_capacity];  // NOLINT
+    if (!starts)
+      return;
+
+    for (int32 i = 0; i < starts_size_; ++i)
+      starts[i] = starts_[i];
+
+    delete[] starts_;
+    starts_ = starts;
+    starts_capacity_ = new_capacity;
+  }
+
+  starts_[starts_size_].position = position;
+  starts_[starts_size_].element = element;
+  ++starts_size_;
+}
+
+MuxerStatistics::Element StatisticsMkvWriter::FindElement(
+    int64 position) const {
+  int32 low = 0;
+  int32 high = starts_size_;
+  while (low < high) {
+    const int32 mid = low + (high - low) / 2;
+    if (starts_[mid].position <= position)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+
+  return (low > 0) ? starts_[low - 1].element : MuxerStatistics::kOtherElement;
+}
+
+PatchMkvWriter::PatchMkvWriter(IMkvWriter* writer)
+    : writer_(writer),
+      patches_(NULL),
+      patches_size_(0),
+      patches_capacity_(0),
+      notifications_(NULL),
+      notifications_size_(0),
+      notifications_capacity_(0),
+      at_end_(true),
+      position_(0) {}
+
+PatchMkvWriter::~PatchMkvWriter() {
+  Reset();
+  delete[] patches_;
+  delete[] notifications_;
+}
+
+int32 PatchMkvWriter::Write(const void* buffer, uint32 length) {
+  if (buffer == NULL && length > 0)
+    return -1;
+
+  if (at_end_)
+    return writer_->Write(buffer, length);
+
+  const uint8* data = static_cast<const uint8*>(buffer);
+  const int64 end = writer_->Position();
+  uint64 patch_length = length;
+  if (position_ + static_cast<int64>(length) > end)
+    patch_length = static_cast<uint64>(end - position_);
+
+  if (patch_length > 0 && !AddPatch(data, patch_length))
+    return -1;
+  position_ += patch_length;
+
+  // The write runs past the end of the output; pass the rest through.
+  if (patch_length < length) {
+    at_end_ = true;
+    return writer_->Write(data + patch_length,
+                          static_cast<uint32>(length - patch_length));
+  }
+
+  return 0;
+}
+
+int64 PatchMkvWriter::Position() const {
+  return at_end_ ? writer_->Position() : position_;
+}
+
+int32 PatchMkvWriter::Position(int64 position) {
+  const int64 end = writer_->Position();
+  if (position < 0 || position > end)
+    return -1;
+
+  at_end_ = (position == end);
+  position_ = position;
+  return 0;
+}
+
+bool PatchMkvWriter::Seekable() const { return writer_->Seekable(); }
+
+void PatchMkvWriter::ElementStartNotify(uint64 element_id, int64 position) {
+  if (position >= writer_->Position()) {
+    writer_->ElementStartNotify(element_id, position);
+    return;
+  }
+
+  if (notifications_size_ + 1 > notifications_capacity_) {
+    const int32 new_capacity =
+        (notifications_capacity_ <= 0) ? 8 : notifications_capacity_ * 2;
+    Notification* const notifications =
+        new (std::nothrow) Notification[new_capacity];  // NOLINT
+    if (!notifications)
+      return;
+
+    for (int32 i = 0; i < notifications_size_; ++i)
+      notifications[i] = notifications_[i];
+
+    delete[] notifications_;
+    notifications_ = notifications;
+    notifications_capacity_ = new_capacity;
+  }
+
+  notifications_[notifications_size_].element_id = element_id;
+  notifications_[notifications_size_].position = position;
+  ++notifications_size_;
+}
+
+bool PatchMkvWriter::Flush() {
+  if (patches_size_ == 0)
+    return true;
+
+  const int64 end = writer_->Position();
+
+  int32* const order = new (std::nothrow) int32[patches_size_];  // NOLINT
+  if (!order)
+    return false;
+  SortPatches(order);
+
+  bool ok = true;
+  int32 first = 0;
+  while (ok && first < patches_size_) {
+    // Gather the patches that overlap or touch into one run.
+    const int64 run_start = patches_[order[first]].position;
+    int64 run_end = run_start + static_cast<int64>(patches_[order[first]].size);
+    int32 last = first + 1;
+    while (last < patches_size_ && patches_[order[last]].position <= run_end) {
+      const Patch& patch = patches_[order[last]];
+      const int64 patch_end = patch.position + static_cast<int64>(patch.size);
+      if (patch_end > run_end)
+        run_end = patch_end;
+      ++last;
+    }
+
+    const uint64 run_size = static_cast<uint64>(run_end - run_start);
+    uint8* const run = new (std::nothrow) uint8[run_size];  // NOLINT
+    if (!run) {
+      ok = false;
+      break;
+    }
+
+    // Later patches overwrite earlier ones, so apply them in the order they
+    // were written.
+    for (int32 i = 0; i < patches_size_; ++i) {
+      const Patch& patch = patches_[i];
+      if (patch.position >= run_start && patch.position < run_end) {
+        memcpy(run + (patch.position - run_start), patch.data,
+               static_cast<size_t>(patch.size));
+      }
+    }
+
+    if (writer_->Position(run_start)) {
+      ok = false;
+    } else {
+      for (int32 i = 0; i < notifications_size_; ++i) {
+        const Notification& notification = notifications_[i];
+        if (notification.position >= run_start &&
+            notification.position < run_end)
+          writer_->ElementStartNotify(notification.element_id,
+                                      notification.position);
+      }
+
+      // Write() takes a 32 bit length.
+      uint64 offset = 0;
+      while (ok && offset < run_size) {
+        uint64 chunk = run_size - offset;
+        if (chunk > 0x80000000ULL)
+          chunk = 0x80000000ULL;
+        if (writer_->Write(run + offset, static_cast<uint32>(chunk)))
+          ok = false;
+        offset += chunk;
+      }
+    }
+
+    delete[] run;
+    first = last;
+  }
+
+  delete[] order;
+
+  if (ok && writer_->Position(end))
+    ok = false;
+
+  Reset();
+  at_end_ = true;
+  return ok;
+}
+
+bool PatchMkvWriter::AddPatch(const uint8* buffer, uint64 length) {
+  // Extend the last patch when the write continues it.
+  Patch* patch = NULL;
+  if (patches_size_ > 0) {
+    Patch& last = patches_[patches_size_ - 1];
+    if (last.position + static_cast<int64>(last.size) == position_)
+      patch = &last;
+  }
+
+  if (!patch) {
+    if (patches_size_ + 1 > patches_capacity_) {
+      const int32 new_capacity =
+          (patches_capacity_ <= 0) ? 8 : patches_capacity_ * 2;
+      Patch* const patches = new (std::nothrow) Patch[new_capacity];  // NOLINT
+      if (!patches)
+        return false;
+
+      for (int32 i = 0; i < patches_size_; ++i)
+        patches[i] = patches_[i];
+
+      delete[] patches_;
+      patches_ = patches;
+      patches_capacity_ = new_capacity;
+    }
+
+    patch = &patches_[patches_size_++];
+    patch->position = position_;
+    patch->data = NULL;
+    patch->size = 0;
+    patch->capacity = 0;
+  }
+
+  const uint64 size = patch->size + length;
+  if (size > patch->capacity) {
+    uint64 new_capacity = (patch->capacity == 0) ? 64 : patch->capacity * 2;
+    while (new_capacity < size)
+      new_capacity *= 2;
+
+    uint8* const data = new (std::nothrow) uint8[new_capacity];  // NOLINT
+    if (!data)
+      return false;
+
+    if (patch->size > 0)
+      memcpy(data, patch->data, static_cast<size_t>(patch->size));
+    delete[] patch->data;
+    patch->data = data;
+    patch->capacity = new_capacity;
+  }
+
+  memcpy(patch->data + patch->size, buffer, static_cast<size_t>(length));
+  patch->size = size;
+  return true;
+}
+
+void PatchMkvWriter::SortPatches(int32* order) const {
+  for (int32 i = 0; i < patches_size_; ++i) {
+    int32 j = i;
+    while (j > 0 && patches_[order[j - 1]].position > patches_[i].position) {
+      order[j] = order[j - 1];
+      --j;
+    }
+    order[j] = i;
+  }
+}
+
+void PatchMkvWriter::Reset() {
+  for (int32 i = 0; i < patches_size_; ++i)
+    delete[] patches_[i].data;
+  patches_size_ = 0;
+  notifications_size_ = 0;
+}
+
 }  // namespace mkvmuxer
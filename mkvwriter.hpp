@@ -35,17 +35,248 @@ class MkvWriter : public IMkvWriter {
   // true on success.
   bool Open(const char* filename);
 
-  // Closes an opened file.
+  // Closes an opened file. Releases the space reserved by Preallocate()
+  // past the end of the file.
   void Close();
 
+  // Reserves |size| bytes of disk space for the file, so it is allocated in
+  // few extents however it grows. The file size is not changed. Only
+  // supported on Linux, and by file systems that implement fallocate().
+  // Returns true on success.
+  bool Preallocate(int64 size);
+
+  // Starts writing back the data to disk every |interval| bytes written,
+  // instead of leaving it to the page cache to flush in bursts. The data
+  // written back an interval before is then dropped from the page cache. 0,
+  // the default, turns it off. Only has an effect on Linux.
+  void set_writeback_interval(int64 interval) {
+    writeback_interval_ = interval;
+  }
+  int64 writeback_interval() const { return writeback_interval_; }
+
+  // Returns the file handle of the output file, or NULL if no file is open.
+  FILE* file() const { return file_; }
+
+  // Counts |length| bytes that were written to file() without going through
+  // Write() towards the write back interval. Returns true on success.
+  bool AddWrittenBytes(int64 length);
+
  private:
+  // Frees the space reserved by Preallocate() past the end of the file.
+  // Returns true on success.
+  bool ReleasePreallocatedSpace();
+
+  // Starts writing back the data written since the last call, and waits for
+  // the data of the call before to be written back. Returns true on success.
+  bool WriteBack();
+
   // File handle to output file.
   FILE* file_;
   bool writer_owns_file_;
 
+  // Flag telling if space was reserved past the end of the file.
+  bool preallocated_;
+
+  // Bytes written between write backs, or 0 for no write back.
+  int64 writeback_interval_;
+
+  // Bytes written since the last write back.
+  int64 writeback_pending_;
+
+  // File offsets up to which write back has been started, and up to which
+  // it has completed.
+  int64 writeback_started_;
+  int64 writeback_done_;
+
   LIBWEBM_DISALLOW_COPY_AND_ASSIGN(MkvWriter);
 };
 
+// Implementation of the IMkvWriter interface that collects the output in a
+// growable memory buffer.
+class MemoryMkvWriter : public IMkvWriter {
+ public:
+  MemoryMkvWriter();
+  virtual ~MemoryMkvWriter();
+
+  // IMkvWriter interface
+  virtual int64 Position() const;
+  virtual int32 Position(int64 position);
+  virtual bool Seekable() const;
+  virtual int32 Write(const void* buffer, uint32 length);
+  virtual void ElementStartNotify(uint64 element_id, int64 position);
+
+  // Discards the data written so far. The memory is kept for reuse.
+  void Reset();
+
+  // Returns the data written so far.
+  const uint8* data() const { return data_; }
+  uint64 size() const { return size_; }
+
+ private:
+  uint8* data_;
+
+  // Number of bytes allocated in |data_|.
+  uint64 capacity_;
+
+  // Number of bytes written to |data_|.
+  uint64 size_;
+
+  // Offset of the next byte to write.
+  uint64 position_;
+
+  LIBWEBM_DISALLOW_COPY_AND_ASSIGN(MemoryMkvWriter);
+};
+
+// Implementation of the IMkvWriter interface that computes the CRC-32 of the
+// data written through it. The data is passed on to another writer, or
+// discarded when there is none. Seeking is not supported, as it would leave
+// the checksum out of step with the output.
+class Crc32MkvWriter : public IMkvWriter {
+ public:
+  // |writer| receives the data, or is NULL to discard it. |writer| is not
+  // owned.
+  explicit Crc32MkvWriter(IMkvWriter* writer);
+  virtual ~Crc32MkvWriter();
+
+  // IMkvWriter interface
+  virtual int64 Position() const;
+  virtual int32 Position(int64 position);
+  virtual bool Seekable() const;
+  virtual int32 Write(const void* buffer, uint32 length);
+  virtual void ElementStartNotify(uint64 element_id, int64 position);
+
+  // Returns the CRC-32 of the data written so far.
+  uint32 crc() const { return crc_; }
+
+  IMkvWriter* writer() const { return writer_; }
+
+ private:
+  IMkvWriter* const writer_;
+
+  uint32 crc_;
+
+  // Number of bytes written so far.
+  int64 size_;
+
+  LIBWEBM_DISALLOW_COPY_AND_ASSIGN(Crc32MkvWriter);
+};
+
+// Implementation of the IMkvWriter interface that records the calls passed
+// through to another writer in a MuxerStatistics object. Written bytes are
+// attributed to the top level element they belong to; bytes written after
+// seeking back count as rewritten.
+class StatisticsMkvWriter : public IMkvWriter {
+ public:
+  // |writer| receives the calls and |statistics| the counts. Neither is
+  // owned.
+  StatisticsMkvWriter(IMkvWriter* writer, MuxerStatistics* statistics);
+  virtual ~StatisticsMkvWriter();
+
+  // IMkvWriter interface
+  virtual int64 Position() const;
+  virtual int32 Position(int64 position);
+  virtual bool Seekable() const;
+  virtual int32 Write(const void* buffer, uint32 length);
+  virtual void ElementStartNotify(uint64 element_id, int64 position);
+
+  IMkvWriter* writer() const { return writer_; }
+
+ private:
+  struct ElementStart {
+    int64 position;
+    MuxerStatistics::Element element;
+  };
+
+  // Returns the top level element that the byte at |position| belongs to.
+  MuxerStatistics::Element FindElement(int64 position) const;
+
+  IMkvWriter* const writer_;
+  MuxerStatistics* const statistics_;
+
+  // Start positions of the top level elements written so far, in file
+  // order.
+  ElementStart* starts_;
+  int32 starts_size_;
+  int32 starts_capacity_;
+
+  // Element the next bytes written belong to.
+  MuxerStatistics::Element element_;
+
+  // Position of the next byte to write, and the end of the data written so
+  // far.
+  int64 position_;
+  int64 end_position_;
+
+  LIBWEBM_DISALLOW_COPY_AND_ASSIGN(StatisticsMkvWriter);
+};
+
+// Implementation of the IMkvWriter interface that holds back writes to data
+// already written, so that they can be applied to another writer in one pass
+// in file order. Data written at the end of the output is passed through, so
+// the destination writer never seeks until Flush() is called.
+class PatchMkvWriter : public IMkvWriter {
+ public:
+  // |writer| receives the data and the patches. It is not owned.
+  explicit PatchMkvWriter(IMkvWriter* writer);
+  virtual ~PatchMkvWriter();
+
+  // IMkvWriter interface
+  virtual int64 Position() const;
+  virtual int32 Position(int64 position);
+  virtual bool Seekable() const;
+  virtual int32 Write(const void* buffer, uint32 length);
+  virtual void ElementStartNotify(uint64 element_id, int64 position);
+
+  // Writes the patches collected so far to the destination writer, merging
+  // patches that touch, in the order of their positions, and leaves the
+  // destination at the end of the output. Returns true on success.
+  bool Flush();
+
+ private:
+  // Data to be written at |position|.
+  struct Patch {
+    int64 position;
+    uint8* data;
+    uint64 size;
+    uint64 capacity;
+  };
+
+  // Element start held back with the patches.
+  struct Notification {
+    uint64 element_id;
+    int64 position;
+  };
+
+  // Adds |length| bytes of |buffer| to the patches at |position_|. Returns
+  // true on success.
+  bool AddPatch(const uint8* buffer, uint64 length);
+
+  // Sorts the indices of |patches_| by position into |order|, which must
+  // hold |patches_size_| entries.
+  void SortPatches(int32* order) const;
+
+  // Frees the patches and notifications.
+  void Reset();
+
+  IMkvWriter* const writer_;
+
+  Patch* patches_;
+  int32 patches_size_;
+  int32 patches_capacity_;
+
+  Notification* notifications_;
+  int32 notifications_size_;
+  int32 notifications_capacity_;
+
+  // Flag telling if the next byte is written at the end of the output.
+  bool at_end_;
+
+  // Position of the next byte written when |at_end_| is false.
+  int64 position_;
+
+  LIBWEBM_DISALLOW_COPY_AND_ASSIGN(PatchMkvWriter);
+};
+
 }  // end namespace mkvmuxer
 
 #endif  // MKVWRITER_HPP
@@ -0,0 +1,478 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+
+// Measures the throughput of mkvmuxer::Segment on synthetic frame streams.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#include <vector>
+
+// libwebm parser includes
+#include "mkvparser.hpp"
+#include "mkvreader.hpp"
+
+// libwebm muxer includes
+#include "mkvmuxer.hpp"
+#include "mkvmuxerutil.hpp"
+#include "mkvwriter.hpp"
+
+using mkvmuxer::int32;
+using mkvmuxer::int64;
+using mkvmuxer::uint8;
+using mkvmuxer::uint64;
+
+#ifdef _MSC_VER
+// Disable MSVC warnings that suggest making code non-portable.
+#pragma warning(disable : 4996)
+#endif
+
+// Number of heap allocations made through operator new.
+static uint64 g_allocations = 0;
+
+void* operator new(size_t size) {
+  ++g_allocations;
+  void* const ptr = malloc(size ? size : 1);
+  if (!ptr)
+    throw std::bad_alloc();
+  return ptr;
+}
+
+void* operator new[](size_t size) {
+  ++g_allocations;
+  void* const ptr = malloc(size ? size : 1);
+  if (!ptr)
+    throw std::bad_alloc();
+  return ptr;
+}
+
+void* operator new(size_t size, const std::nothrow_t&) throw() {
+  ++g_allocations;
+  return malloc(size ? size : 1);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) throw() {
+  ++g_allocations;
+  return malloc(size ? size : 1);
+}
+
+void operator delete(void* ptr) throw() { free(ptr); }
+void operator delete[](void* ptr) throw() { free(ptr); }
+void operator delete(void* ptr, const std::nothrow_t&) throw() { free(ptr); }
+void operator delete[](void* ptr, const std::nothrow_t&) throw() {
+  free(ptr);
+}
+#if __cplusplus >= 201402L
+void operator delete(void* ptr, size_t) throw() { free(ptr); }
+void operator delete[](void* ptr, size_t) throw() { free(ptr); }
+#endif
+
+namespace {
+
+const uint64 kNanosecondsPerSecond = 1000000000ULL;
+const uint64 kVideoFrameDuration = 33333333ULL;  // 30 fps
+
+void Usage() {
+  printf("Usage: mux_bench [options]\n");
+  printf("\n");
+  printf("Options:\n");
+  printf("  -h | -?               show help\n");
+  printf("  -scenario <string>    only runs the named scenario\n");
+  printf("  -writer <string>      only uses the null, memory or file writer\n");
+  printf("  -seconds <double>     length of the streams, default 60\n");
+  printf("  -iterations <int>     runs of each test, the best is reported,\n");
+  printf("                        default 3\n");
+  printf("  -dir <string>         directory for the file writer output,\n");
+  printf("                        default .\n");
+}
+
+struct Scenario {
+  const char* name;
+  bool video;
+  int key_interval;
+  int key_size;
+  int delta_size;
+  int audio_tracks;
+  uint64 audio_frame_duration;
+  int audio_frame_size;
+  bool cues;
+  bool cues_before_clusters;
+  bool chunking;
+  bool live;
+};
+
+const Scenario kScenarios[] = {
+  // name, video, key_interval, key_size, delta_size, audio_tracks,
+  // audio_frame_duration, audio_frame_size, cues, cues_before_clusters,
+  // chunking, live
+  { "video_only", true, 60, 60000, 8000, 0, 0, 0, true, false, false, false },
+  { "video_audio3", true, 60, 60000, 8000, 3, 20000000ULL, 160, true, false,
+    false, false },
+  { "opus_tiny", false, 0, 0, 0, 1, 2500000ULL, 12, true, false, false,
+    false },
+  { "4k_keyframes", true, 30, 1500000, 200000, 1, 20000000ULL, 400, true,
+    false, false, false },
+  { "no_cues", true, 60, 60000, 8000, 1, 20000000ULL, 160, false, false,
+    false, false },
+  { "cues_before_clusters", true, 60, 60000, 8000, 1, 20000000ULL, 160, true,
+    true, false, false },
+  { "chunking", true, 60, 60000, 8000, 1, 20000000ULL, 160, true, false, true,
+    false },
+  { "live", true, 60, 60000, 8000, 1, 20000000ULL, 160, false, false, false,
+    true },
+};
+
+const int kNumScenarios = sizeof(kScenarios) / sizeof(kScenarios[0]);
+
+enum WriterType { kNullWriter, kMemoryWriter, kFileWriter };
+
+const char* const kWriterNames[] = { "null", "memory", "file" };
+
+const int kNumWriters = sizeof(kWriterNames) / sizeof(kWriterNames[0]);
+
+// Writer that only keeps track of the output position and size.
+class NullMkvWriter : public mkvmuxer::IMkvWriter {
+ public:
+  NullMkvWriter() : position_(0), size_(0) {}
+  virtual ~NullMkvWriter() {}
+
+  virtual int32 Write(const void*, mkvmuxer::uint32 length) {
+    position_ += length;
+    if (position_ > size_)
+      size_ = position_;
+    return 0;
+  }
+  virtual int64 Position() const { return position_; }
+  virtual int32 Position(int64 position) {
+    if (position < 0 || position > size_)
+      return -1;
+    position_ = position;
+    return 0;
+  }
+  virtual bool Seekable() const { return true; }
+  virtual void ElementStartNotify(uint64, int64) {}
+
+ private:
+  int64 position_;
+  int64 size_;
+};
+
+// Reader of the data collected by a MemoryMkvWriter.
+class MemoryMkvReader : public mkvparser::IMkvReader {
+ public:
+  explicit MemoryMkvReader(const mkvmuxer::MemoryMkvWriter* writer)
+      : writer_(writer) {}
+  virtual ~MemoryMkvReader() {}
+
+  virtual int Read(long long position, long length, unsigned char* buffer) {
+    if (position < 0 || length < 0 ||
+        static_cast<uint64>(position + length) > writer_->size())
+      return -1;
+    memcpy(buffer, writer_->data() + position, length);
+    return 0;
+  }
+  virtual int Length(long long* total, long long* available) {
+    if (total)
+      *total = writer_->size();
+    if (available)
+      *available = writer_->size();
+    return 0;
+  }
+
+ private:
+  const mkvmuxer::MemoryMkvWriter* const writer_;
+};
+
+// Chunk sink that only counts the chunks.
+class NullChunkSink : public mkvmuxer::IMkvChunkSink {
+ public:
+  NullChunkSink() : chunks_(0) {}
+  virtual ~NullChunkSink() {}
+
+  virtual bool OnChunk(ChunkType, int32, const uint8*, uint64, uint64,
+                       uint64) {
+    ++chunks_;
+    return true;
+  }
+
+ private:
+  int chunks_;
+};
+
+struct BenchFrame {
+  int track;  // Index into the track numbers.
+  uint64 timestamp;
+  int size;
+  bool is_key;
+};
+
+// Returns the frames of |scenario| for |seconds|, ordered by timestamp.
+// Track index 0 is the video track, if present.
+void MakeFrames(const Scenario& scenario, double seconds,
+                std::vector<BenchFrame>* frames) {
+  const uint64 end = static_cast<uint64>(seconds * kNanosecondsPerSecond);
+  const int num_tracks = (scenario.video ? 1 : 0) + scenario.audio_tracks;
+  std::vector<uint64> next(num_tracks, 0);
+  std::vector<int> count(num_tracks, 0);
+
+  for (;;) {
+    int track = -1;
+    for (int i = 0; i < num_tracks; ++i) {
+      if (next[i] < end && (track < 0 || next[i] < next[track]))
+        track = i;
+    }
+    if (track < 0)
+      break;
+
+    BenchFrame frame;
+    frame.track = track;
+    frame.timestamp = next[track];
+    const int n = count[track]++;
+    if (scenario.video && track == 0) {
+      frame.is_key = (n % scenario.key_interval) == 0;
+      const int size = frame.is_key ? scenario.key_size : scenario.delta_size;
+      frame.size = size - size / 8 + (n * 7919) % (size / 4);
+      next[track] += kVideoFrameDuration;
+    } else {
+      frame.is_key = true;
+      const int size = scenario.audio_frame_size;
+      frame.size = size - size / 8 + (n * 31) % (size / 4 + 1);
+      next[track] += scenario.audio_frame_duration;
+    }
+    frames->push_back(frame);
+  }
+}
+
+struct BenchResult {
+  uint64 mux_ns;
+  uint64 finalize_ns;
+  uint64 allocations;
+};
+
+// Removes the chunk files written with |base|.
+void RemoveChunkFiles(const std::string& base) {
+  remove((base + ".hdr").c_str());
+  for (int i = 0;; ++i) {
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), "_%06d.", i);
+    const bool chunk = !remove((base + suffix + "chk").c_str());
+    const bool cues = !remove((base + suffix + "cues").c_str());
+    if (!chunk && !cues)
+      break;
+  }
+}
+
+// Muxes |frames| of |scenario| using a writer of |type|. Returns true on
+// success.
+bool RunBench(const Scenario& scenario, const std::vector<BenchFrame>& frames,
+              const uint8* data, WriterType type, const std::string& dir,
+              BenchResult* result) {
+  const std::string file_name = dir + "/mux_bench.webm";
+  const std::string copy_name = dir + "/mux_bench_cues.webm";
+  const std::string chunk_base = dir + "/mux_bench_chunk";
+
+  NullMkvWriter null_writer;
+  mkvmuxer::MemoryMkvWriter memory_writer;
+  mkvmuxer::MkvWriter file_writer;
+  mkvmuxer::IMkvWriter* writer = &null_writer;
+  if (type == kMemoryWriter) {
+    writer = &memory_writer;
+  } else if (type == kFileWriter) {
+    if (!file_writer.Open(file_name.c_str())) {
+      printf("\n Could not open output file %s.\n", file_name.c_str());
+      return false;
+    }
+    writer = &file_writer;
+  }
+
+  bool ok = true;
+  NullChunkSink chunk_sink;
+  {
+    mkvmuxer::Segment segment;
+    if (!segment.Init(writer))
+      return false;
+
+    segment.set_mode(scenario.live ? mkvmuxer::Segment::kLive
+                                   : mkvmuxer::Segment::kFile);
+    segment.OutputCues(scenario.cues);
+    if (scenario.chunking) {
+      if (type == kFileWriter)
+        ok = segment.SetChunking(true, chunk_base.c_str());
+      else
+        ok = segment.SetChunkSink(&chunk_sink);
+      if (!ok)
+        return false;
+    }
+
+    std::vector<uint64> tracks;
+    if (scenario.video) {
+      const uint64 track = segment.AddVideoTrack(1920, 1080, 0);
+      if (!track)
+        return false;
+      tracks.push_back(track);
+      segment.CuesTrack(track);
+    }
+    for (int i = 0; i < scenario.audio_tracks; ++i) {
+      const uint64 track = segment.AddAudioTrack(48000, 2, 0);
+      if (!track)
+        return false;
+      tracks.push_back(track);
+      if (!scenario.video && i == 0)
+        segment.CuesTrack(track);
+    }
+
+    const uint64 allocations = g_allocations;
+    const uint64 mux_start = mkvmuxer::GetMonotonicTimeNs();
+    for (size_t i = 0; i < frames.size() && ok; ++i) {
+      const BenchFrame& frame = frames[i];
+      ok = segment.AddFrame(data, frame.size, tracks[frame.track],
+                            frame.timestamp, frame.is_key);
+    }
+    const uint64 finalize_start = mkvmuxer::GetMonotonicTimeNs();
+    result->allocations = g_allocations - allocations;
+
+    if (ok)
+      ok = segment.Finalize();
+
+    if (ok && scenario.cues_before_clusters) {
+      if (type == kMemoryWriter) {
+        MemoryMkvReader reader(&memory_writer);
+        mkvmuxer::MemoryMkvWriter copy_writer;
+        ok = segment.CopyAndMoveCuesBeforeClusters(&reader, &copy_writer);
+      } else if (type == kFileWriter) {
+        file_writer.Close();
+        mkvparser::MkvReader reader;
+        mkvmuxer::MkvWriter copy_writer;
+        ok = !reader.Open(file_name.c_str()) &&
+             copy_writer.Open(copy_name.c_str()) &&
+             segment.CopyAndMoveCuesBeforeClusters(&reader, &copy_writer);
+        reader.Close();
+        copy_writer.Close();
+      }
+    }
+    const uint64 finalize_end = mkvmuxer::GetMonotonicTimeNs();
+
+    result->mux_ns = finalize_start - mux_start;
+    result->finalize_ns = finalize_end - finalize_start;
+  }
+
+  if (type == kFileWriter) {
+    file_writer.Close();
+    remove(file_name.c_str());
+    remove(copy_name.c_str());
+    if (scenario.chunking)
+      RemoveChunkFiles(chunk_base);
+  }
+
+  return ok;
+}
+
+}  // end namespace
+
+int main(int argc, char* argv[]) {
+  const char* scenario_name = NULL;
+  const char* writer_name = NULL;
+  double seconds = 60.0;
+  int iterations = 3;
+  std::string dir = ".";
+
+  const int argc_check = argc - 1;
+  for (int i = 1; i < argc; ++i) {
+    char* end;
+
+    if (!strcmp("-h", argv[i]) || !strcmp("-?", argv[i])) {
+      Usage();
+      return EXIT_SUCCESS;
+    } else if (!strcmp("-scenario", argv[i]) && i < argc_check) {
+      scenario_name = argv[++i];
+    } else if (!strcmp("-writer", argv[i]) && i < argc_check) {
+      writer_name = argv[++i];
+    } else if (!strcmp("-seconds", argv[i]) && i < argc_check) {
+      seconds = strtod(argv[++i], &end);
+    } else if (!strcmp("-iterations", argv[i]) && i < argc_check) {
+      iterations = strtol(argv[++i], &end, 10);
+    } else if (!strcmp("-dir", argv[i]) && i < argc_check) {
+      dir = argv[++i];
+    }
+  }
+
+  if (seconds <= 0.0 || iterations < 1) {
+    Usage();
+    return EXIT_FAILURE;
+  }
+
+  // The same data is used for every frame.
+  int max_frame_size = 1;
+  for (int i = 0; i < kNumScenarios; ++i) {
+    if (kScenarios[i].key_size > max_frame_size)
+      max_frame_size = kScenarios[i].key_size;
+  }
+  std::vector<uint8> data(max_frame_size + max_frame_size / 4);
+  for (size_t i = 0; i < data.size(); ++i)
+    data[i] = static_cast<uint8>(i * 131 + 7);
+
+  printf("%-22s %-7s %10s %9s %13s %12s\n", "scenario", "writer", "frames/s",
+         "MB/s", "allocs/frame", "finalize ms");
+
+  bool ran = false;
+  for (int s = 0; s < kNumScenarios; ++s) {
+    const Scenario& scenario = kScenarios[s];
+    if (scenario_name && strcmp(scenario_name, scenario.name))
+      continue;
+
+    std::vector<BenchFrame> frames;
+    MakeFrames(scenario, seconds, &frames);
+    uint64 frame_bytes = 0;
+    for (size_t i = 0; i < frames.size(); ++i)
+      frame_bytes += frames[i].size;
+
+    for (int w = 0; w < kNumWriters; ++w) {
+      if (writer_name && strcmp(writer_name, kWriterNames[w]))
+        continue;
+
+      // Moving the Cues needs to read back the output.
+      const WriterType type = static_cast<WriterType>(w);
+      if (scenario.cues_before_clusters && type == kNullWriter)
+        continue;
+
+      BenchResult best;
+      for (int i = 0; i < iterations; ++i) {
+        BenchResult result;
+        if (!RunBench(scenario, frames, &data[0], type, dir, &result)) {
+          printf("\n Scenario %s failed with the %s writer.\n", scenario.name,
+                 kWriterNames[w]);
+          return EXIT_FAILURE;
+        }
+        if (i == 0 || result.mux_ns < best.mux_ns)
+          best.mux_ns = result.mux_ns;
+        if (i == 0 || result.finalize_ns < best.finalize_ns)
+          best.finalize_ns = result.finalize_ns;
+        best.allocations = result.allocations;
+      }
+
+      const double mux_seconds =
+          (best.mux_ns > 0 ? best.mux_ns : 1) /
+          static_cast<double>(kNanosecondsPerSecond);
+      printf("%-22s %-7s %10.0f %9.1f %13.2f %12.3f\n", scenario.name,
+             kWriterNames[w], frames.size() / mux_seconds,
+             frame_bytes / mux_seconds / (1024.0 * 1024.0),
+             static_cast<double>(best.allocations) / frames.size(),
+             best.finalize_ns / 1000000.0);
+      ran = true;
+    }
+  }
+
+  if (!ran) {
+    printf("\n No scenario matches the options.\n");
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -9,14 +9,25 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <deque>
+#include <fstream>
 #include <list>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <random>
+#include <sstream>
 #include <string>
+#include <thread>
+#include <vector>
 
 // libwebm parser includes
 #include "mkvreader.hpp"
 #include "mkvparser.hpp"
 
 // libwebm muxer includes
+#include "mkvasyncwriter.hpp"
+#include "mkvframetransform.hpp"
 #include "mkvmuxer.hpp"
 #include "mkvwriter.hpp"
 #include "mkvmuxerutil.hpp"
@@ -35,6 +46,7 @@ namespace {
 
 void Usage() {
   printf("Usage: sample_muxer -i input -o output [options]\n");
+  printf("       sample_muxer -batch list [options]\n");
   printf("\n");
   printf("Main options:\n");
   printf("  -h | -?                     show help\n");
@@ -47,10 +59,46 @@ void Usage() {
   printf("  -cues_on_audio_track <int>  >0 outputs cues on audio track\n");
   printf("  -max_cluster_duration <double> in seconds\n");
   printf("  -max_cluster_size <int>     in bytes\n");
+  printf("  -min_cluster_duration <double> in seconds, clusters start on\n");
+  printf("                              video key frames past the minimum\n");
+  printf("  -min_cluster_size <int>     in bytes\n");
+  printf("  -cluster_lookahead <int>    frames looked ahead at for a key\n");
+  printf("                              frame to split a full cluster at\n");
   printf("  -switch_tracks <int>        >0 switches tracks in output\n");
   printf("  -audio_track_number <int>   >0 Changes the audio track number\n");
   printf("  -video_track_number <int>   >0 Changes the video track number\n");
-  printf("  -chunking <string>          Chunk output\n");
+  printf("  -chunking <string>          Chunk output, -batch names the\n");
+  printf("                              chunks after each output instead\n");
+  printf("  -buffer_clusters <int>      >0 assembles clusters in memory\n");
+  printf("  -max_cluster_buffer_size <int> in bytes\n");
+  printf("  -async_io <int>             >0 writes output on an I/O thread\n");
+  printf("  -preallocate <int>          >0 reserves disk space for the\n");
+  printf("                              output, sized after the input\n");
+  printf("  -writeback_interval <int>   >0 writes back the output to disk\n");
+  printf("                              every <int> bytes\n");
+  printf("  -max_audio_hold <double>    in seconds, max time audio is held\n");
+  printf("  -latency_stats <int>        >0 prints frame latency statistics\n");
+  printf("  -muxer_stats <int>          >0 prints cluster and writer counts\n");
+  printf("  -max_lace_duration <double> in seconds, >0 laces audio frames\n");
+  printf("                              of tracks with a default duration\n");
+  printf("  -passthrough <int>          >0 copies SimpleBlocks without\n");
+  printf("                              staging their frames\n");
+  printf("  -output_crc32 <int>         >0 writes CRC-32 elements\n");
+  printf("  -verify_crc32 <int>         >0 checks CRC-32s of input clusters\n");
+  printf("\n");
+  printf("Encryption options:\n");
+  printf("  -encryption_key <hex>       AES key of 16, 24 or 32 bytes,\n");
+  printf("                              encrypts audio and video (AES-CTR)\n");
+  printf("  -encryption_key_id <hex>    ContentEncKeyID of the tracks,\n");
+  printf("                              required with -encryption_key\n");
+  printf("  -encryption_threads <int>   threads that encrypt frames,\n");
+  printf("                              0 encrypts on the muxing thread\n");
+  printf("\n");
+  printf("Batch options:\n");
+  printf("  -batch <file>               muxes the input and output named on\n");
+  printf("                              each line of <file>\n");
+  printf("  -jobs <int>                 number of threads used by -batch,\n");
+  printf("                              0 uses one per core\n");
   printf("\n");
   printf("Video options:\n");
   printf("  -display_width <int>        Display width in pixels\n");
@@ -60,6 +108,13 @@ void Usage() {
   printf("Cues options:\n");
   printf("  -output_cues_block_number <int> >0 outputs cue block number\n");
   printf("  -cues_before_clusters <int> >0 puts Cues before Clusters\n");
+  printf("  -reserve_cues_interval <double> expected seconds between cues,\n");
+  printf("                              reserves space to write Cues before\n");
+  printf("                              Clusters without copying the file\n");
+  printf("  -audio_cues_interval <double> also outputs cues on audio track,\n");
+  printf("                              at least <double> seconds apart\n");
+  printf("  -cues_spill_threshold <int> >0 keeps <int> cues in memory,\n");
+  printf("                              spills older cues to a file\n");
   printf("\n");
   printf("Metadata options:\n");
   printf("  -webvtt-subtitles <vttfile>    ");
@@ -139,124 +194,230 @@ int ParseArgWebVTT(char* argv[], int* argv_index, int argc_check,
   return 0;  // not a WebVTT arg
 }
 
-}  // end namespace
-
-int main(int argc, char* argv[]) {
-  char* input = NULL;
-  char* output = NULL;
+// Muxer settings taken from the command line. In batch mode they apply to
+// every input, except that chunks are named after the output of each job.
+struct MuxerOptions {
+  MuxerOptions()
+      : output_video(true),
+        output_audio(true),
+        live_mode(false),
+        output_cues(true),
+        cues_before_clusters(false),
+        reserve_cues_interval(0.0),
+        cues_on_video_track(true),
+        cues_on_audio_track(false),
+        audio_cues_interval(-1.0),
+        cues_spill_threshold(0),
+        max_cluster_duration(0),
+        max_cluster_size(0),
+        min_cluster_duration(0),
+        min_cluster_size(0),
+        cluster_lookahead(0),
+        switch_tracks(false),
+        audio_track_number(0),
+        video_track_number(0),
+        chunking(false),
+        chunk_name(NULL),
+        buffer_clusters(false),
+        max_cluster_buffer_size(0),
+        async_io(false),
+        preallocate(false),
+        writeback_interval(0),
+        max_audio_hold(0),
+        latency_stats(false),
+        muxer_stats(false),
+        max_lace_duration(0),
+        passthrough(false),
+        output_crc32(false),
+        verify_crc32(false),
+        encryption_threads(0),
+        output_cues_block_number(true),
+        display_width(0),
+        display_height(0),
+        stereo_mode(0) {}
 
   // Segment variables
-  bool output_video = true;
-  bool output_audio = true;
-  bool live_mode = false;
-  bool output_cues = true;
-  bool cues_before_clusters = false;
-  bool cues_on_video_track = true;
-  bool cues_on_audio_track = false;
-  uint64 max_cluster_duration = 0;
-  uint64 max_cluster_size = 0;
-  bool switch_tracks = false;
-  int audio_track_number = 0;  // 0 tells muxer to decide.
-  int video_track_number = 0;  // 0 tells muxer to decide.
-  bool chunking = false;
-  const char* chunk_name = NULL;
-
-  bool output_cues_block_number = true;
-
-  uint64 display_width = 0;
-  uint64 display_height = 0;
-  uint64 stereo_mode = 0;
+  bool output_video;
+  bool output_audio;
+  bool live_mode;
+  bool output_cues;
+  bool cues_before_clusters;
+  double reserve_cues_interval;
+  bool cues_on_video_track;
+  bool cues_on_audio_track;
+  double audio_cues_interval;  // <0 outputs no extra audio cues.
+  int cues_spill_threshold;
+  uint64 max_cluster_duration;
+  uint64 max_cluster_size;
+  uint64 min_cluster_duration;
+  uint64 min_cluster_size;
+  int cluster_lookahead;
+  bool switch_tracks;
+  int audio_track_number;  // 0 tells muxer to decide.
+  int video_track_number;  // 0 tells muxer to decide.
+  bool chunking;
+  const char* chunk_name;
+  bool buffer_clusters;
+  uint64 max_cluster_buffer_size;
+  bool async_io;
+  bool preallocate;
+  int64 writeback_interval;
+  uint64 max_audio_hold;
+  bool latency_stats;
+  bool muxer_stats;
+  uint64 max_lace_duration;
+  bool passthrough;
+  bool output_crc32;
+  bool verify_crc32;
+
+  // Encryption variables. Frames are encrypted if |encryption_key| is set.
+  std::vector<unsigned char> encryption_key;
+  std::vector<unsigned char> encryption_key_id;
+  int encryption_threads;
+
+  bool output_cues_block_number;
+
+  uint64 display_width;
+  uint64 display_height;
+  uint64 stereo_mode;
 
   metadata_files_t metadata_files;
+};
 
-  const int argc_check = argc - 1;
-  for (int i = 1; i < argc; ++i) {
-    char* end;
+// Parses the hexadecimal string |hex| into |bytes|. Returns false if |hex| is
+// empty or not made of pairs of hexadecimal digits.
+bool ParseHex(const char* hex, std::vector<unsigned char>* bytes) {
+  const size_t length = strlen(hex);
+  if (length == 0 || length % 2 != 0)
+    return false;
+
+  bytes->clear();
+  for (size_t i = 0; i < length; i += 2) {
+    const char digits[3] = {hex[i], hex[i + 1], '\0'};
+    char* end = NULL;
+    const long value = strtol(digits, &end, 16);
+    if (end != digits + 2)
+      return false;
+    bytes->push_back(static_cast<unsigned char>(value));
+  }
+  return true;
+}
 
-    if (!strcmp("-h", argv[i]) || !strcmp("-?", argv[i])) {
-      Usage();
-      return EXIT_SUCCESS;
-    } else if (!strcmp("-i", argv[i]) && i < argc_check) {
-      input = argv[++i];
-    } else if (!strcmp("-o", argv[i]) && i < argc_check) {
-      output = argv[++i];
-    } else if (!strcmp("-video", argv[i]) && i < argc_check) {
-      output_video = strtol(argv[++i], &end, 10) == 0 ? false : true;
-    } else if (!strcmp("-audio", argv[i]) && i < argc_check) {
-      output_audio = strtol(argv[++i], &end, 10) == 0 ? false : true;
-    } else if (!strcmp("-live", argv[i]) && i < argc_check) {
-      live_mode = strtol(argv[++i], &end, 10) == 0 ? false : true;
-    } else if (!strcmp("-output_cues", argv[i]) && i < argc_check) {
-      output_cues = strtol(argv[++i], &end, 10) == 0 ? false : true;
-    } else if (!strcmp("-cues_before_clusters", argv[i]) && i < argc_check) {
-      cues_before_clusters = strtol(argv[++i], &end, 10) == 0 ? false : true;
-    } else if (!strcmp("-cues_on_video_track", argv[i]) && i < argc_check) {
-      cues_on_video_track = strtol(argv[++i], &end, 10) == 0 ? false : true;
-      if (cues_on_video_track)
-        cues_on_audio_track = false;
-    } else if (!strcmp("-cues_on_audio_track", argv[i]) && i < argc_check) {
-      cues_on_audio_track = strtol(argv[++i], &end, 10) == 0 ? false : true;
-      if (cues_on_audio_track)
-        cues_on_video_track = false;
-    } else if (!strcmp("-max_cluster_duration", argv[i]) && i < argc_check) {
-      const double seconds = strtod(argv[++i], &end);
-      max_cluster_duration = static_cast<uint64>(seconds * 1000000000.0);
-    } else if (!strcmp("-max_cluster_size", argv[i]) && i < argc_check) {
-      max_cluster_size = strtol(argv[++i], &end, 10);
-    } else if (!strcmp("-switch_tracks", argv[i]) && i < argc_check) {
-      switch_tracks = strtol(argv[++i], &end, 10) == 0 ? false : true;
-    } else if (!strcmp("-audio_track_number", argv[i]) && i < argc_check) {
-      audio_track_number = strtol(argv[++i], &end, 10);
-    } else if (!strcmp("-video_track_number", argv[i]) && i < argc_check) {
-      video_track_number = strtol(argv[++i], &end, 10);
-    } else if (!strcmp("-chunking", argv[i]) && i < argc_check) {
-      chunking = true;
-      chunk_name = argv[++i];
-    } else if (!strcmp("-display_width", argv[i]) && i < argc_check) {
-      display_width = strtol(argv[++i], &end, 10);
-    } else if (!strcmp("-display_height", argv[i]) && i < argc_check) {
-      display_height = strtol(argv[++i], &end, 10);
-    } else if (!strcmp("-stereo_mode", argv[i]) && i < argc_check) {
-      stereo_mode = strtol(argv[++i], &end, 10);
-    } else if (!strcmp("-output_cues_block_number", argv[i]) &&
-               i < argc_check) {
-      output_cues_block_number =
-          strtol(argv[++i], &end, 10) == 0 ? false : true;
-    } else if (int e = ParseArgWebVTT(argv, &i, argc_check, &metadata_files)) {
-      if (e < 0)
-        return EXIT_FAILURE;
-    }
+// Prints the counts collected by the muxer.
+void PrintMuxerStatistics(const mkvmuxer::MuxerStatistics& statistics) {
+  typedef mkvmuxer::MuxerStatistics Statistics;
+  static const char* const kReasons[Statistics::kNumClusterReasons] = {
+      "first", "forced", "keyframe", "duration", "size", "timecode overflow"};
+  static const char* const kElements[Statistics::kNumElements] = {
+      "EBML",    "Segment", "SeekHead", "Info", "Tracks",
+      "Chapters", "Cluster", "Cues",     "Void", "other"};
+  static const char* const kPhases[Statistics::kNumFinalizePhases] = {
+      "clusters", "info", "cues", "seek head", "segment size"};
+
+  printf("Clusters: %llu, largest %llu bytes\n", statistics.clusters(),
+         statistics.largest_cluster_size());
+  for (int i = 0; i < Statistics::kNumClusterReasons; ++i) {
+    const Statistics::ClusterReason reason =
+        static_cast<Statistics::ClusterReason>(i);
+    if (statistics.cluster_count(reason) > 0)
+      printf("  %-18s %llu\n", kReasons[i], statistics.cluster_count(reason));
   }
 
-  if (input == NULL || output == NULL) {
-    Usage();
-    return EXIT_FAILURE;
+  for (int i = 0; i < statistics.track_count(); ++i) {
+    const Statistics::TrackCounts& track = statistics.track(i);
+    printf("Track %llu: %llu blocks, %llu frames, %llu bytes\n",
+           track.track_number, track.blocks, track.frames, track.bytes);
+  }
+
+  printf("Writes: %llu, %llu bytes, %llu rewritten, %llu seeks\n",
+         statistics.writes(), statistics.bytes_written(),
+         statistics.bytes_rewritten(), statistics.seeks());
+  for (int i = 0; i < Statistics::kNumElements; ++i) {
+    const Statistics::Element element = static_cast<Statistics::Element>(i);
+    if (statistics.element_bytes(element) > 0)
+      printf("  %-18s %llu\n", kElements[i], statistics.element_bytes(element));
+  }
+
+  printf("Audio queue depth: %d\n", statistics.max_audio_queue_depth());
+  printf("Finalize (us):");
+  for (int i = 0; i < Statistics::kNumFinalizePhases; ++i) {
+    const Statistics::FinalizePhase phase =
+        static_cast<Statistics::FinalizePhase>(i);
+    printf(" %s %.1f", kPhases[i], statistics.finalize_ns(phase) / 1000.0);
   }
+  printf("\n");
+}
+
+// Buffer that frames are read into. It only grows, so that it is reused for
+// every frame of an input, and for every input a batch thread muxes.
+class FrameBuffer {
+ public:
+  FrameBuffer() : data_(NULL), size_(0) {}
+  ~FrameBuffer() { delete[] data_; }
+
+  // Returns a buffer of at least |size| bytes, or NULL if it could not be
+  // allocated.
+  unsigned char* Reserve(long long size) {
+    if (size > size_) {
+      delete[] data_;
+      data_ = new (std::nothrow) unsigned char[size];  // NOLINT
+      size_ = data_ ? size : 0;
+    }
+    return data_;
+  }
+
+ private:
+  unsigned char* data_;
+  long long size_;
+};
+
+// Work done muxing one input.
+struct MuxStats {
+  MuxStats() : frames(0), bytes_in(0), bytes_out(0), seconds(0.0) {}
+
+  uint64 frames;
+  uint64 bytes_in;
+  uint64 bytes_out;
+  double seconds;
+};
+
+// Muxes the file |input| into |output| using |options|. Frames are read into
+// |buffer|. Returns true on success, and fills in |stats|.
+bool MuxFile(const MuxerOptions& options, const char* input,
+             const char* output, FrameBuffer* buffer, MuxStats* stats) {
+  const uint64 start_ns = mkvmuxer::GetMonotonicTimeNs();
 
   // Get parser header info
   mkvparser::MkvReader reader;
 
   if (reader.Open(input)) {
     printf("\n Filename is invalid or error while opening.\n");
-    return EXIT_FAILURE;
+    return false;
   }
 
+  long long input_size = 0;
+  long long available = 0;
+  if (reader.Length(&input_size, &available) == 0)
+    stats->bytes_in = input_size;
+
   long long pos = 0;
   mkvparser::EBMLHeader ebml_header;
   ebml_header.Parse(&reader, pos);
 
-  mkvparser::Segment* parser_segment;
-  long long ret =
-      mkvparser::Segment::CreateInstance(&reader, pos, parser_segment);
+  mkvparser::Segment* segment;
+  long long ret = mkvparser::Segment::CreateInstance(&reader, pos, segment);
   if (ret) {
     printf("\n Segment::CreateInstance() failed.");
-    return EXIT_FAILURE;
+    return false;
   }
+  const std::unique_ptr<mkvparser::Segment> parser_segment(segment);
+
+  parser_segment->SetVerifyCrc32(options.verify_crc32);
 
   ret = parser_segment->Load();
   if (ret < 0) {
     printf("\n Segment::Load() failed.");
-    return EXIT_FAILURE;
+    return false;
   }
 
   const mkvparser::SegmentInfo* const segment_info = parser_segment->GetInfo();
@@ -265,33 +426,94 @@ int main(int argc, char* argv[]) {
   // Set muxer header info
   mkvmuxer::MkvWriter writer;
 
-  char* temp_file = tmpnam(NULL);
-  if (!writer.Open(cues_before_clusters ? temp_file : output)) {
+  // With reserved space the Cues are normally written in place, and the
+  // output is only copied if they turn out not to fit.
+  const bool reserve_cues =
+      options.cues_before_clusters && options.reserve_cues_interval > 0;
+
+  // The temporary file is named after the output so that concurrent batch
+  // jobs never share one.
+  const std::string temp_file = std::string(output) + ".tmp";
+  if (!writer.Open(options.cues_before_clusters && !reserve_cues
+                       ? temp_file.c_str()
+                       : output)) {
     printf("\n Filename is invalid or error while opening.\n");
-    return EXIT_FAILURE;
+    return false;
+  }
+
+  // The output of a remux is about as large as its input. Preallocation is
+  // only a hint, so failures are ignored.
+  if (options.preallocate && input_size > 0)
+    writer.Preallocate(input_size);
+  writer.set_writeback_interval(options.writeback_interval);
+
+  mkvmuxer::AsyncMkvWriter async_writer(&writer);
+  if (options.async_io && !async_writer.Init()) {
+    printf("\n Could not start the I/O thread.\n");
+    return false;
   }
 
+  // Declared before the segment, which uses it until it is destroyed.
+  mkvmuxer::AesCtrFrameTransform encryption;
+  const bool encrypt = !options.encryption_key.empty();
+
   // Set Segment element attributes
   mkvmuxer::Segment muxer_segment;
 
-  if (!muxer_segment.Init(&writer)) {
+  if (!muxer_segment.Init(options.async_io
+                              ? static_cast<mkvmuxer::IMkvWriter*>(
+                                    &async_writer)
+                              : &writer)) {
     printf("\n Could not initialize muxer segment!\n");
-    return EXIT_FAILURE;
+    return false;
   }
 
-  if (live_mode)
+  if (options.live_mode)
     muxer_segment.set_mode(mkvmuxer::Segment::kLive);
   else
     muxer_segment.set_mode(mkvmuxer::Segment::kFile);
 
-  if (chunking)
-    muxer_segment.SetChunking(true, chunk_name);
-
-  if (max_cluster_duration > 0)
-    muxer_segment.set_max_cluster_duration(max_cluster_duration);
-  if (max_cluster_size > 0)
-    muxer_segment.set_max_cluster_size(max_cluster_size);
-  muxer_segment.OutputCues(output_cues);
+  if (options.chunking)
+    muxer_segment.SetChunking(true, options.chunk_name);
+
+  if (options.max_cluster_duration > 0)
+    muxer_segment.set_max_cluster_duration(options.max_cluster_duration);
+  if (options.max_cluster_size > 0)
+    muxer_segment.set_max_cluster_size(options.max_cluster_size);
+  if (options.min_cluster_duration > 0 || options.min_cluster_size > 0 ||
+      options.cluster_lookahead > 0) {
+    mkvmuxer::ClusterPolicy policy;
+    policy.set_min_cluster_duration(options.min_cluster_duration);
+    policy.set_min_cluster_size(options.min_cluster_size);
+    policy.set_max_cluster_duration(options.max_cluster_duration);
+    policy.set_max_cluster_size(options.max_cluster_size);
+    policy.set_lookahead_frames(options.cluster_lookahead);
+    if (!muxer_segment.SetClusterPolicy(policy)) {
+      printf("\n Invalid cluster policy.\n");
+      return false;
+    }
+  }
+  muxer_segment.set_buffer_clusters(options.buffer_clusters);
+  if (options.max_cluster_buffer_size > 0)
+    muxer_segment.set_max_cluster_buffer_size(
+        options.max_cluster_buffer_size);
+  muxer_segment.set_max_audio_hold(options.max_audio_hold);
+  muxer_segment.set_record_latency(options.latency_stats);
+  muxer_segment.set_collect_statistics(options.muxer_stats);
+  muxer_segment.set_max_lace_duration(options.max_lace_duration);
+  muxer_segment.set_output_crc32(options.output_crc32);
+  muxer_segment.OutputCues(options.output_cues);
+
+  if (reserve_cues) {
+    const uint64 cue_interval =
+        static_cast<uint64>(options.reserve_cues_interval * 1000000000.0);
+    if (segment_info->GetDuration() <= 0 ||
+        !muxer_segment.ReserveCuesSpace(segment_info->GetDuration(),
+                                        cue_interval)) {
+      printf("\n Could not reserve space for the Cues.\n");
+      return false;
+    }
+  }
 
   // Set SegmentInfo element attributes
   mkvmuxer::SegmentInfo* const info = muxer_segment.GetSegmentInfo();
@@ -308,7 +530,7 @@ int main(int argc, char* argv[]) {
 
   while (i != parser_tracks->GetTracksCount()) {
     int track_num = i++;
-    if (switch_tracks)
+    if (options.switch_tracks)
       track_num = i % parser_tracks->GetTracksCount();
 
     const mkvparser::Track* const parser_track =
@@ -322,7 +544,7 @@ int main(int argc, char* argv[]) {
 
     const long long track_type = parser_track->GetType();
 
-    if (track_type == Track::kVideo && output_video) {
+    if (track_type == Track::kVideo && options.output_video) {
       // Get the video track from the parser
       const mkvparser::VideoTrack* const pVideoTrack =
           static_cast<const mkvparser::VideoTrack*>(parser_track);
@@ -332,17 +554,17 @@ int main(int argc, char* argv[]) {
       // Add the video track to the muxer
       vid_track = muxer_segment.AddVideoTrack(static_cast<int>(width),
                                               static_cast<int>(height),
-                                              video_track_number);
+                                              options.video_track_number);
       if (!vid_track) {
         printf("\n Could not add video track.\n");
-        return EXIT_FAILURE;
+        return false;
       }
 
       mkvmuxer::VideoTrack* const video = static_cast<mkvmuxer::VideoTrack*>(
           muxer_segment.GetTrackByNumber(vid_track));
       if (!video) {
         printf("\n Could not get video track.\n");
-        return EXIT_FAILURE;
+        return false;
       }
 
       if (track_name)
@@ -350,18 +572,18 @@ int main(int argc, char* argv[]) {
 
       video->set_codec_id(pVideoTrack->GetCodecId());
 
-      if (display_width > 0)
-        video->set_display_width(display_width);
-      if (display_height > 0)
-        video->set_display_height(display_height);
-      if (stereo_mode > 0)
-        video->SetStereoMode(stereo_mode);
+      if (options.display_width > 0)
+        video->set_display_width(options.display_width);
+      if (options.display_height > 0)
+        video->set_display_height(options.display_height);
+      if (options.stereo_mode > 0)
+        video->SetStereoMode(options.stereo_mode);
 
       const double rate = pVideoTrack->GetFrameRate();
       if (rate > 0.0) {
         video->set_frame_rate(rate);
       }
-    } else if (track_type == Track::kAudio && output_audio) {
+    } else if (track_type == Track::kAudio && options.output_audio) {
       // Get the audio track from the parser
       const mkvparser::AudioTrack* const pAudioTrack =
           static_cast<const mkvparser::AudioTrack*>(parser_track);
@@ -371,17 +593,17 @@ int main(int argc, char* argv[]) {
       // Add the audio track to the muxer
       aud_track = muxer_segment.AddAudioTrack(static_cast<int>(sample_rate),
                                               static_cast<int>(channels),
-                                              audio_track_number);
+                                              options.audio_track_number);
       if (!aud_track) {
         printf("\n Could not add audio track.\n");
-        return EXIT_FAILURE;
+        return false;
       }
 
       mkvmuxer::AudioTrack* const audio = static_cast<mkvmuxer::AudioTrack*>(
           muxer_segment.GetTrackByNumber(aud_track));
       if (!audio) {
         printf("\n Could not get audio track.\n");
-        return EXIT_FAILURE;
+        return false;
       }
 
       if (track_name)
@@ -395,7 +617,7 @@ int main(int argc, char* argv[]) {
       if (private_size > 0) {
         if (!audio->SetCodecPrivate(private_data, private_size)) {
           printf("\n Could not add audio private data.\n");
-          return EXIT_FAILURE;
+          return false;
         }
       }
 
@@ -403,6 +625,9 @@ int main(int argc, char* argv[]) {
       if (bit_depth > 0)
         audio->set_bit_depth(bit_depth);
 
+      // Laced frames take their timestamps from the default duration.
+      if (pAudioTrack->GetDefaultDuration())
+        audio->set_default_duration(pAudioTrack->GetDefaultDuration());
       if (pAudioTrack->GetCodecDelay())
         audio->set_codec_delay(pAudioTrack->GetCodecDelay());
       if (pAudioTrack->GetSeekPreRoll())
@@ -410,6 +635,42 @@ int main(int argc, char* argv[]) {
     }
   }
 
+  if (encrypt) {
+    // The IVs must never repeat for a key, so start each output at a random
+    // IV.
+    std::random_device random;
+    const uint64 initial_iv = (static_cast<uint64>(random()) << 32) | random();
+    if (!encryption.Init(&options.encryption_key[0],
+                         options.encryption_key.size(), initial_iv) ||
+        !muxer_segment.SetFrameTransformThreads(options.encryption_threads)) {
+      printf("\n Could not set up encryption.\n");
+      return false;
+    }
+
+    const uint64 tracks[2] = {vid_track, aud_track};
+    for (int i = 0; i < 2; ++i) {
+      if (!tracks[i])
+        continue;
+      mkvmuxer::Track* const track = muxer_segment.GetTrackByNumber(tracks[i]);
+      if (!track || !track->AddContentEncoding()) {
+        printf("\n Could not add content encoding.\n");
+        return false;
+      }
+      mkvmuxer::ContentEncoding* const encoding =
+          track->GetContentEncodingByIndex(
+              track->content_encoding_entries_size() - 1);
+      if (!encoding ||
+          (!options.encryption_key_id.empty() &&
+           !encoding->SetEncryptionID(&options.encryption_key_id[0],
+                                      options.encryption_key_id.size())) ||
+          !muxer_segment.SetFrameTransform(tracks[i], &encryption)) {
+        printf("\n Could not set up encryption of track %llu.\n",
+               tracks[i]);
+        return false;
+      }
+    }
+  }
+
   // We have created all the video and audio tracks.  If any WebVTT
   // files were specified as command-line args, then parse them and
   // add a track to the output file corresponding to each metadata
@@ -419,27 +680,37 @@ int main(int argc, char* argv[]) {
 
   if (!metadata.Init(&muxer_segment)) {
     printf("\n Could not initialize metadata cache.\n");
-    return EXIT_FAILURE;
+    return false;
   }
 
-  if (!LoadMetadataFiles(metadata_files, &metadata))
-    return EXIT_FAILURE;
+  if (!LoadMetadataFiles(options.metadata_files, &metadata))
+    return false;
 
   if (!metadata.AddChapters())
-    return EXIT_FAILURE;
+    return false;
 
   // Set Cues element attributes
   mkvmuxer::Cues* const cues = muxer_segment.GetCues();
-  cues->set_output_block_number(output_cues_block_number);
-  if (cues_on_video_track && vid_track)
+  cues->set_output_block_number(options.output_cues_block_number);
+  if (options.cues_spill_threshold > 0 &&
+      !cues->SetSpillThreshold(options.cues_spill_threshold)) {
+    printf("\n Could not set the cues spill threshold.\n");
+    return false;
+  }
+  if (options.cues_on_video_track && vid_track)
     muxer_segment.CuesTrack(vid_track);
-  if (cues_on_audio_track && aud_track)
+  if (options.cues_on_audio_track && aud_track)
     muxer_segment.CuesTrack(aud_track);
+  if (options.audio_cues_interval >= 0 && aud_track) {
+    const uint64 interval =
+        static_cast<uint64>(options.audio_cues_interval * 1000000000.0);
+    if (!muxer_segment.AddCuesTrack(aud_track, interval)) {
+      printf("\n Could not add cues on the audio track.\n");
+      return false;
+    }
+  }
 
   // Write clusters
-  unsigned char* data = NULL;
-  int data_len = 0;
-
   const mkvparser::Cluster* cluster = parser_segment->GetFirst();
 
   while ((cluster != NULL) && !cluster->EOS()) {
@@ -447,9 +718,13 @@ int main(int argc, char* argv[]) {
 
     long status = cluster->GetFirst(block_entry);
 
-    if (status) {
+    if (status == mkvparser::E_CRC32_MISMATCH) {
+      printf("\n Cluster at %lld failed its CRC-32 check.\n",
+             cluster->m_element_start);
+      return false;
+    } else if (status) {
       printf("\n Could not get first block of cluster.\n");
-      return EXIT_FAILURE;
+      return false;
     }
 
     while ((block_entry != NULL) && !block_entry->EOS()) {
@@ -462,7 +737,7 @@ int main(int argc, char* argv[]) {
       // Block is invalid (i.e.) the was no TrackEntry corresponding to the
       // track number. So we reject the file.
       if (!parser_track) {
-        return EXIT_FAILURE;
+        return false;
       }
 
       const long long track_type = parser_track->GetType();
@@ -471,43 +746,54 @@ int main(int argc, char* argv[]) {
       // Flush any metadata frames to the output file, before we write
       // the current block.
       if (!metadata.Write(time_ns))
-        return EXIT_FAILURE;
+        return false;
 
-      if ((track_type == Track::kAudio && output_audio) ||
-          (track_type == Track::kVideo && output_video)) {
+      if ((track_type == Track::kAudio && options.output_audio) ||
+          (track_type == Track::kVideo && options.output_video)) {
         const int frame_count = block->GetFrameCount();
         const bool is_key = block->IsKey();
         const int64 discard_padding = block->GetDiscardPadding();
 
-        for (int i = 0; i < frame_count; ++i) {
-          const mkvparser::Block::Frame& frame = block->GetFrame(i);
-
-          if (frame.len > data_len) {
-            delete[] data;
-            data = new unsigned char[frame.len];
-            if (!data)
-              return EXIT_FAILURE;
-            data_len = frame.len;
+        // Passthrough writes SimpleBlocks and would drop the other children
+        // of a BlockGroup, so those blocks take the frame path.
+        if (options.passthrough && !encrypt &&
+            block_entry->GetKind() == mkvparser::BlockEntry::kBlockSimple) {
+          const uint64 track_num =
+              (track_type == Track::kAudio) ? aud_track : vid_track;
+          if (!muxer_segment.AddBlockPassthrough(&reader, *block, track_num,
+                                                 time_ns)) {
+            printf("\n Could not add block.\n");
+            return false;
           }
+          stats->frames += frame_count;
+        } else {
+          for (int i = 0; i < frame_count; ++i) {
+            const mkvparser::Block::Frame& frame = block->GetFrame(i);
 
-          if (frame.Read(&reader, data))
-            return EXIT_FAILURE;
-
-          uint64 track_num = vid_track;
-          if (track_type == Track::kAudio)
-            track_num = aud_track;
-
-          bool frame_added = false;
-          if (discard_padding) {
-            frame_added = muxer_segment.AddFrameWithDiscardPadding(
-                data, frame.len, discard_padding, track_num, time_ns, is_key);
-          } else {
-            frame_added = muxer_segment.AddFrame(data, frame.len, track_num,
-                                                 time_ns, is_key);
-          }
-          if (!frame_added) {
-            printf("\n Could not add frame.\n");
-            return EXIT_FAILURE;
+            unsigned char* const data = buffer->Reserve(frame.len);
+            if (!data)
+              return false;
+
+            if (frame.Read(&reader, data))
+              return false;
+
+            uint64 track_num = vid_track;
+            if (track_type == Track::kAudio)
+              track_num = aud_track;
+
+            bool frame_added = false;
+            if (discard_padding) {
+              frame_added = muxer_segment.AddFrameWithDiscardPadding(
+                  data, frame.len, discard_padding, track_num, time_ns, is_key);
+            } else {
+              frame_added = muxer_segment.AddFrame(data, frame.len, track_num,
+                                                   time_ns, is_key);
+            }
+            if (!frame_added) {
+              printf("\n Could not add frame.\n");
+              return false;
+            }
+            ++stats->frames;
           }
         }
       }
@@ -516,7 +802,7 @@ int main(int argc, char* argv[]) {
 
       if (status) {
         printf("\n Could not get next block of cluster.\n");
-        return EXIT_FAILURE;
+        return false;
       }
     }
 
@@ -526,36 +812,396 @@ int main(int argc, char* argv[]) {
   // We have exhausted all video and audio frames in the input file.
   // Flush any remaining metadata frames to the output file.
   if (!metadata.Write(-1))
-    return EXIT_FAILURE;
+    return false;
 
   if (!muxer_segment.Finalize()) {
     printf("Finalization of segment failed.\n");
-    return EXIT_FAILURE;
+    return false;
+  }
+
+  if (options.async_io && !async_writer.Close()) {
+    printf("\n Could not write the output.\n");
+    return false;
+  }
+
+  if (options.latency_stats) {
+    const mkvmuxer::LatencyHistogram& latency =
+        muxer_segment.latency_histogram();
+    if (latency.count() > 0) {
+      printf("Frame latency (us): mean %.1f p50 <%.1f p99 <%.1f max %.1f\n",
+             latency.total_ns() / 1000.0 / latency.count(),
+             latency.Percentile(50.0) / 1000.0,
+             latency.Percentile(99.0) / 1000.0, latency.max_ns() / 1000.0);
+    }
   }
 
+  if (options.muxer_stats)
+    PrintMuxerStatistics(muxer_segment.statistics());
+
+  stats->bytes_out = writer.Position();
   reader.Close();
   writer.Close();
 
-  if (cues_before_clusters) {
-    if (reader.Open(temp_file)) {
+  if (options.cues_before_clusters &&
+      muxer_segment.cues_position() != mkvmuxer::Segment::kBeforeClusters) {
+    if (reserve_cues) {
+      // The Cues did not fit in the reserved space; fall back to copying.
+      if (rename(output, temp_file.c_str())) {
+        printf("\n Unable to rename the output file.\n");
+        return false;
+      }
+    }
+    if (reader.Open(temp_file.c_str())) {
       printf("\n Filename is invalid or error while opening.\n");
-      return EXIT_FAILURE;
+      return false;
     }
     if (!writer.Open(output)) {
       printf("\n Filename is invalid or error while opening.\n");
-      return EXIT_FAILURE;
+      return false;
     }
+    if (options.preallocate && input_size > 0)
+      writer.Preallocate(input_size);
     if (!muxer_segment.CopyAndMoveCuesBeforeClusters(&reader, &writer)) {
       printf("\n Unable to copy and move cues before clusters.\n");
-      return EXIT_FAILURE;
+      return false;
     }
+    stats->bytes_out = writer.Position();
     reader.Close();
     writer.Close();
-    remove(temp_file);
+    remove(temp_file.c_str());
+  }
+
+  stats->seconds = (mkvmuxer::GetMonotonicTimeNs() - start_ns) / 1e9;
+  return true;
+}
+
+// One input and output pair of a batch.
+struct BatchJob {
+  BatchJob() : ok(false) {}
+
+  std::string input;
+  std::string output;
+  bool ok;
+  MuxStats stats;
+};
+
+// Reads the jobs of a batch from |list|. Each non-empty line holds an input
+// and an output file name separated by white space; lines starting with '#'
+// are ignored. Returns false if the list could not be read or a line is
+// missing the output.
+bool LoadBatchList(const char* list, std::vector<BatchJob>* jobs) {
+  std::ifstream file(list);
+  if (!file) {
+    printf("\n Could not open batch list %s.\n", list);
+    return false;
+  }
+
+  std::string line;
+  int line_number = 0;
+  while (std::getline(file, line)) {
+    ++line_number;
+    std::istringstream fields(line);
+    BatchJob job;
+    if (!(fields >> job.input) || job.input[0] == '#')
+      continue;
+    if (!(fields >> job.output)) {
+      printf("\n Missing output on line %d of %s.\n", line_number, list);
+      return false;
+    }
+    jobs->push_back(job);
+  }
+  return true;
+}
+
+// Muxes the jobs of a batch on a pool of threads. The jobs are dealt out to
+// per-thread queues up front. A thread takes jobs from the front of its own
+// queue and, once that is empty, steals from the back of the others, so that
+// a few large inputs do not leave the remaining threads idle.
+class BatchRunner {
+ public:
+  BatchRunner(const MuxerOptions& options, std::vector<BatchJob>* jobs,
+              int num_threads);
+  ~BatchRunner();
+
+  // Runs every job and waits for them to finish. Returns the number of jobs
+  // that failed.
+  int Run();
+
+ private:
+  struct WorkQueue {
+    std::mutex mutex;
+    std::deque<size_t> jobs;
+  };
+
+  // Muxes jobs until every queue is empty.
+  void Worker(int index);
+
+  // Takes the next job for thread |index| and stores its index in |job|.
+  // Returns false when no job is left.
+  bool NextJob(int index, size_t* job);
+
+  const MuxerOptions& options_;
+  std::vector<BatchJob>* const jobs_;
+  const int num_threads_;
+  WorkQueue* const queues_;
+};
+
+BatchRunner::BatchRunner(const MuxerOptions& options,
+                         std::vector<BatchJob>* jobs, int num_threads)
+    : options_(options),
+      jobs_(jobs),
+      num_threads_(num_threads),
+      queues_(new WorkQueue[num_threads]) {
+  for (size_t i = 0; i < jobs_->size(); ++i)
+    queues_[i % num_threads_].jobs.push_back(i);
+}
+
+BatchRunner::~BatchRunner() { delete[] queues_; }
+
+int BatchRunner::Run() {
+  std::vector<std::thread> threads;
+  for (int i = 0; i < num_threads_; ++i)
+    threads.push_back(std::thread(&BatchRunner::Worker, this, i));
+  for (size_t i = 0; i < threads.size(); ++i)
+    threads[i].join();
+
+  int failed = 0;
+  for (size_t i = 0; i < jobs_->size(); ++i) {
+    if (!(*jobs_)[i].ok)
+      ++failed;
+  }
+  return failed;
+}
+
+void BatchRunner::Worker(int index) {
+  FrameBuffer buffer;
+  size_t job_index;
+  while (NextJob(index, &job_index)) {
+    BatchJob& job = (*jobs_)[job_index];
+    MuxerOptions options = options_;
+    if (options.chunking)
+      options.chunk_name = job.output.c_str();
+    job.ok = MuxFile(options, job.input.c_str(), job.output.c_str(), &buffer,
+                     &job.stats);
+  }
+}
+
+bool BatchRunner::NextJob(int index, size_t* job) {
+  for (int i = 0; i < num_threads_; ++i) {
+    WorkQueue& queue = queues_[(index + i) % num_threads_];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (queue.jobs.empty())
+      continue;
+
+    if (i == 0) {
+      *job = queue.jobs.front();
+      queue.jobs.pop_front();
+    } else {
+      *job = queue.jobs.back();
+      queue.jobs.pop_back();
+    }
+    return true;
+  }
+  return false;
+}
+
+// Prints the throughput of each job of a batch and of the whole batch, which
+// took |seconds| of wall time.
+void PrintBatchSummary(const std::vector<BatchJob>& jobs, double seconds) {
+  uint64 frames = 0;
+  uint64 bytes_in = 0;
+  for (size_t i = 0; i < jobs.size(); ++i) {
+    const BatchJob& job = jobs[i];
+    if (!job.ok) {
+      printf("%s -> %s: failed\n", job.input.c_str(), job.output.c_str());
+      continue;
+    }
+
+    const MuxStats& stats = job.stats;
+    const double job_seconds = stats.seconds > 0.0 ? stats.seconds : 1e-9;
+    printf("%s -> %s: %llu frames, %llu -> %llu bytes, %.3f s, %.1f MB/s, "
+           "%.0f frames/s\n",
+           job.input.c_str(), job.output.c_str(),
+           static_cast<unsigned long long>(stats.frames),
+           static_cast<unsigned long long>(stats.bytes_in),
+           static_cast<unsigned long long>(stats.bytes_out), stats.seconds,
+           stats.bytes_in / job_seconds / 1e6, stats.frames / job_seconds);
+    frames += stats.frames;
+    bytes_in += stats.bytes_in;
   }
 
-  delete[] data;
-  delete parser_segment;
+  if (seconds <= 0.0)
+    seconds = 1e-9;
+  printf("Batch: %u files, %llu frames, %.3f s, %.1f MB/s, %.0f frames/s\n",
+         static_cast<unsigned>(jobs.size()),
+         static_cast<unsigned long long>(frames), seconds,
+         bytes_in / seconds / 1e6, frames / seconds);
+}
+
+}  // end namespace
+
+int main(int argc, char* argv[]) {
+  char* input = NULL;
+  char* output = NULL;
+  const char* batch_list = NULL;
+  int num_jobs = 0;
+
+  MuxerOptions options;
+
+  const int argc_check = argc - 1;
+  for (int i = 1; i < argc; ++i) {
+    char* end;
+
+    if (!strcmp("-h", argv[i]) || !strcmp("-?", argv[i])) {
+      Usage();
+      return EXIT_SUCCESS;
+    } else if (!strcmp("-i", argv[i]) && i < argc_check) {
+      input = argv[++i];
+    } else if (!strcmp("-o", argv[i]) && i < argc_check) {
+      output = argv[++i];
+    } else if (!strcmp("-batch", argv[i]) && i < argc_check) {
+      batch_list = argv[++i];
+    } else if (!strcmp("-jobs", argv[i]) && i < argc_check) {
+      num_jobs = strtol(argv[++i], &end, 10);
+    } else if (!strcmp("-video", argv[i]) && i < argc_check) {
+      options.output_video = strtol(argv[++i], &end, 10) == 0 ? false : true;
+    } else if (!strcmp("-audio", argv[i]) && i < argc_check) {
+      options.output_audio = strtol(argv[++i], &end, 10) == 0 ? false : true;
+    } else if (!strcmp("-live", argv[i]) && i < argc_check) {
+      options.live_mode = strtol(argv[++i], &end, 10) == 0 ? false : true;
+    } else if (!strcmp("-output_cues", argv[i]) && i < argc_check) {
+      options.output_cues = strtol(argv[++i], &end, 10) == 0 ? false : true;
+    } else if (!strcmp("-cues_before_clusters", argv[i]) && i < argc_check) {
+      options.cues_before_clusters =
+          strtol(argv[++i], &end, 10) == 0 ? false : true;
+    } else if (!strcmp("-reserve_cues_interval", argv[i]) && i < argc_check) {
+      options.reserve_cues_interval = strtod(argv[++i], &end);
+    } else if (!strcmp("-cues_spill_threshold", argv[i]) && i < argc_check) {
+      options.cues_spill_threshold = strtol(argv[++i], &end, 10);
+    } else if (!strcmp("-audio_cues_interval", argv[i]) && i < argc_check) {
+      options.audio_cues_interval = strtod(argv[++i], &end);
+    } else if (!strcmp("-cues_on_video_track", argv[i]) && i < argc_check) {
+      options.cues_on_video_track =
+          strtol(argv[++i], &end, 10) == 0 ? false : true;
+      if (options.cues_on_video_track)
+        options.cues_on_audio_track = false;
+    } else if (!strcmp("-cues_on_audio_track", argv[i]) && i < argc_check) {
+      options.cues_on_audio_track =
+          strtol(argv[++i], &end, 10) == 0 ? false : true;
+      if (options.cues_on_audio_track)
+        options.cues_on_video_track = false;
+    } else if (!strcmp("-max_cluster_duration", argv[i]) && i < argc_check) {
+      const double seconds = strtod(argv[++i], &end);
+      options.max_cluster_duration =
+          static_cast<uint64>(seconds * 1000000000.0);
+    } else if (!strcmp("-max_cluster_size", argv[i]) && i < argc_check) {
+      options.max_cluster_size = strtol(argv[++i], &end, 10);
+    } else if (!strcmp("-min_cluster_duration", argv[i]) && i < argc_check) {
+      const double seconds = strtod(argv[++i], &end);
+      options.min_cluster_duration =
+          static_cast<uint64>(seconds * 1000000000.0);
+    } else if (!strcmp("-min_cluster_size", argv[i]) && i < argc_check) {
+      options.min_cluster_size = strtol(argv[++i], &end, 10);
+    } else if (!strcmp("-cluster_lookahead", argv[i]) && i < argc_check) {
+      options.cluster_lookahead = strtol(argv[++i], &end, 10);
+    } else if (!strcmp("-switch_tracks", argv[i]) && i < argc_check) {
+      options.switch_tracks = strtol(argv[++i], &end, 10) == 0 ? false : true;
+    } else if (!strcmp("-audio_track_number", argv[i]) && i < argc_check) {
+      options.audio_track_number = strtol(argv[++i], &end, 10);
+    } else if (!strcmp("-video_track_number", argv[i]) && i < argc_check) {
+      options.video_track_number = strtol(argv[++i], &end, 10);
+    } else if (!strcmp("-chunking", argv[i]) && i < argc_check) {
+      options.chunking = true;
+      options.chunk_name = argv[++i];
+    } else if (!strcmp("-buffer_clusters", argv[i]) && i < argc_check) {
+      options.buffer_clusters = strtol(argv[++i], &end, 10) == 0 ? false : true;
+    } else if (!strcmp("-max_cluster_buffer_size", argv[i]) &&
+               i < argc_check) {
+      options.max_cluster_buffer_size = strtol(argv[++i], &end, 10);
+    } else if (!strcmp("-async_io", argv[i]) && i < argc_check) {
+      options.async_io = strtol(argv[++i], &end, 10) == 0 ? false : true;
+    } else if (!strcmp("-preallocate", argv[i]) && i < argc_check) {
+      options.preallocate = strtol(argv[++i], &end, 10) == 0 ? false : true;
+    } else if (!strcmp("-writeback_interval", argv[i]) && i < argc_check) {
+      options.writeback_interval = strtol(argv[++i], &end, 10);
+    } else if (!strcmp("-max_audio_hold", argv[i]) && i < argc_check) {
+      const double seconds = strtod(argv[++i], &end);
+      options.max_audio_hold = static_cast<uint64>(seconds * 1000000000.0);
+    } else if (!strcmp("-latency_stats", argv[i]) && i < argc_check) {
+      options.latency_stats = strtol(argv[++i], &end, 10) == 0 ? false : true;
+    } else if (!strcmp("-muxer_stats", argv[i]) && i < argc_check) {
+      options.muxer_stats = strtol(argv[++i], &end, 10) == 0 ? false : true;
+    } else if (!strcmp("-max_lace_duration", argv[i]) && i < argc_check) {
+      const double seconds = strtod(argv[++i], &end);
+      options.max_lace_duration = static_cast<uint64>(seconds * 1000000000.0);
+    } else if (!strcmp("-passthrough", argv[i]) && i < argc_check) {
+      options.passthrough = strtol(argv[++i], &end, 10) == 0 ? false : true;
+    } else if (!strcmp("-output_crc32", argv[i]) && i < argc_check) {
+      options.output_crc32 = strtol(argv[++i], &end, 10) == 0 ? false : true;
+    } else if (!strcmp("-verify_crc32", argv[i]) && i < argc_check) {
+      options.verify_crc32 = strtol(argv[++i], &end, 10) == 0 ? false : true;
+    } else if (!strcmp("-encryption_key", argv[i]) && i < argc_check) {
+      if (!ParseHex(argv[++i], &options.encryption_key)) {
+        printf("\n Invalid encryption key %s.\n", argv[i]);
+        return EXIT_FAILURE;
+      }
+    } else if (!strcmp("-encryption_key_id", argv[i]) && i < argc_check) {
+      if (!ParseHex(argv[++i], &options.encryption_key_id)) {
+        printf("\n Invalid encryption key id %s.\n", argv[i]);
+        return EXIT_FAILURE;
+      }
+    } else if (!strcmp("-encryption_threads", argv[i]) && i < argc_check) {
+      options.encryption_threads = strtol(argv[++i], &end, 10);
+    } else if (!strcmp("-display_width", argv[i]) && i < argc_check) {
+      options.display_width = strtol(argv[++i], &end, 10);
+    } else if (!strcmp("-display_height", argv[i]) && i < argc_check) {
+      options.display_height = strtol(argv[++i], &end, 10);
+    } else if (!strcmp("-stereo_mode", argv[i]) && i < argc_check) {
+      options.stereo_mode = strtol(argv[++i], &end, 10);
+    } else if (!strcmp("-output_cues_block_number", argv[i]) &&
+               i < argc_check) {
+      options.output_cues_block_number =
+          strtol(argv[++i], &end, 10) == 0 ? false : true;
+    } else if (int e = ParseArgWebVTT(argv, &i, argc_check,
+                                      &options.metadata_files)) {
+      if (e < 0)
+        return EXIT_FAILURE;
+    }
+  }
+
+  // WebM requires a ContentEncKeyID for encrypted tracks.
+  if (!options.encryption_key.empty() && options.encryption_key_id.empty()) {
+    printf("\n -encryption_key requires -encryption_key_id.\n");
+    return EXIT_FAILURE;
+  }
+
+  if (batch_list != NULL) {
+    std::vector<BatchJob> jobs;
+    if (!LoadBatchList(batch_list, &jobs))
+      return EXIT_FAILURE;
+
+    if (num_jobs <= 0)
+      num_jobs = std::thread::hardware_concurrency();
+    if (num_jobs > static_cast<int>(jobs.size()))
+      num_jobs = static_cast<int>(jobs.size());
+    if (num_jobs <= 0)
+      num_jobs = 1;
+
+    const uint64 start_ns = mkvmuxer::GetMonotonicTimeNs();
+    BatchRunner runner(options, &jobs, num_jobs);
+    const int failed = runner.Run();
+    PrintBatchSummary(jobs,
+                      (mkvmuxer::GetMonotonicTimeNs() - start_ns) / 1e9);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+  }
+
+  if (input == NULL || output == NULL) {
+    Usage();
+    return EXIT_FAILURE;
+  }
 
-  return EXIT_SUCCESS;
+  FrameBuffer buffer;
+  MuxStats stats;
+  return MuxFile(options, input, output, &buffer, &stats) ? EXIT_SUCCESS
+                                                          : EXIT_FAILURE;
 }
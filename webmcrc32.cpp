@@ -0,0 +1,84 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+
+#include "webmcrc32.hpp"
+
+namespace libwebm {
+
+namespace {
+
+// Bit-reflected form of the CRC-32 polynomial.
+const unsigned int kPolynomial = 0xEDB88320U;
+
+// Lookup tables for the slice-by-8 algorithm. |table[0]| is the classic
+// byte-at-a-time table; |table[k]| advances a byte through k more zero bytes,
+// so that eight input bytes are folded into the CRC with eight independent
+// lookups per iteration.
+struct Crc32Tables {
+  Crc32Tables() {
+    for (unsigned int i = 0; i < 256; ++i) {
+      unsigned int crc = i;
+      for (int bit = 0; bit < 8; ++bit)
+        crc = (crc & 1) ? (crc >> 1) ^ kPolynomial : crc >> 1;
+      table[0][i] = crc;
+    }
+
+    for (unsigned int i = 0; i < 256; ++i) {
+      for (int k = 1; k < 8; ++k) {
+        const unsigned int prev = table[k - 1][i];
+        table[k][i] = (prev >> 8) ^ table[0][prev & 0xFF];
+      }
+    }
+  }
+
+  unsigned int table[8][256];
+};
+
+const Crc32Tables& GetTables() {
+  static const Crc32Tables tables;
+  return tables;
+}
+
+// Loads four bytes in little-endian order. Compilers turn this into a single
+// load on little-endian targets.
+inline unsigned int LoadLittleEndian32(const unsigned char* data) {
+  return static_cast<unsigned int>(data[0]) |
+         (static_cast<unsigned int>(data[1]) << 8) |
+         (static_cast<unsigned int>(data[2]) << 16) |
+         (static_cast<unsigned int>(data[3]) << 24);
+}
+
+}  // namespace
+
+unsigned int Crc32(unsigned int crc, const unsigned char* data,
+                   size_t length) {
+  if (data == NULL || length == 0)
+    return crc;
+
+  const unsigned int(*const table)[256] = GetTables().table;
+
+  crc = ~crc;
+
+  while (length >= 8) {
+    const unsigned int low = LoadLittleEndian32(data) ^ crc;
+    const unsigned int high = LoadLittleEndian32(data + 4);
+    crc = table[7][low & 0xFF] ^ table[6][(low >> 8) & 0xFF] ^
+          table[5][(low >> 16) & 0xFF] ^ table[4][low >> 24] ^
+          table[3][high & 0xFF] ^ table[2][(high >> 8) & 0xFF] ^
+          table[1][(high >> 16) & 0xFF] ^ table[0][high >> 24];
+    data += 8;
+    length -= 8;
+  }
+
+  while (length-- > 0)
+    crc = table[0][(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+
+  return ~crc;
+}
+
+}  // namespace libwebm
@@ -0,0 +1,25 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+
+#ifndef WEBMCRC32_HPP
+#define WEBMCRC32_HPP
+
+#include <stddef.h>
+
+namespace libwebm {
+
+// Returns the CRC-32 of |length| bytes at |data| appended to data whose
+// CRC-32 is |crc|. Pass 0 as |crc| to start a new checksum. This is the
+// CRC-32 used by EBML CRC-32 elements (ISO 3309, polynomial 0x04C11DB7,
+// bit-reflected), which is also the one used by zlib. The checksum is stored
+// in EBML elements in little-endian byte order.
+unsigned int Crc32(unsigned int crc, const unsigned char* data, size_t length);
+
+}  // namespace libwebm
+
+#endif  // WEBMCRC32_HPP
@@ -21,6 +21,7 @@ enum MkvId {
   kMkvDocTypeVersion = 0x4287,
   kMkvDocTypeReadVersion = 0x4285,
   kMkvVoid = 0xEC,
+  kMkvCRC32 = 0xBF,
   kMkvSignatureSlot = 0x1B538667,
   kMkvSignatureAlgo = 0x7E8A,
   kMkvSignatureHash = 0x7E9A,